@@ -0,0 +1,108 @@
+#include "hamt.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Batched against one-at-a-time lookups in a HAMT larger than the LLC
+ *
+ *      ./batch_bench [keys] [lookups] [batch size]
+ *
+ * Keys are random ints with an identity hash, so consecutive lookups touch
+ * unrelated paths and nearly every level below the top misses in cache.
+ */
+
+int hash_int_ref(const void * num)
+{
+        return *(const int *)num;
+}
+
+static unsigned int next_rand(unsigned int * x)
+{
+        *x ^= *x << 13;
+        *x ^= *x >> 17;
+        *x ^= *x << 5;
+        return *x;
+}
+
+double seconds(struct timespec * start)
+{
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        return (end.tv_sec - start->tv_sec) +
+                (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char ** argv)
+{
+        int n = argc > 1 ? atoi(argv[1]) : 1 << 23;
+        int lookups = argc > 2 ? atoi(argv[2]) : 1 << 22;
+        int batch = argc > 3 ? atoi(argv[3]) : 64;
+
+        struct hamtinfo info = {
+                .key_size = sizeof(int),
+                .elem_size = sizeof(int),
+                .hash = hash_int_ref,
+        };
+        HAMT * h = init_hamt(&info);
+        assert(h);
+
+        int * keys = malloc(n * sizeof(*keys));
+        int * probe = malloc(lookups * sizeof(*probe));
+        int * out = malloc(batch * sizeof(*out));
+        void ** kp = malloc(batch * sizeof(*kp));
+        void ** bp = malloc(batch * sizeof(*bp));
+        assert(keys && probe && out && kp && bp);
+
+        unsigned int x = 2463534242u;
+        for (int i = 0; i < n; ++i) {
+                keys[i] = (int)next_rand(&x);
+                insert_hamt(h, &keys[i], &i);
+        }
+        /* Three hits for every miss */
+        for (int i = 0; i < lookups; ++i) {
+                unsigned int r = next_rand(&x);
+                probe[i] = r & 3 ? keys[r % n] : (int)next_rand(&x);
+        }
+
+        struct hamtstats st;
+        stats_hamt(h, &st);
+        printf("%u keys, %lu MiB of trie, %d lookups, batches of %d\n",
+                        size_hamt(h), st.bytes >> 20, lookups, batch);
+
+        struct timespec start;
+        long hits = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < lookups; ++i) {
+                int v;
+                hits += find_hamt(h, &probe[i], (void**)&v);
+        }
+        double single = seconds(&start);
+
+        long batched_hits = 0;
+        for (int i = 0; i < batch; ++i)
+                bp[i] = &out[i];
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < lookups; i += batch) {
+                int m = lookups - i < batch ? lookups - i : batch;
+                for (int k = 0; k < m; ++k)
+                        kp[k] = &probe[i + k];
+                batched_hits += find_many_hamt(h, kp, m, bp, NULL);
+        }
+        double batched = seconds(&start);
+        assert(hits == batched_hits);
+
+        printf("find_hamt      %7.1f ns/lookup\n", single * 1e9 / lookups);
+        printf("find_many_hamt %7.1f ns/lookup  (%.2fx)\n",
+                        batched * 1e9 / lookups, single / batched);
+
+        free_hamt(h);
+        free(keys);
+        free(probe);
+        free(out);
+        free(kp);
+        free(bp);
+        exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,126 @@
+#include "hamt.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Throughput of a concurrent HAMT against a plain HAMT behind one mutex
+ *
+ *      ./ctrie_bench [max threads] [ops per thread] [preloaded keys]
+ *
+ * Every thread runs 90% finds, 5% inserts and 5% removes over keys drawn
+ * uniformly from twice the preloaded range.
+ */
+
+struct bench_arg {
+        HAMT * h;
+        pthread_mutex_t * lock;         /* NULL for the concurrent HAMT */
+        unsigned int seed;
+        long ops;
+        int range;
+};
+
+int hash_int_ref(const void * num)
+{
+        return *(const int *)num;
+}
+
+static unsigned int next_rand(unsigned int * x)
+{
+        *x ^= *x << 13;
+        *x ^= *x >> 17;
+        *x ^= *x << 5;
+        return *x;
+}
+
+void * bench_worker(void * p)
+{
+        struct bench_arg * a = (struct bench_arg *)p;
+        unsigned int x = a->seed;
+        for (long i = 0; i < a->ops; ++i) {
+                unsigned int r = next_rand(&x);
+                int key = (r >> 8) % a->range;
+                int op = r & 0xff;
+                int v;
+
+                if (a->lock)
+                        pthread_mutex_lock(a->lock);
+                if (op < 230)
+                        find_hamt(a->h, &key, (void**)&v);
+                else if (op < 243)
+                        insert_hamt(a->h, &key, &key);
+                else
+                        remove_hamt(a->h, &key, NULL);
+                if (a->lock)
+                        pthread_mutex_unlock(a->lock);
+        }
+        return NULL;
+}
+
+double run_bench(HAMT * h, pthread_mutex_t * lock, int nthreads, long ops,
+                int range)
+{
+        pthread_t * threads = malloc(nthreads * sizeof(*threads));
+        struct bench_arg * args = malloc(nthreads * sizeof(*args));
+        assert(threads && args);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int t = 0; t < nthreads; ++t) {
+                args[t] = (struct bench_arg){ h, lock, 2463534242u + t, ops,
+                        range };
+                int rv = pthread_create(&threads[t], NULL, bench_worker,
+                                &args[t]);
+                assert(rv == 0);
+        }
+        for (int t = 0; t < nthreads; ++t)
+                pthread_join(threads[t], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        free(threads);
+        free(args);
+        double secs = (end.tv_sec - start.tv_sec) +
+                (end.tv_nsec - start.tv_nsec) / 1e9;
+        return nthreads * ops / secs / 1e6;
+}
+
+HAMT * preload(HAMT * h, int n)
+{
+        assert(h);
+        for (int i = 0; i < n; ++i)
+                insert_hamt(h, &i, &i);
+        return h;
+}
+
+int main(int argc, char ** argv)
+{
+        int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+        long ops = argc > 2 ? atol(argv[2]) : 1000000;
+        int n = argc > 3 ? atoi(argv[3]) : 1 << 20;
+
+        struct hamtinfo info = {
+                .key_size = sizeof(int),
+                .elem_size = sizeof(int),
+                .hash = hash_int_ref,
+        };
+
+        printf("%d keys, %ld ops/thread, 90%% find 5%% insert 5%% remove\n",
+                        n, ops);
+        printf("threads  concurrent Mops/s  mutex Mops/s\n");
+        for (int t = 1; t <= max_threads; t *= 2) {
+                HAMT * h = preload(init_concurrent_hamt(&info), n);
+                double conc = run_bench(h, NULL, t, ops, 2 * n);
+                free_hamt(h);
+
+                pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+                h = preload(init_hamt(&info), n);
+                double locked = run_bench(h, &lock, t, ops, 2 * n);
+                free_hamt(h);
+
+                printf("%7d  %17.2f  %12.2f\n", t, conc, locked);
+        }
+        exit(EXIT_SUCCESS);
+}
@@ -1,6 +1,7 @@
 #include "hamt.h"
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -8,79 +9,292 @@
 
 #define HAMT_VALID 0x815842
 #define valid_hamt(t) ((t)->valid == HAMT_VALID)
-#define HAMT_MAX_LEVEL 5
+/* Levels of 5 bits (the last one 2 bits) consumed from one 32-bit hash */
+#define HAMT_GEN_LEVELS 7
+/* Hashes (the primary one plus seeded rehashes) tried before chaining */
+#define HAMT_MAX_GEN 4
+#define HAMT_MAX_LEVEL (HAMT_GEN_LEVELS * HAMT_MAX_GEN)
 #define HAMT_CREATE 1
 #define HAMT_NOCREATE 0
 
 /* For removing values */
 #define HAMT_NOREMOVE 0
-#define HAMT_REMOVECLEAR 1
-#define HAMT_REMOVENOCLEAR 2
+#define HAMT_REMOVECLEAR 1      /* Removed; the subtrie/list is now empty */
+#define HAMT_REMOVENOCLEAR 2    /* Removed; the subtrie/list stays */
+#define HAMT_REMOVECOLLAPSE 3   /* Removed; the subtrie is down to one list */
 
 #define HAMT_MASK32 0xffffffff
 
-#define find_logical_index(hash, depth) ((hash >> ((depth) * 5)) & 0x01f)
+/* Keys looked up together by find_many_hamt/insert_many_hamt */
+#define HAMT_BATCH 16
+
+/* 'bits' is the hash of the generation 'depth' belongs to */
+#define find_logical_index(bits, depth) \
+        (((bits) >> (((depth) % HAMT_GEN_LEVELS) * 5)) & 0x01f)
+#define starts_hamt_gen(depth) ((depth) % HAMT_GEN_LEVELS == 0)
+/* Position of a logical child in the compressed children array */
+#define find_physical_index(bitfield, logical) \
+        __builtin_popcount((bitfield) & ((1u << (logical)) - 1))
+#define hamt_node_size(nchildren) \
+        (sizeof(hamt_n) + (nchildren) * sizeof(union hamt_slot))
 
 #define HAMT_ARRAY_ADD 1
 #define HAMT_ARRAY_REMOVE 2
 
+/* Inline keys/values are padded so the value that follows stays aligned */
+#define HAMT_INLINE_ALIGN(n) (((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+#define inline_keys(s) ((s)->info.copy_key == NULL)
+#define inline_elems(s) ((s)->info.copy_elem == NULL)
+
+/*
+ * Arena size classes: blocks are rounded up to HAMT_ARENA_GRAIN bytes and
+ * pooled per size up to HAMT_ARENA_MAX (every node size, and the list size
+ * of most hamtinfos).  Larger list nodes get the one extra class.
+ */
+#define HAMT_ARENA_GRAIN 16
+#define HAMT_ARENA_MAX 512
+#define HAMT_ARENA_CLASSES (HAMT_ARENA_MAX / HAMT_ARENA_GRAIN + 1)
+#define HAMT_ARENA_FIRST_CHUNK 1024
+#define HAMT_ARENA_MAX_CHUNK (64 * 1024)
+
+/* Main node kinds of a concurrent HAMT (see init_concurrent_hamt) */
+#define CTRIE_CNODE 0
+#define CTRIE_TNODE 1
+#define CTRIE_LNODE 2
+#define concurrent_hamt(s) ((s)->croot != NULL)
+
+/* Nodes may be shared with a snapshot while another handle holds the arena */
+#define shared_hamt(s) ((s)->arena != NULL && \
+                __atomic_load_n(&(s)->arena->handles, __ATOMIC_ACQUIRE) > 1)
+
+/*
+ * In fixed-size mode (copy_key/copy_elem == NULL) the key and/or value bytes
+ * are stored directly after the list node, and key/value point at them.
+ * Entries sharing every hash bit the trie consumes are chained through next.
+ * 'hash' is the primary hash; rehashes are recomputed on the rare descents
+ * past the first HAMT_GEN_LEVELS levels.
+ * 'refs' counts the slots pointing at a list head (snapshots share lists);
+ * the rest of a list is owned by its head.
+ */
 struct hamt_list {
         void * key;
         void * value;
         struct hamt_list * next;
+        uint32_t hash;
+        uint32_t refs;
 };
 
 typedef struct hamt_node hamt_n;
+
+/*
+ * A child slot holds either a subtrie or, while no other key shares its
+ * hash prefix, the entry list itself (see entrymap)
+ */
+union hamt_slot {
+        struct hamt_node * node;
+        struct hamt_list * list;
+};
+
 struct hamt_node {
-        struct hamt_list * values;
-        uint32_t size;
-        uint32_t bitfield;
-        struct hamt_node * children[32];
+        uint32_t bitfield;              /* Occupied logical slots */
+        uint32_t entrymap;              /* Occupied slots holding a list */
+        uint32_t refs;                  /* Parents/handles sharing the node */
+        uint32_t cap;                   /* Slots allocated (>= popcount) */
+        union hamt_slot children[];     /* popcount(bitfield) entries */
+};
+
+/*
+ * Per-HAMT slab arena for nodes and list entries.  Blocks come from chunks
+ * that grow geometrically, freed blocks go on a free list per size class,
+ * and clearing the HAMT hands whole chunks back instead of walking the
+ * trie.  Snapshots share their origin's arena; while more than one handle
+ * uses it, it is locked.
+ */
+struct hamt_arena {
+        void * chunks;                  /* Chunks, linked by their 1st word */
+        char * cur;                     /* Unused tail of the newest chunk */
+        char * end;
+        size_t chunk_size;              /* Size of the next chunk */
+        size_t big_size;                /* Block size of the extra class */
+        void * free[HAMT_ARENA_CLASSES];
+        uint32_t handles;               /* HAMTs sharing the arena */
+        pthread_mutex_t lock;
 };
 
+struct ctrie_inode;
+struct hamt_epoch;
+
 typedef struct {
         struct hamtinfo info;
         hamt_n * root;
+        struct hamt_arena * arena;      /* NULL in concurrent mode */
+        struct ctrie_inode * croot;     /* Root in concurrent mode, else NULL */
+        struct hamt_epoch * epoch;      /* Reclamation state (concurrent) */
+        unsigned int size;
+        int max_level;          /* Levels available before keys must chain */
+        size_t list_size;       /* Bytes per list node, inline data included */
         int valid;
 } hamt_s;
 
-hamt_n * _create_hamt_node(void);
-int _insert_hamt_list(hamt_s * s, hamt_n * node, const void * key, const void * val);
-int _remove_hamt_list(hamt_s * s, hamt_n * node, const void * key, void ** buf);
-int _find_hamt_list(hamt_s * s, hamt_n * node, const void * key, void ** buf);
-struct hamt_list * _make_hamt_list_node(hamt_s * s, const void * key,
-                const void * val, struct hamt_list * next);
-hamt_n * __find_hamt(hamt_s * s, hamt_n * root, const int hash, const int depth);
-int _find_hamt(hamt_s * s, hamt_n * root, const int hash, 
-                const void * key, void ** buf);
-void _free_hamt_nodes(hamt_s * s, hamt_n * root);
-void _free_hamt_node(hamt_s * s, hamt_n * root);
-int _remove_hamt(hamt_s * s, hamt_n * root, const int hash, const int depth,
-                const void * key, void **buf);
+hamt_s * _new_hamt(struct hamtinfo * info, int concurrent);
+struct hamt_arena * _create_hamt_arena(size_t big_size);
+void * _hamt_arena_alloc(struct hamt_arena * a, size_t size);
+void _hamt_arena_free(struct hamt_arena * a, void * p, size_t size);
+void _reset_hamt_arena(struct hamt_arena * a);
+void _free_hamt_arena(struct hamt_arena * a);
+hamt_n * _create_hamt_node(hamt_s * s, int nchildren);
+void _free_hamt_node(hamt_s * s, hamt_n * node);
+hamt_n * _add_hamt_child(hamt_s * s, hamt_n * node, int logical_index,
+                union hamt_slot child, int is_list);
+void _remove_hamt_child(hamt_n * node, int logical_index);
+uint32_t _rehash_hamt(hamt_s * s, const void * key, int gen);
+int _find_split_depth(hamt_s * s, struct hamt_list * a, struct hamt_list * b,
+                int depth, int * path);
+hamt_n * _split_hamt_lists(hamt_s * s, struct hamt_list * a,
+                struct hamt_list * b, const int depth, const int split_depth,
+                const int * path);
+struct hamt_list * _find_hamt_list(hamt_s * s, struct hamt_list * it,
+                uint32_t hash, const void * key);
+int _remove_hamt_list(hamt_s * s, struct hamt_list ** listp, const void * key,
+                void ** buf);
+struct hamt_list * _make_hamt_list_node(hamt_s * s, uint32_t hash,
+                const void * key, const void * val, struct hamt_list * next);
+struct hamt_list * _find_hamt_entry(hamt_s * s, const void * key);
+void _find_hamt_batch(hamt_s * s, void * const * keys, int n,
+                uint32_t * hashes, struct hamt_list ** entries);
+hamt_n * _own_hamt_node(hamt_s * s, hamt_n ** nodep);
+struct hamt_list * _own_hamt_list(hamt_s * s, struct hamt_list ** listp);
+void _release_hamt_node(hamt_s * s, hamt_n * root);
+void _release_hamt_list(hamt_s * s, struct hamt_list * it);
+void _free_hamt_list(hamt_s * s, struct hamt_list * it);
+void _drop_hamt_data(hamt_s * s, hamt_n * root);
+int _remove_hamt(hamt_s * s, hamt_n ** rootp, const uint32_t hash,
+                uint32_t bits, const int depth, const void * key, void **buf);
+void _stats_hamt(hamt_s * s, hamt_n * root, int depth, struct hamtstats * st);
+static int _ctrie_insert_hamt(hamt_s * s, const void * key, const void * val);
+static int _ctrie_find_hamt(hamt_s * s, const void * key, void ** buf);
+static int _ctrie_remove_hamt(hamt_s * s, const void * key, void ** buf);
+static struct hamt_list * _ctrie_find(hamt_s * s, const void * key);
+static struct hamt_epoch_rec * _ctrie_enter(hamt_s * s);
+static void _ctrie_exit(struct hamt_epoch_rec * rec);
+static struct ctrie_inode * _ctrie_empty(void);
+static void _ctrie_free(hamt_s * s, struct ctrie_inode * i);
+static void _ctrie_free_epoch(hamt_s * s);
+static void _ctrie_stats(hamt_s * s, struct ctrie_inode * i, int depth,
+                struct hamtstats * st);
 
-HAMT * init_hamt(struct hamtinfo * info)
+/* Allocates 'size' bytes for a node or list entry of 's' */
+static inline void * _hamt_alloc(hamt_s * s, size_t size)
+{
+        if (s->arena == NULL)
+                return malloc(size);
+        return _hamt_arena_alloc(s->arena, size);
+}
+
+/* Releases a block of 'size' bytes from _hamt_alloc */
+static inline void _hamt_free(hamt_s * s, void * p, size_t size)
+{
+        if (s->arena == NULL)
+                free(p);
+        else
+                _hamt_arena_free(s->arena, p, size);
+}
+
+/* Compares a stored key against 'key'; inline keys default to memcmp */
+static inline int _cmp_hamt_key(hamt_s * s, const void * stored,
+                const void * key)
+{
+        if (s->info.cmp_key == NULL)
+                return memcmp(stored, key, s->info.key_size);
+        return s->info.cmp_key(stored, key);
+}
+
+/* Replaces the value held by 'it' with a copy of 'val' */
+static inline void _set_hamt_value(hamt_s * s, struct hamt_list * it,
+                const void * val)
+{
+        if (inline_elems(s)) {
+                memcpy(it->value, val, s->info.elem_size);
+        }
+        else {
+                s->info.free_elem(it->value);
+                it->value = s->info.copy_elem(val);
+        }
+}
+
+/* Hands a copy of the value held by 'it' to the caller's buffer */
+static inline void _get_hamt_value(hamt_s * s, struct hamt_list * it,
+                void ** buf)
+{
+        if (inline_elems(s))
+                memcpy(buf, it->value, s->info.elem_size);
+        else
+                *buf = s->info.copy_elem(it->value);
+}
+
+/* Releases the key/value held by 'it' and the list node itself */
+static inline void _free_hamt_list_node(hamt_s * s, struct hamt_list * it)
 {
-        if (info == NULL) {
+        if (!inline_keys(s))
+                s->info.free_key(it->key);
+        if (!inline_elems(s))
+                s->info.free_elem(it->value);
+        _hamt_free(s, it, s->list_size);
+}
+
+/* Allocates a HAMT handle, with an arena unless it is to be concurrent */
+hamt_s * _new_hamt(struct hamtinfo * info, int concurrent)
+{
+        if (info == NULL || info->hash == NULL ||
+                        (info->copy_key == NULL && info->key_size <= 0) ||
+                        (info->copy_elem == NULL && info->elem_size <= 0) ||
+                        (info->copy_key != NULL &&
+                         (info->free_key == NULL || info->cmp_key == NULL)) ||
+                        (info->copy_elem != NULL && info->free_elem == NULL)) {
                 errno = EINVAL;
                 return NULL;
         }
 
         hamt_s * rv = (hamt_s*)calloc(1, sizeof(*rv));
         if (rv == NULL) return NULL;
-        rv->root = _create_hamt_node();
+
+        memcpy(&rv->info, info, sizeof(*info));
+        rv->list_size = sizeof(struct hamt_list);
+        if (inline_keys(rv))
+                rv->list_size += HAMT_INLINE_ALIGN(info->key_size);
+        if (inline_elems(rv))
+                rv->list_size += info->elem_size;
+
+        if (!concurrent) {
+                rv->arena = _create_hamt_arena(rv->list_size);
+                if (rv->arena == NULL) {
+                        free(rv);
+                        return NULL;
+                }
+        }
+        rv->root = _create_hamt_node(rv, 0);
         if (rv->root == NULL) {
+                if (rv->arena)
+                        _free_hamt_arena(rv->arena);
                 free(rv);
                 return NULL;
         }
 
-        memcpy(&rv->info, info, sizeof(*info));
+        /* Without a secondary hash, keys agreeing on all 32 bits chain */
+        rv->max_level = info->rehash != NULL || inline_keys(rv) ?
+                HAMT_MAX_LEVEL : HAMT_GEN_LEVELS;
         rv->valid = HAMT_VALID;
+        return rv;
+}
 
-        return (HAMT*)rv;
+HAMT * init_hamt(struct hamtinfo * info)
+{
+        return (HAMT*)_new_hamt(info, 0);
 }
 
-int _insert_ham(hamt_s * h, hamt_n * root, const int hash, const int depth,
-                const void * key, const void * val);
+int _insert_ham(hamt_s * h, hamt_n ** rootp, const uint32_t hash,
+                uint32_t bits, const int depth, const void * key,
+                const void * val);
 
 int insert_hamt(HAMT * H, void * key, void * val)
 {
@@ -90,272 +304,574 @@ int insert_hamt(HAMT * H, void * key, void * val)
                 return -1;
         }
 
-        int hash = h->info.hash(key);
-        int rv = _insert_ham(h, h->root, hash, 0, key, val);
+        if (concurrent_hamt(h))
+                return _ctrie_insert_hamt(h, key, val);
+
+        uint32_t hash = (uint32_t)h->info.hash(key);
+        int rv = _insert_ham(h, &h->root, hash, hash, 0, key, val);
+        if (rv > 0)
+                h->size += rv;
         return rv;
 }
 
-int _insert_ham(hamt_s * h, hamt_n * root, const int hash, const int depth,
-                const void * key, const void * val)
+/*
+ * Inserts into the subtrie at *rootp.  Adding a child may move the node, so
+ * the (possibly new) node is written back through rootp.
+ *
+ * An entry lives in the shallowest slot its hash prefix reaches alone; it is
+ * only pushed down a level once a second key lands in the same slot.
+ */
+int _insert_ham(hamt_s * h, hamt_n ** rootp, const uint32_t hash,
+                uint32_t bits, const int depth, const void * key,
+                const void * val)
 {
-        if (depth == HAMT_MAX_LEVEL) {
-                int rv = _insert_hamt_list(h, root, key, val);
-                root->size += rv;
-                return rv;
+        hamt_n * root = _own_hamt_node(h, rootp);
+        if (root == NULL)
+                return -1;
+
+        int logical_index = find_logical_index(bits, depth);
+        uint32_t bit = 1u << logical_index;
+
+        if ((root->bitfield & bit) == 0) {
+                union hamt_slot child;
+                child.list = _make_hamt_list_node(h, hash, key, val, NULL);
+                if (child.list == NULL)
+                        return -1;
+
+                root = _add_hamt_child(h, root, logical_index, child, 1);
+                if (root == NULL) {
+                        _free_hamt_list(h, child.list);
+                        return -1;
+                }
+                *rootp = root;
+                return 1;
         }
 
-        int logical_index = find_logical_index(hash, depth);
+        int physical_index = find_physical_index(root->bitfield, logical_index);
+        union hamt_slot * slot = &root->children[physical_index];
 
-        if (root->children[logical_index] == NULL)
-                root->children[logical_index] = _create_hamt_node();
+        if ((root->entrymap & bit) == 0) {
+                if (starts_hamt_gen(depth+1))
+                        bits = _rehash_hamt(h, key, (depth+1) / HAMT_GEN_LEVELS);
+                return _insert_ham(h, &slot->node, hash, bits, depth+1,
+                                key, val);
+        }
 
-        int rv = _insert_ham(h, root->children[logical_index], hash, depth+1,
-                        key, val);
+        struct hamt_list * it = _find_hamt_list(h, slot->list, hash, key);
+        if (it != NULL) {
+                if (_own_hamt_list(h, &slot->list) == NULL)
+                        return -1;
+                it = _find_hamt_list(h, slot->list, hash, key);
+                _set_hamt_value(h, it, val);
+                return 0;
+        }
 
-        root->bitfield |= (1 << logical_index);
-        root->size += rv;
-        return rv;
-}
+        /* A second key reached this slot: push both down a level */
+        struct hamt_list * e = _make_hamt_list_node(h, hash, key, val, NULL);
+        if (e == NULL)
+                return -1;
 
-hamt_n * _create_hamt_node(void)
-{
-        hamt_n * rv = (hamt_n*)calloc(1, sizeof(*rv));
-        return rv;
+        int path[HAMT_MAX_LEVEL];
+        int split_depth = _find_split_depth(h, slot->list, e, depth+1, path);
+        if (split_depth < 0) {
+                /* Same bits all the way down: nothing left to split on */
+                if (_own_hamt_list(h, &slot->list) == NULL) {
+                        _free_hamt_list(h, e);
+                        return -1;
+                }
+                e->next = slot->list;
+                slot->list = e;
+                return 1;
+        }
+
+        hamt_n * child = _split_hamt_lists(h, slot->list, e, depth+1,
+                        split_depth, path);
+        if (child == NULL) {
+                _free_hamt_list(h, e);
+                return -1;
+        }
+
+        slot->node = child;
+        root->entrymap &= ~bit;
+        return 1;
 }
 
-struct hamt_list * _make_hamt_list_node(hamt_s * s, const void * key,
-                const void * val, struct hamt_list * next)
+/*
+ * Seeded secondary hash of a key for generation 'gen' (> 0) of the trie.
+ * Inline keys fall back to hashing their bytes.
+ */
+uint32_t _rehash_hamt(hamt_s * s, const void * key, int gen)
 {
-        struct hamt_list * rv = (struct hamt_list *)malloc(sizeof(*rv));
-        rv->key   = s->info.copy_key(key);
-        rv->value = s->info.copy_elem(val);
-        rv-> next = next;
-        return rv;
+        if (s->info.rehash != NULL)
+                return (uint32_t)s->info.rehash(key, gen);
+
+        /* FNV-1a seeded per generation, finished with murmur3's fmix32 */
+        const unsigned char * p = (const unsigned char *)key;
+        uint32_t h = 2166136261u ^ ((uint32_t)gen * 0x9e3779b9u);
+        for (int i = 0; i < s->info.key_size; ++i) {
+                h ^= p[i];
+                h *= 16777619u;
+        }
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+        return h;
 }
 
-int _insert_hamt_list(hamt_s * s, hamt_n * node,
-                const void * key, const void * val)
+/*
+ * Finds the first level at or below 'depth' where the (equal up to 'depth')
+ * hash bits of 'a' and 'b' pick different children.  'path' records the
+ * shared logical index of every level before it, and (ia << 8) | ib for the
+ * level itself.  Returns -1 if they agree on every level the trie has.
+ */
+int _find_split_depth(hamt_s * s, struct hamt_list * a, struct hamt_list * b,
+                int depth, int * path)
 {
-        if (node->values == NULL) {
-                node->values = _make_hamt_list_node(s, key, val, NULL);
-                return 1;
+        uint32_t abits = a->hash, bbits = b->hash;
+        int gen = depth / HAMT_GEN_LEVELS;
+        if (gen > 0 && depth < s->max_level) {
+                abits = _rehash_hamt(s, a->key, gen);
+                bbits = _rehash_hamt(s, b->key, gen);
         }
 
-        struct hamt_list * cur = node->values, * prev = NULL;
-        while (cur) {
-                if (s->info.cmp_key(key, cur->key) == 0) {
-                        s->info.free_elem(cur->value);
-                        cur->value = s->info.copy_elem(val);
-                        return 0;
+        for (; depth < s->max_level; ++depth) {
+                if (starts_hamt_gen(depth) && depth > gen * HAMT_GEN_LEVELS) {
+                        gen = depth / HAMT_GEN_LEVELS;
+                        abits = _rehash_hamt(s, a->key, gen);
+                        bbits = _rehash_hamt(s, b->key, gen);
                 }
 
-                prev = cur;
-                cur = cur->next;
+                int ia = find_logical_index(abits, depth);
+                int ib = find_logical_index(bbits, depth);
+                if (ia != ib) {
+                        path[depth] = (ia << 8) | ib;
+                        return depth;
+                }
+                path[depth] = ia;
         }
-
-        prev->next = _make_hamt_list_node(s, key, val, NULL);
-        return 1;
+        return -1;
 }
 
 /*
- * Fills buffer with value asociated with key and returns 1 on success
- * If key is not found, returns 0
+ * Builds the subtrie at 'depth' holding lists 'a' and 'b', which share the
+ * children in 'path' down to 'split_depth' (see _find_split_depth).
+ * Returns NULL on failure, in which case neither list is freed.
  */
-int _find_hamt_list(hamt_s * s, hamt_n * node, const void * key, void ** buf)
+hamt_n * _split_hamt_lists(hamt_s * s, struct hamt_list * a,
+                struct hamt_list * b, const int depth, const int split_depth,
+                const int * path)
 {
-        if (node == NULL) {
-                fprintf(stderr, "Node is NULL at line: %d\n", __LINE__);
-                return 0;
-        }
-        struct hamt_list * it = node->values;
-        while (it) {
-                if (s->info.cmp_key(it->key, key) == 0) {
-                        *buf = s->info.copy_elem(it->value);
-                        return 1;
+        int ia = path[split_depth] >> 8;
+        int ib = path[split_depth] & 0xff;
+
+        hamt_n * rv = _create_hamt_node(s, 2);
+        if (rv == NULL)
+                return NULL;
+
+        rv->bitfield = rv->entrymap = (1u << ia) | (1u << ib);
+        rv->children[ia > ib].list = a;
+        rv->children[ia < ib].list = b;
+
+        for (int d = split_depth - 1; d >= depth; --d) {
+                hamt_n * parent = _create_hamt_node(s, 1);
+                if (parent == NULL) {
+                        while (rv->entrymap == 0) {
+                                hamt_n * child = rv->children[0].node;
+                                _free_hamt_node(s, rv);
+                                rv = child;
+                        }
+                        _free_hamt_node(s, rv);
+                        return NULL;
                 }
-                it = it->next;
+
+                parent->bitfield = 1u << path[d];
+                parent->children[0].node = rv;
+                rv = parent;
         }
-        *buf = NULL;
-        return 0;
+        return rv;
 }
 
-/*
- * Searches for hamt_ node for given hash
- * If found, returns the node
- * If not found, returns NULL
- */
-hamt_n * __find_hamt(hamt_s * s, hamt_n * root, const int hash, const int depth)
+/* Creates an arena whose extra size class holds 'big_size' byte blocks */
+struct hamt_arena * _create_hamt_arena(size_t big_size)
 {
-        if (depth == HAMT_MAX_LEVEL)
-                return root;
-        if (root == NULL)
+        struct hamt_arena * rv = (struct hamt_arena *)calloc(1, sizeof(*rv));
+        if (rv == NULL)
+                return NULL;
+        if (pthread_mutex_init(&rv->lock, NULL) != 0) {
+                free(rv);
                 return NULL;
+        }
+        rv->chunk_size = HAMT_ARENA_FIRST_CHUNK;
+        rv->big_size = big_size;
+        rv->handles = 1;
+        return rv;
+}
+
+static inline size_t _hamt_arena_class(struct hamt_arena * a, size_t size,
+                size_t * rounded)
+{
+        if (size > HAMT_ARENA_MAX) {
+                assert(size == a->big_size);
+                *rounded = (size + HAMT_ARENA_GRAIN - 1) &
+                        ~(size_t)(HAMT_ARENA_GRAIN - 1);
+                return HAMT_ARENA_CLASSES - 1;
+        }
+        size_t cls = (size + HAMT_ARENA_GRAIN - 1) / HAMT_ARENA_GRAIN - 1;
+        *rounded = (cls + 1) * HAMT_ARENA_GRAIN;
+        return cls;
+}
+
+/* Takes the arena lock if other handles may be using it too */
+static inline int _lock_hamt_arena(struct hamt_arena * a)
+{
+        if (__atomic_load_n(&a->handles, __ATOMIC_ACQUIRE) == 1)
+                return 0;
+        pthread_mutex_lock(&a->lock);
+        return 1;
+}
 
-        int logical_index = find_logical_index(hash, depth);
-        return __find_hamt(s, root->children[logical_index], hash, depth+1);
-         
+void * _hamt_arena_alloc(struct hamt_arena * a, size_t size)
+{
+        size_t rounded;
+        size_t cls = _hamt_arena_class(a, size, &rounded);
+        int locked = _lock_hamt_arena(a);
+
+        void * rv = a->free[cls];
+        if (rv != NULL) {
+                a->free[cls] = *(void **)rv;
+        }
+        else {
+                if ((size_t)(a->end - a->cur) < rounded) {
+                        /* The old tail is abandoned until the next reset */
+                        size_t n = a->chunk_size;
+                        while (n < rounded + HAMT_ARENA_GRAIN)
+                                n *= 2;
+                        char * chunk = (char *)malloc(n);
+                        if (chunk == NULL) {
+                                if (locked)
+                                        pthread_mutex_unlock(&a->lock);
+                                return NULL;
+                        }
+                        *(void **)chunk = a->chunks;
+                        a->chunks = chunk;
+                        a->cur = chunk + HAMT_ARENA_GRAIN;
+                        a->end = chunk + n;
+                        if (a->chunk_size < HAMT_ARENA_MAX_CHUNK)
+                                a->chunk_size *= 2;
+                }
+                rv = a->cur;
+                a->cur += rounded;
+        }
+
+        if (locked)
+                pthread_mutex_unlock(&a->lock);
+        return rv;
 }
 
-int _find_hamt(hamt_s * s, hamt_n * root, const int hash, 
-                const void * key, void ** buf)
+void _hamt_arena_free(struct hamt_arena * a, void * p, size_t size)
 {
+        size_t rounded;
+        size_t cls = _hamt_arena_class(a, size, &rounded);
+        int locked = _lock_hamt_arena(a);
+        *(void **)p = a->free[cls];
+        a->free[cls] = p;
+        if (locked)
+                pthread_mutex_unlock(&a->lock);
+}
 
-        hamt_n * leaf = __find_hamt(s, root, hash, 0);
-        return _find_hamt_list(s, leaf, key, buf);
+/* Returns every block to the system at once; no handle may still use one */
+void _reset_hamt_arena(struct hamt_arena * a)
+{
+        void * chunk = a->chunks;
+        while (chunk) {
+                void * next = *(void **)chunk;
+                free(chunk);
+                chunk = next;
+        }
+        a->chunks = NULL;
+        a->cur = a->end = NULL;
+        a->chunk_size = HAMT_ARENA_FIRST_CHUNK;
+        memset(a->free, 0, sizeof(a->free));
 }
 
+void _free_hamt_arena(struct hamt_arena * a)
+{
+        _reset_hamt_arena(a);
+        pthread_mutex_destroy(&a->lock);
+        free(a);
+}
 
 /*
- * Returns 1 and fills buf with the value asociated with key
- * If key not found, returns 0
- * On error, sets errno and returns -1
+ * Creates a node with room for at least 'nchildren' children: arena blocks
+ * are rounded up, and the slack is kept as spare slots
  */
-int find_hamt(HAMT * H, const void * key, void **buf)
+hamt_n * _create_hamt_node(hamt_s * s, int nchildren)
 {
-        hamt_s * s = (hamt_s *)H;
-        if (s->valid != HAMT_VALID) {
-                errno = EINVAL;
-                return -1;
+        size_t size = hamt_node_size(nchildren);
+        if (s->arena != NULL)
+                size = (size + HAMT_ARENA_GRAIN - 1) &
+                        ~(size_t)(HAMT_ARENA_GRAIN - 1);
+
+        hamt_n * rv = (hamt_n*)_hamt_alloc(s, size);
+        if (rv != NULL) {
+                rv->bitfield = rv->entrymap = 0;
+                rv->refs = 1;
+                rv->cap = (size - sizeof(hamt_n)) / sizeof(union hamt_slot);
         }
+        return rv;
+}
 
-        int hash = s->info.hash(key);
-        
-        return _find_hamt(s, s->root, hash, key, buf);
+void _free_hamt_node(hamt_s * s, hamt_n * node)
+{
+        _hamt_free(s, node, hamt_node_size(node->cap));
 }
 
-unsigned int size_hamt(HAMT * H)
+/*
+ * Makes *nodep safe to modify: a node shared with a snapshot is replaced by
+ * a private copy (path copying), whose children gain a reference.
+ * Returns the node to modify, or NULL on failure.
+ */
+hamt_n * _own_hamt_node(hamt_s * s, hamt_n ** nodep)
 {
-        hamt_s * s = (hamt_s *)H;
-        if (s->valid != HAMT_VALID) {
-                errno = EINVAL;
-                return -1;
+        hamt_n * node = *nodep;
+        if (__atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 1)
+                return node;
+
+        int n = __builtin_popcount(node->bitfield);
+        hamt_n * rv = _create_hamt_node(s, n);
+        if (rv == NULL)
+                return NULL;
+
+        uint32_t cap = rv->cap;
+        memcpy(rv, node, hamt_node_size(n));
+        rv->refs = 1;
+        rv->cap = cap;
+        uint32_t map = rv->bitfield;
+        for (int i = 0; i < n; ++i) {
+                uint32_t bit = map & -map;
+                uint32_t * refs = rv->entrymap & bit ?
+                        &rv->children[i].list->refs :
+                        &rv->children[i].node->refs;
+                __atomic_add_fetch(refs, 1, __ATOMIC_RELAXED);
+                map ^= bit;
         }
-        return s->root->size;
+
+        _release_hamt_node(s, node);
+        *nodep = rv;
+        return rv;
 }
 
-void _free_hamt_nodes(hamt_s * s, hamt_n * root)
+/*
+ * Makes the list at *listp safe to modify, copying all of it if its head is
+ * shared with a snapshot.  Returns the list head, or NULL on failure.
+ */
+struct hamt_list * _own_hamt_list(hamt_s * s, struct hamt_list ** listp)
 {
-        if (root == NULL)
-                return;
-        for (int i = 0; i < 32; ++i)
-                _free_hamt_nodes(s, root->children[i]);
+        struct hamt_list * list = *listp;
+        if (__atomic_load_n(&list->refs, __ATOMIC_ACQUIRE) == 1)
+                return list;
 
-        _free_hamt_node(s, root);
+        struct hamt_list * rv = NULL, ** tail = &rv;
+        for (struct hamt_list * it = list; it; it = it->next) {
+                *tail = _make_hamt_list_node(s, it->hash, it->key, it->value,
+                                NULL);
+                if (*tail == NULL) {
+                        _free_hamt_list(s, rv);
+                        return NULL;
+                }
+                tail = &(*tail)->next;
+        }
+
+        _release_hamt_list(s, list);
+        *listp = rv;
+        return rv;
 }
 
-void _free_hamt_node(hamt_s * s, hamt_n * root)
+/*
+ * Stores 'child' at 'logical_index' of 'node', in a spare slot if it has
+ * one, else by moving to a bigger block.  Returns the (possibly moved) node,
+ * or NULL on failure, in which case 'node' is left untouched.
+ */
+hamt_n * _add_hamt_child(hamt_s * s, hamt_n * node, int logical_index,
+                union hamt_slot child, int is_list)
 {
-        struct hamt_list * it = root->values, * next;
-        while (it) {
-                next = it->next;
-                
-                s->info.free_key(it->key);
-                s->info.free_elem(it->value);
+        int n = __builtin_popcount(node->bitfield);
+        int physical_index = find_physical_index(node->bitfield, logical_index);
+        hamt_n * rv = node;
 
-                free(it);
-                it = next;
+        if ((uint32_t)n < node->cap) {
+                memmove(&rv->children[physical_index + 1],
+                                &rv->children[physical_index],
+                                (n - physical_index) * sizeof(union hamt_slot));
         }
+        else {
+                rv = _create_hamt_node(s, n + 1);
+                if (rv == NULL)
+                        return NULL;
 
-        free(root);
+                uint32_t cap = rv->cap;
+                memcpy(rv, node, hamt_node_size(physical_index));
+                memcpy(&rv->children[physical_index + 1],
+                                &node->children[physical_index],
+                                (n - physical_index) * sizeof(union hamt_slot));
+                rv->cap = cap;
+                _free_hamt_node(s, node);
+        }
+        rv->children[physical_index] = child;
+        rv->bitfield |= (1u << logical_index);
+        if (is_list)
+                rv->entrymap |= (1u << logical_index);
+        return rv;
 }
 
-int free_hamt(HAMT * H)
+/*
+ * Drops the child slot at 'logical_index'.  Never allocates: the freed slot
+ * stays with 'node' for later inserts.
+ */
+void _remove_hamt_child(hamt_n * node, int logical_index)
 {
-        hamt_s * s = (hamt_s *)H;
-        if (s->valid != HAMT_VALID) {
-                errno = EINVAL;
-                return -1;
+        int n = __builtin_popcount(node->bitfield);
+        int physical_index = find_physical_index(node->bitfield, logical_index);
+        memmove(&node->children[physical_index],
+                        &node->children[physical_index + 1],
+                        (n - physical_index - 1) * sizeof(union hamt_slot));
+        node->bitfield &= ~(1u << logical_index);
+        node->entrymap &= ~(1u << logical_index);
+}
+
+struct hamt_list * _make_hamt_list_node(hamt_s * s, uint32_t hash,
+                const void * key, const void * val, struct hamt_list * next)
+{
+        struct hamt_list * rv = (struct hamt_list *)_hamt_alloc(s,
+                        s->list_size);
+        if (rv == NULL)
+                return NULL;
+
+        unsigned char * data = (unsigned char *)(rv + 1);
+        if (inline_keys(s)) {
+                rv->key = data;
+                memcpy(data, key, s->info.key_size);
+                data += HAMT_INLINE_ALIGN(s->info.key_size);
+        }
+        else {
+                rv->key = s->info.copy_key(key);
         }
 
-        _free_hamt_nodes(s, s->root);
-        memset(s, 0, sizeof(*s));
-        free(s);
-        return 0;
+        if (inline_elems(s)) {
+                rv->value = data;
+                memcpy(data, val, s->info.elem_size);
+        }
+        else {
+                rv->value = s->info.copy_elem(val);
+        }
+        rv->next = next;
+        rv->hash = hash;
+        rv->refs = 1;
+        return rv;
 }
 
-int _remove_hamt_list(hamt_s * s, hamt_n * node, const void * key, void ** buf)
+/* Returns the node of list 'it' holding 'key', or NULL */
+struct hamt_list * _find_hamt_list(hamt_s * s, struct hamt_list * it,
+                uint32_t hash, const void * key)
 {
-        if (node->values == NULL)
-                return HAMT_NOREMOVE;
+        while (it && (it->hash != hash || _cmp_hamt_key(s, it->key, key) != 0))
+                it = it->next;
+        return it;
+}
 
-        struct hamt_list * prev = NULL, * cur = node->values;
-        while (cur) {
-                if (s->info.cmp_key(cur->key, key) == 0) {
-                        /* Match found */
-                        if (prev == NULL)
-                                node->values = cur->next;
-                        else
-                                prev->next = cur->next;
+/*
+ * Returns the list node holding 'key', or NULL if 'key' is not in 's'
+ */
+struct hamt_list * _find_hamt_entry(hamt_s * s, const void * key)
+{
+        uint32_t hash = (uint32_t)s->info.hash(key);
+        uint32_t bits = hash;
+        hamt_n * node = s->root;
 
-                        if (buf != NULL)
-                                *buf = s->info.copy_elem(cur->value);
+        for (int depth = 0; ; ++depth) {
+                if (depth > 0 && starts_hamt_gen(depth))
+                        bits = _rehash_hamt(s, key, depth / HAMT_GEN_LEVELS);
 
-                        s->info.free_elem(cur->value);
-                        s->info.free_key(cur->key);
-                        free(cur);
+                int logical_index = find_logical_index(bits, depth);
+                uint32_t bit = 1u << logical_index;
+                if ((node->bitfield & bit) == 0)
+                        return NULL;
 
-                        node->size -= 1;
-                        if (node->values == NULL)
-                                return HAMT_REMOVECLEAR;
-                        else
-                                return HAMT_REMOVENOCLEAR;
-                }
+                int physical_index = find_physical_index(node->bitfield,
+                                logical_index);
+                if (node->entrymap & bit)
+                        return _find_hamt_list(s,
+                                        node->children[physical_index].list,
+                                        hash, key);
+                node = node->children[physical_index].node;
         }
-        return HAMT_NOREMOVE;
 }
 
-int _remove_hamt(hamt_s * s, hamt_n * root, const int hash, const int depth,
-                const void * key, void **buf)
+/*
+ * Looks up keys[0..n) (n <= HAMT_BATCH) side by side, one trie level per
+ * pass over the batch.  Each key's next node (or list) is prefetched as soon
+ * as it is known and only read on the next pass, once the other keys have
+ * had their turn, so the cache misses of the whole batch overlap instead of
+ * being paid one after another.  Fills hashes[] and entries[] (NULL for
+ * keys not found).
+ */
+void _find_hamt_batch(hamt_s * s, void * const * keys, int n,
+                uint32_t * hashes, struct hamt_list ** entries)
 {
-        if (root == NULL)
-                return HAMT_NOREMOVE;
+        hamt_n * nodes[HAMT_BATCH];
+        uint32_t bits[HAMT_BATCH];
+        int active[HAMT_BATCH];
+        int nactive = n;
 
-        if (depth == HAMT_MAX_LEVEL) {
-                int rv = _remove_hamt_list(s, root, key, buf);
-                
-                if (rv == HAMT_REMOVECLEAR) {
-                        _free_hamt_node(s, root);
-                }
-                return rv;
+        for (int i = 0; i < n; ++i) {
+                hashes[i] = bits[i] = (uint32_t)s->info.hash(keys[i]);
+                nodes[i] = s->root;
+                entries[i] = NULL;
+                active[i] = i;
         }
 
-        int logical_index = find_logical_index(hash, depth);
-        int rv = _remove_hamt(s, root->children[logical_index], hash,
-                        depth+1, key, buf);
-        
-        switch (rv) {
-                case HAMT_NOREMOVE:
-                        return rv;
-                case HAMT_REMOVECLEAR:
-                        root->size -= 1;
-                        root->children[logical_index] = NULL;
-                        root->bitfield &= ~(1 << logical_index);
-                        if (root->size == 0 && depth != 0) {
-                                _free_hamt_node(s, root);
-                                return HAMT_REMOVECLEAR;
-                        }
-                        return HAMT_REMOVENOCLEAR;
-                        break;
-                case HAMT_REMOVENOCLEAR: 
-                        root->size -= 1;
-                        return rv;
-                        break;
-                default:
-                        break;
+        for (int depth = 0; nactive > 0; ++depth) {
+                int still = 0;
+                for (int a = 0; a < nactive; ++a) {
+                        int i = active[a];
+                        hamt_n * node = nodes[i];
+                        if (depth > 0 && starts_hamt_gen(depth))
+                                bits[i] = _rehash_hamt(s, keys[i],
+                                                depth / HAMT_GEN_LEVELS);
+
+                        int logical_index = find_logical_index(bits[i], depth);
+                        uint32_t bit = 1u << logical_index;
+                        if ((node->bitfield & bit) == 0)
+                                continue;
 
+                        int physical_index = find_physical_index(
+                                        node->bitfield, logical_index);
+                        if (node->entrymap & bit) {
+                                entries[i] = node->children[physical_index].list;
+                                __builtin_prefetch(entries[i]);
+                                continue;
+                        }
+                        nodes[i] = node->children[physical_index].node;
+                        __builtin_prefetch(nodes[i]);
+                        active[still++] = i;
+                }
+                nactive = still;
         }
-        fprintf(stderr, "Should not reach here at %s: %d", 
-                        __FILE__, __LINE__);
-        exit(1);
+
+        for (int i = 0; i < n; ++i)
+                if (entries[i] != NULL)
+                        entries[i] = _find_hamt_list(s, entries[i], hashes[i],
+                                        keys[i]);
 }
 
 /*
- * Returns 1 on success
- *      if buffer != NULL, fills buffer with removed value
- * Returns 0 when key not found
- * Returns -1 on failure (sets errno)
+ * Returns 1 and fills buf with the value asociated with key
+ * If key not found, returns 0
+ * On error, sets errno and returns -1
  */
-int remove_hamt(HAMT * H, const void * key, void ** buffer)
+int find_hamt(HAMT * H, const void * key, void **buf)
 {
         hamt_s * s = (hamt_s *)H;
         if (s->valid != HAMT_VALID) {
@@ -363,23 +879,1467 @@ int remove_hamt(HAMT * H, const void * key, void ** buffer)
                 return -1;
         }
 
-        int hash = s->info.hash(key);
-        int rv = _remove_hamt(s, s->root, hash, 0, key, buffer);
-        if (rv == HAMT_REMOVECLEAR || rv == HAMT_REMOVENOCLEAR)
-                return 1;
-        else
+        if (concurrent_hamt(s))
+                return _ctrie_find_hamt(s, key, buf);
+
+        struct hamt_list * it = _find_hamt_entry(s, key);
+        if (it == NULL) {
+                if (!inline_elems(s))
+                        *buf = NULL;
                 return 0;
+        }
+
+        _get_hamt_value(s, it, buf);
+        return 1;
 }
 
-int clear_hamt(HAMT *H)
+void * find_ref_hamt(HAMT * H, const void * key)
 {
         hamt_s * s = (hamt_s *)H;
-        if (s->valid != HAMT_VALID) {
+        if (s->valid != HAMT_VALID || concurrent_hamt(s)) {
                 errno = EINVAL;
-                return -1;
+                return NULL;
         }
 
-        _free_hamt_nodes(s, s->root);
-        s->root = _create_hamt_node();
+        struct hamt_list * it = _find_hamt_entry(s, key);
+        if (it == NULL)
+                return NULL;
+        return inline_elems(s) ? it->value : (void *)&it->value;
+}
+
+int find_many_hamt(HAMT * H, void * const * keys, int n, void ** bufs,
+                int * found)
+{
+        hamt_s * s = (hamt_s *)H;
+        if (s->valid != HAMT_VALID || n < 0) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        struct hamt_list * entries[HAMT_BATCH];
+        uint32_t hashes[HAMT_BATCH];
+        struct hamt_epoch_rec * rec = NULL;
+        int rv = 0;
+
+        if (concurrent_hamt(s) && (rec = _ctrie_enter(s)) == NULL)
+                return -1;
+
+        for (int base = 0; base < n; base += HAMT_BATCH) {
+                int m = n - base < HAMT_BATCH ? n - base : HAMT_BATCH;
+                if (concurrent_hamt(s)) {
+                        for (int i = 0; i < m; ++i)
+                                entries[i] = _ctrie_find(s, keys[base + i]);
+                }
+                else {
+                        _find_hamt_batch(s, keys + base, m, hashes, entries);
+                }
+
+                for (int i = 0; i < m; ++i) {
+                        if (entries[i] != NULL) {
+                                _get_hamt_value(s, entries[i],
+                                                (void **)bufs[base + i]);
+                                rv += 1;
+                        }
+                        else if (!inline_elems(s)) {
+                                *(void **)bufs[base + i] = NULL;
+                        }
+                        if (found != NULL)
+                                found[base + i] = entries[i] != NULL;
+                }
+        }
+
+        if (rec != NULL)
+                _ctrie_exit(rec);
+        return rv;
+}
+
+int insert_many_hamt(HAMT * H, void * const * keys, void * const * vals, int n)
+{
+        hamt_s * s = (hamt_s *)H;
+        if (s->valid != HAMT_VALID || n < 0) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        struct hamt_list * entries[HAMT_BATCH];
+        uint32_t hashes[HAMT_BATCH];
+        int rv = 0;
+
+        for (int base = 0; base < n; base += HAMT_BATCH) {
+                int m = n - base < HAMT_BATCH ? n - base : HAMT_BATCH;
+
+                /* Shared or concurrent nodes must be copied/CASed on update */
+                if (concurrent_hamt(s) || shared_hamt(s)) {
+                        for (int i = 0; i < m; ++i) {
+                                int r = insert_hamt(H, keys[base + i],
+                                                vals[base + i]);
+                                if (r < 0)
+                                        return -1;
+                                rv += r;
+                        }
+                        continue;
+                }
+
+                /*
+                 * Locate the whole batch first: existing keys are updated in
+                 * place, and new keys are inserted down the paths the
+                 * lookup has just pulled into cache.  Inserting never moves
+                 * or frees list entries, so the located ones stay valid.
+                 */
+                _find_hamt_batch(s, keys + base, m, hashes, entries);
+                for (int i = 0; i < m; ++i) {
+                        if (entries[i] != NULL) {
+                                _set_hamt_value(s, entries[i], vals[base + i]);
+                                continue;
+                        }
+                        int r = _insert_ham(s, &s->root, hashes[i], hashes[i],
+                                        0, keys[base + i], vals[base + i]);
+                        if (r < 0)
+                                return -1;
+                        s->size += r;
+                        rv += r;
+                }
+        }
+        return rv;
+}
+
+unsigned int size_hamt(HAMT * H)
+{
+        hamt_s * s = (hamt_s *)H;
+        if (s->valid != HAMT_VALID) {
+                errno = EINVAL;
+                return -1;
+        }
+        return __atomic_load_n(&s->size, __ATOMIC_RELAXED);
+}
+
+void _free_hamt_list(hamt_s * s, struct hamt_list * it)
+{
+        struct hamt_list * next;
+        while (it) {
+                next = it->next;
+                _free_hamt_list_node(s, it);
+                it = next;
+        }
+}
+
+/* Drops a reference to the list 'it', freeing it with the last one */
+void _release_hamt_list(hamt_s * s, struct hamt_list * it)
+{
+        if (__atomic_sub_fetch(&it->refs, 1, __ATOMIC_ACQ_REL) == 0)
+                _free_hamt_list(s, it);
+}
+
+/* Drops a reference to 'root', freeing its subtrie with the last one */
+void _release_hamt_node(hamt_s * s, hamt_n * root)
+{
+        if (__atomic_sub_fetch(&root->refs, 1, __ATOMIC_ACQ_REL) != 0)
+                return;
+
+        int n = __builtin_popcount(root->bitfield);
+        uint32_t map = root->bitfield;
+        for (int i = 0; i < n; ++i) {
+                uint32_t bit = map & -map;
+                if (root->entrymap & bit)
+                        _release_hamt_list(s, root->children[i].list);
+                else
+                        _release_hamt_node(s, root->children[i].node);
+                map ^= bit;
+        }
+
+        _free_hamt_node(s, root);
+}
+
+/*
+ * Frees the copied keys/values held below 'root' ahead of a bulk arena
+ * release.  In fixed-size mode there is nothing to free and nothing to walk.
+ */
+void _drop_hamt_data(hamt_s * s, hamt_n * root)
+{
+        if (inline_keys(s) && inline_elems(s))
+                return;
+
+        int n = __builtin_popcount(root->bitfield);
+        uint32_t map = root->bitfield;
+        for (int i = 0; i < n; ++i) {
+                uint32_t bit = map & -map;
+                if (root->entrymap & bit) {
+                        for (struct hamt_list * it = root->children[i].list;
+                                        it; it = it->next) {
+                                if (!inline_keys(s))
+                                        s->info.free_key(it->key);
+                                if (!inline_elems(s))
+                                        s->info.free_elem(it->value);
+                        }
+                }
+                else {
+                        _drop_hamt_data(s, root->children[i].node);
+                }
+                map ^= bit;
+        }
+}
+
+int free_hamt(HAMT * H)
+{
+        hamt_s * s = (hamt_s *)H;
+        if (s->valid != HAMT_VALID) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (concurrent_hamt(s)) {
+                _ctrie_free(s, s->croot);
+                _ctrie_free_epoch(s);
+                _release_hamt_node(s, s->root);
+        }
+        else if (__atomic_load_n(&s->arena->handles, __ATOMIC_ACQUIRE) == 1) {
+                _drop_hamt_data(s, s->root);
+                _free_hamt_arena(s->arena);
+        }
+        else {
+                _release_hamt_node(s, s->root);
+                if (__atomic_sub_fetch(&s->arena->handles, 1,
+                                        __ATOMIC_ACQ_REL) == 0)
+                        _free_hamt_arena(s->arena);
+        }
+        memset(s, 0, sizeof(*s));
+        free(s);
+        return 0;
+}
+
+/*
+ * Unlinks 'key' from the list at *listp
+ * Returns HAMT_REMOVECLEAR if the list is now empty, -1 on failure
+ */
+int _remove_hamt_list(hamt_s * s, struct hamt_list ** listp, const void * key,
+                void ** buf)
+{
+        if (_own_hamt_list(s, listp) == NULL)
+                return -1;
+
+        struct hamt_list * prev = NULL, * cur = *listp;
+        while (cur) {
+                if (_cmp_hamt_key(s, cur->key, key) == 0) {
+                        /* Match found */
+                        if (prev == NULL)
+                                *listp = cur->next;
+                        else
+                                prev->next = cur->next;
+
+                        if (buf != NULL)
+                                _get_hamt_value(s, cur, buf);
+
+                        _free_hamt_list_node(s, cur);
+
+                        if (*listp == NULL)
+                                return HAMT_REMOVECLEAR;
+                        else
+                                return HAMT_REMOVENOCLEAR;
+                }
+                prev = cur;
+                cur = cur->next;
+        }
+        return HAMT_NOREMOVE;
+}
+
+/*
+ * Removes 'key' from the subtrie at *rootp (at 'depth').  Returns
+ * HAMT_NOREMOVE if it isn't there, or -1 on failure; otherwise tells the
+ * parent what is left of the subtrie: nothing (HAMT_REMOVECLEAR), a single
+ * list the parent should hold in its own slot (HAMT_REMOVECOLLAPSE), or more
+ * (HAMT_REMOVENOCLEAR).  Folding single-list nodes back up keeps every
+ * entry at the shallowest level its hash prefix reaches alone, as if the
+ * remaining keys had been inserted into an empty trie.  Nothing is
+ * allocated unless the path is shared with a snapshot.
+ */
+int _remove_hamt(hamt_s * s, hamt_n ** rootp, const uint32_t hash,
+                uint32_t bits, const int depth, const void * key, void **buf)
+{
+        hamt_n * root = _own_hamt_node(s, rootp);
+        if (root == NULL)
+                return -1;
+
+        int logical_index = find_logical_index(bits, depth);
+        uint32_t bit = 1u << logical_index;
+        if ((root->bitfield & bit) == 0)
+                return HAMT_NOREMOVE;
+
+        int physical_index = find_physical_index(root->bitfield, logical_index);
+        union hamt_slot * slot = &root->children[physical_index];
+        int rv;
+
+        if (root->entrymap & bit) {
+                if (slot->list->hash != hash)
+                        return HAMT_NOREMOVE;
+                rv = _remove_hamt_list(s, &slot->list, key, buf);
+        }
+        else {
+                if (starts_hamt_gen(depth+1))
+                        bits = _rehash_hamt(s, key, (depth+1) / HAMT_GEN_LEVELS);
+                rv = _remove_hamt(s, &slot->node, hash, bits, depth+1, key,
+                                buf);
+                if (rv == HAMT_REMOVECLEAR) {
+                        _free_hamt_node(s, slot->node);
+                }
+                else if (rv == HAMT_REMOVECOLLAPSE) {
+                        hamt_n * child = slot->node;
+                        slot->list = child->children[0].list;
+                        root->entrymap |= bit;
+                        _free_hamt_node(s, child);
+                }
+        }
+
+        if (rv == HAMT_NOREMOVE || rv < 0)
+                return rv;
+        if (rv == HAMT_REMOVECLEAR)
+                _remove_hamt_child(root, logical_index);
+
+        /* The root stays put however few children it has */
+        if (depth == 0)
+                return HAMT_REMOVENOCLEAR;
+        if (root->bitfield == 0)
+                return HAMT_REMOVECLEAR;
+        if ((root->bitfield & (root->bitfield - 1)) == 0 &&
+                        root->entrymap == root->bitfield)
+                return HAMT_REMOVECOLLAPSE;
+        return HAMT_REMOVENOCLEAR;
+}
+
+/*
+ * Returns 1 on success
+ *      if buffer != NULL, fills buffer with removed value
+ * Returns 0 when key not found
+ * Returns -1 on failure (sets errno)
+ */
+int remove_hamt(HAMT * H, const void * key, void ** buffer)
+{
+        hamt_s * s = (hamt_s *)H;
+        if (s->valid != HAMT_VALID) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (concurrent_hamt(s))
+                return _ctrie_remove_hamt(s, key, buffer);
+
+        /* Don't copy a path shared with a snapshot just to find nothing */
+        if (shared_hamt(s) && _find_hamt_entry(s, key) == NULL)
+                return 0;
+
+        uint32_t hash = (uint32_t)s->info.hash(key);
+        int rv = _remove_hamt(s, &s->root, hash, hash, 0, key, buffer);
+        if (rv > 0) {
+                s->size -= 1;
+                return 1;
+        }
+        else
+                return rv < 0 ? -1 : 0;
+}
+
+int clear_hamt(HAMT *H)
+{
+        hamt_s * s = (hamt_s *)H;
+        if (s->valid != HAMT_VALID) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (concurrent_hamt(s)) {
+                struct ctrie_inode * root = _ctrie_empty();
+                if (root == NULL)
+                        return -1;
+                _ctrie_free(s, s->croot);
+                s->croot = root;
+                s->size = 0;
+                return 0;
+        }
+
+        /* Sole user of the arena: drop it wholesale rather than node by node */
+        if (__atomic_load_n(&s->arena->handles, __ATOMIC_ACQUIRE) == 1) {
+                _drop_hamt_data(s, s->root);
+                _reset_hamt_arena(s->arena);
+        }
+        else {
+                _release_hamt_node(s, s->root);
+        }
+        s->root = _create_hamt_node(s, 0);
+        s->size = 0;
+        return s->root == NULL ? -1 : 0;
+}
+
+HAMT * snapshot_hamt(HAMT * H)
+{
+        hamt_s * s = (hamt_s *)H;
+        if (s->valid != HAMT_VALID || concurrent_hamt(s)) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        hamt_s * rv = (hamt_s*)malloc(sizeof(*rv));
+        if (rv == NULL)
+                return NULL;
+
+        memcpy(rv, s, sizeof(*rv));
+        __atomic_add_fetch(&s->root->refs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&s->arena->handles, 1, __ATOMIC_ACQ_REL);
+        return (HAMT*)rv;
+}
+
+HAMT * pinsert_hamt(HAMT * H, void * key, void * val)
+{
+        HAMT * rv = snapshot_hamt(H);
+        if (rv == NULL)
+                return NULL;
+
+        if (insert_hamt(rv, key, val) < 0) {
+                free_hamt(rv);
+                return NULL;
+        }
+        return rv;
+}
+
+HAMT * premove_hamt(HAMT * H, const void * key, void ** buf)
+{
+        HAMT * rv = snapshot_hamt(H);
+        if (rv == NULL)
+                return NULL;
+
+        if (remove_hamt(rv, key, buf) < 0) {
+                free_hamt(rv);
+                return NULL;
+        }
+        return rv;
+}
+
+void _stats_hamt(hamt_s * s, hamt_n * root, int depth, struct hamtstats * st)
+{
+        int n = __builtin_popcount(root->bitfield);
+        uint32_t map = root->bitfield;
+        st->nodes += 1;
+        st->slots += n;
+        st->bytes += hamt_node_size(root->cap);
+        for (int i = 0; i < n; ++i) {
+                uint32_t bit = map & -map;
+                if (root->entrymap & bit) {
+                        unsigned int chain = 0;
+                        for (struct hamt_list * it = root->children[i].list;
+                                        it; it = it->next) {
+                                chain += 1;
+                                st->entries += 1;
+                                st->bytes += s->list_size;
+                                st->depth_sum += depth + 1;
+                                if (depth + 1 > st->max_depth)
+                                        st->max_depth = depth + 1;
+                        }
+                        if (chain > st->max_chain)
+                                st->max_chain = chain;
+                }
+                else {
+                        _stats_hamt(s, root->children[i].node, depth+1, st);
+                }
+                map ^= bit;
+        }
+}
+
+/*
+ * Cursors keep the path from the root as a stack of nodes, each with the
+ * bits of its bitfield still to visit; the next child is found with ctz on
+ * those bits rather than by scanning the 32 slots.
+ */
+#if HAMT_CURSOR_DEPTH < HAMT_MAX_LEVEL + 1
+#error "HAMT_CURSOR_DEPTH cannot hold the deepest HAMT path"
+#endif
+
+int begin_range_hamt(HAMT * H, struct hamt_cursor * c, int first, int last)
+{
+        hamt_s * s = (hamt_s *)H;
+        if (s->valid != HAMT_VALID || concurrent_hamt(s) || c == NULL ||
+                        first < 0 || last > 32 || first >= last) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        uint32_t range = (last == 32 ? HAMT_MASK32 : (1u << last) - 1) &
+                ~((1u << first) - 1);
+        c->nodes[0] = s->root;
+        c->pending[0] = s->root->bitfield & range;
+        c->depth = 0;
+        c->entry = NULL;
+        return next_hamt(c);
+}
+
+int begin_hamt(HAMT * H, struct hamt_cursor * c)
+{
+        return begin_range_hamt(H, c, 0, 32);
+}
+
+int next_hamt(struct hamt_cursor * c)
+{
+        struct hamt_list * it = (struct hamt_list *)c->entry;
+        if (it != NULL && it->next != NULL) {
+                it = it->next;
+        }
+        else {
+                it = NULL;
+                while (c->depth >= 0) {
+                        uint32_t pending = c->pending[c->depth];
+                        if (pending == 0) {
+                                c->depth -= 1;
+                                continue;
+                        }
+
+                        hamt_n * node = (hamt_n *)c->nodes[c->depth];
+                        uint32_t bit = pending & -pending;
+                        int physical_index = find_physical_index(
+                                        node->bitfield, __builtin_ctz(bit));
+                        c->pending[c->depth] = pending ^ bit;
+                        if (node->entrymap & bit) {
+                                it = node->children[physical_index].list;
+                                break;
+                        }
+                        node = node->children[physical_index].node;
+                        c->depth += 1;
+                        c->nodes[c->depth] = node;
+                        c->pending[c->depth] = node->bitfield;
+                }
+        }
+
+        c->entry = it;
+        c->key = it ? it->key : NULL;
+        c->value = it ? it->value : NULL;
+        return it != NULL;
+}
+
+int end_hamt(struct hamt_cursor * c)
+{
+        return c->entry == NULL;
+}
+
+int foreach_hamt(HAMT * H, int (*cb)(const void * key, void * value,
+                        void * arg), void * arg)
+{
+        struct hamt_cursor c;
+        int rv = begin_hamt(H, &c);
+        if (rv < 0)
+                return -1;
+
+        for (; rv > 0; rv = next_hamt(&c)) {
+                int stop = cb(c.key, c.value, arg);
+                if (stop != 0)
+                        return stop;
+        }
+        return 0;
+}
+
+int stats_hamt(HAMT * H, struct hamtstats * st)
+{
+        hamt_s * s = (hamt_s *)H;
+        if (s->valid != HAMT_VALID || st == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        memset(st, 0, sizeof(*st));
+        st->bytes = sizeof(*s);
+        if (concurrent_hamt(s))
+                _ctrie_stats(s, s->croot, 0, st);
+        else
+                _stats_hamt(s, s->root, 0, st);
         return 0;
 }
+
+/*
+ * Concurrent mode (Ctrie)
+ *
+ * Every node hangs off an indirection node (INode) whose 'main' pointer is
+ * the only thing ever modified: an update builds a new main node and swaps
+ * it in with a single CAS, retrying from the top if another writer got
+ * there first.  Main nodes are immutable once published, so lookups never
+ * lock, write, or retry.  A main node is one of
+ *      CNode: a HAMT node whose slots hold INodes or entries (entrymap)
+ *      TNode: a tomb holding the last entry of a removed-from CNode, which
+ *             the parent folds back into its own slot ('cleaning')
+ *      LNode: the entries whose hashes agree on every level
+ * Replaced nodes are freed through epoch-based reclamation once no thread
+ * can still be reading them.
+ */
+
+/* Restarts an update from the root after a lost CAS */
+#define CTRIE_RESTART 2
+
+/* Tag for retired entries (vs. plain nodes) in limbo lists */
+#define CTRIE_RETIRED_ENTRY ((uintptr_t)1)
+
+/* Retired objects are reclaimed this many retires apart, at most */
+#define CTRIE_ADVANCE_PERIOD 64
+
+/*
+ * Thread-local epoch record.  'local' is (epoch << 1) | 1 while the thread
+ * is inside an operation and 0 otherwise.  Objects retired during epoch e
+ * sit in limbo[e % 3] until the global epoch reaches e + 2.
+ */
+struct hamt_limbo {
+        uintptr_t * items;
+        size_t n, cap;
+        uint64_t epoch;
+};
+
+struct hamt_epoch_rec {
+        uint64_t local;
+        int in_use;
+        unsigned int retires;
+        struct hamt_limbo limbo[3];
+        struct hamt_epoch_rec * next;
+};
+
+struct hamt_epoch {
+        uint64_t global;
+        struct hamt_epoch_rec * recs;
+        pthread_key_t key;
+};
+
+struct ctrie_inode {
+        struct ctrie_main * main;
+};
+
+union ctrie_slot {
+        struct ctrie_inode * inode;
+        struct hamt_list * list;
+};
+
+struct ctrie_main {
+        uint32_t kind;                  /* CTRIE_CNODE/TNODE/LNODE */
+        uint32_t bitfield;              /* CNode slots, or LNode/TNode count */
+        uint32_t entrymap;              /* CNode slots holding an entry */
+        union ctrie_slot children[];
+};
+
+#define ctrie_main_size(nchildren) \
+        (sizeof(struct ctrie_main) + (nchildren) * sizeof(union ctrie_slot))
+#define ctrie_count(m) ((m)->kind == CTRIE_CNODE ? \
+                __builtin_popcount((m)->bitfield) : (int)(m)->bitfield)
+
+static void _ctrie_release_rec(void * p)
+{
+        struct hamt_epoch_rec * rec = (struct hamt_epoch_rec *)p;
+        __atomic_store_n(&rec->local, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/* Frees everything in 'l' (the caller knows no reader can still see it) */
+static void _ctrie_reclaim(hamt_s * s, struct hamt_limbo * l)
+{
+        for (size_t i = 0; i < l->n; ++i) {
+                if (l->items[i] & CTRIE_RETIRED_ENTRY)
+                        _free_hamt_list_node(s, (struct hamt_list *)
+                                        (l->items[i] & ~CTRIE_RETIRED_ENTRY));
+                else
+                        free((void *)l->items[i]);
+        }
+        l->n = 0;
+}
+
+/* Returns the calling thread's epoch record, claiming one on first use */
+static struct hamt_epoch_rec * _ctrie_rec(hamt_s * s)
+{
+        struct hamt_epoch * ep = s->epoch;
+        struct hamt_epoch_rec * rec = pthread_getspecific(ep->key);
+        if (rec != NULL)
+                return rec;
+
+        /* Reuse the record of an exited thread, limbo and all */
+        for (rec = __atomic_load_n(&ep->recs, __ATOMIC_ACQUIRE); rec;
+                        rec = rec->next) {
+                int free_rec = 0;
+                if (__atomic_compare_exchange_n(&rec->in_use, &free_rec, 1,
+                                0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                        break;
+        }
+
+        if (rec == NULL) {
+                rec = (struct hamt_epoch_rec *)calloc(1, sizeof(*rec));
+                if (rec == NULL)
+                        return NULL;
+                rec->in_use = 1;
+                rec->next = __atomic_load_n(&ep->recs, __ATOMIC_RELAXED);
+                while (!__atomic_compare_exchange_n(&ep->recs, &rec->next,
+                                rec, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                        ;
+        }
+
+        if (pthread_setspecific(ep->key, rec) != 0) {
+                _ctrie_release_rec(rec);
+                return NULL;
+        }
+        return rec;
+}
+
+/* Announces that the calling thread may read nodes of 's' */
+static struct hamt_epoch_rec * _ctrie_enter(hamt_s * s)
+{
+        struct hamt_epoch_rec * rec = _ctrie_rec(s);
+        if (rec == NULL)
+                return NULL;
+
+        uint64_t e = __atomic_load_n(&s->epoch->global, __ATOMIC_ACQUIRE);
+        for (;;) {
+                __atomic_store_n(&rec->local, (e << 1) | 1, __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                uint64_t now = __atomic_load_n(&s->epoch->global,
+                                __ATOMIC_ACQUIRE);
+                if (now == e)
+                        return rec;
+                e = now;
+        }
+}
+
+static void _ctrie_exit(struct hamt_epoch_rec * rec)
+{
+        __atomic_store_n(&rec->local, 0, __ATOMIC_RELEASE);
+}
+
+/* Moves the global epoch on if every active thread has caught up to it */
+static void _ctrie_try_advance(hamt_s * s, struct hamt_epoch_rec * self)
+{
+        struct hamt_epoch * ep = s->epoch;
+        uint64_t e = __atomic_load_n(&ep->global, __ATOMIC_ACQUIRE);
+        for (struct hamt_epoch_rec * rec =
+                        __atomic_load_n(&ep->recs, __ATOMIC_ACQUIRE);
+                        rec; rec = rec->next) {
+                uint64_t local = __atomic_load_n(&rec->local,
+                                __ATOMIC_ACQUIRE);
+                if ((local & 1) && (local >> 1) != e)
+                        return;
+        }
+
+        if (__atomic_compare_exchange_n(&ep->global, &e, e + 1, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                e += 1;
+
+        for (int i = 0; i < 3; ++i)
+                if (self->limbo[i].n && self->limbo[i].epoch + 2 <= e)
+                        _ctrie_reclaim(s, &self->limbo[i]);
+}
+
+/*
+ * Hands an unlinked node (or, with CTRIE_RETIRED_ENTRY, an entry) over to
+ * be freed once every thread that might still see it has moved on
+ */
+static void _ctrie_retire(hamt_s * s, struct hamt_epoch_rec * rec, void * p,
+                uintptr_t tag)
+{
+        uint64_t e = __atomic_load_n(&s->epoch->global, __ATOMIC_ACQUIRE);
+        struct hamt_limbo * l = &rec->limbo[e % 3];
+        if (l->epoch != e) {
+                /* Left over from epoch e - 3 or earlier: safe now */
+                _ctrie_reclaim(s, l);
+                l->epoch = e;
+        }
+
+        if (l->n == l->cap) {
+                size_t cap = l->cap ? 2 * l->cap : 64;
+                uintptr_t * items = realloc(l->items, cap * sizeof(*items));
+                if (items == NULL)
+                        return; /* Leak rather than free too early */
+                l->items = items;
+                l->cap = cap;
+        }
+        l->items[l->n++] = (uintptr_t)p | tag;
+
+        if (++rec->retires % CTRIE_ADVANCE_PERIOD == 0)
+                _ctrie_try_advance(s, rec);
+}
+
+static struct ctrie_main * _ctrie_load(struct ctrie_inode * i)
+{
+        return __atomic_load_n(&i->main, __ATOMIC_ACQUIRE);
+}
+
+static int _ctrie_cas(struct ctrie_inode * i, struct ctrie_main * old,
+                struct ctrie_main * new)
+{
+        return __atomic_compare_exchange_n(&i->main, &old, new, 0,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static struct ctrie_main * _ctrie_new_main(uint32_t kind, int nchildren)
+{
+        struct ctrie_main * rv =
+                (struct ctrie_main *)malloc(ctrie_main_size(nchildren));
+        if (rv != NULL) {
+                rv->kind = kind;
+                rv->bitfield = rv->entrymap = 0;
+        }
+        return rv;
+}
+
+static struct ctrie_inode * _ctrie_new_inode(struct ctrie_main * main)
+{
+        struct ctrie_inode * rv =
+                (struct ctrie_inode *)malloc(sizeof(*rv));
+        if (rv != NULL)
+                rv->main = main;
+        return rv;
+}
+
+/* Copy of CNode 'cn' with 'child' put in the empty slot 'logical_index' */
+static struct ctrie_main * _ctrie_inserted(struct ctrie_main * cn,
+                int logical_index, union ctrie_slot child, int is_entry)
+{
+        int n = __builtin_popcount(cn->bitfield);
+        int pi = find_physical_index(cn->bitfield, logical_index);
+        struct ctrie_main * rv = _ctrie_new_main(CTRIE_CNODE, n + 1);
+        if (rv == NULL)
+                return NULL;
+
+        memcpy(rv->children, cn->children, pi * sizeof(union ctrie_slot));
+        rv->children[pi] = child;
+        memcpy(&rv->children[pi + 1], &cn->children[pi],
+                        (n - pi) * sizeof(union ctrie_slot));
+        rv->bitfield = cn->bitfield | (1u << logical_index);
+        rv->entrymap = cn->entrymap | (is_entry ? 1u << logical_index : 0);
+        return rv;
+}
+
+/* Copy of CNode 'cn' with the slot 'logical_index' replaced by 'child' */
+static struct ctrie_main * _ctrie_updated(struct ctrie_main * cn,
+                int logical_index, union ctrie_slot child, int is_entry)
+{
+        int n = __builtin_popcount(cn->bitfield);
+        struct ctrie_main * rv = _ctrie_new_main(CTRIE_CNODE, n);
+        if (rv == NULL)
+                return NULL;
+
+        memcpy(rv->children, cn->children, n * sizeof(union ctrie_slot));
+        rv->children[find_physical_index(cn->bitfield, logical_index)] = child;
+        rv->bitfield = cn->bitfield;
+        rv->entrymap = (cn->entrymap & ~(1u << logical_index)) |
+                (is_entry ? 1u << logical_index : 0);
+        return rv;
+}
+
+/*
+ * Turns a CNode below the root that is down to a single entry into a TNode,
+ * so its parent can take the entry back.  Returns the node to publish.
+ */
+static struct ctrie_main * _ctrie_contracted(struct ctrie_main * cn, int depth)
+{
+        if (depth == 0 || __builtin_popcount(cn->bitfield) != 1 ||
+                        cn->entrymap != cn->bitfield)
+                return cn;
+
+        struct ctrie_main * rv = _ctrie_new_main(CTRIE_TNODE, 1);
+        if (rv == NULL)
+                return cn;      /* Still correct, just not compact */
+        rv->bitfield = 1;
+        rv->children[0] = cn->children[0];
+        free(cn);
+        return rv;
+}
+
+/* Frees a main node built by _ctrie_branch, but not the node it parts */
+static void _ctrie_free_branch(struct ctrie_main * m)
+{
+        for (;;) {
+                struct ctrie_main * next = NULL;
+                if (__builtin_popcount(m->bitfield) == 1) {
+                        next = m->children[0].inode->main;
+                        free(m->children[0].inode);
+                }
+                else if (m->entrymap != m->bitfield) {
+                        /* The INode parted from the entry is ours */
+                        uint32_t low = m->bitfield & -m->bitfield;
+                        free(m->children[(m->entrymap & low) != 0].inode);
+                }
+                free(m);
+                if (next == NULL)
+                        return;
+                m = next;
+        }
+}
+
+/*
+ * Builds the CNode for 'depth' that parts 'a' (an entry, or an INode if
+ * !a_is_entry) from the entry 'b' at 'split_depth', through single-child
+ * CNodes following 'path' (see _find_split_depth).  Returns NULL on failure,
+ * in which case neither 'a' nor 'b' is freed.
+ */
+static struct ctrie_main * _ctrie_branch(union ctrie_slot a, int a_is_entry,
+                struct hamt_list * b, int depth, int split_depth,
+                const int * path)
+{
+        int ia = path[split_depth] >> 8;
+        int ib = path[split_depth] & 0xff;
+
+        struct ctrie_main * m = _ctrie_new_main(CTRIE_CNODE, 2);
+        if (m == NULL)
+                return NULL;
+        m->bitfield = (1u << ia) | (1u << ib);
+        m->entrymap = (a_is_entry ? 1u << ia : 0) | (1u << ib);
+        m->children[ia > ib] = a;
+        m->children[ia < ib].list = b;
+
+        for (int d = split_depth - 1; d >= depth; --d) {
+                struct ctrie_inode * i = _ctrie_new_inode(m);
+                struct ctrie_main * parent =
+                        i ? _ctrie_new_main(CTRIE_CNODE, 1) : NULL;
+                if (parent == NULL) {
+                        free(i);
+                        _ctrie_free_branch(m);
+                        return NULL;
+                }
+                parent->bitfield = 1u << path[d];
+                parent->children[0].inode = i;
+                m = parent;
+        }
+        return m;
+}
+
+/*
+ * Builds the INode for 'depth' holding entries 'a' and 'b' (which share
+ * the hash bits above 'depth'), or an LNode if they never part.  Returns
+ * NULL on failure.
+ */
+static struct ctrie_inode * _ctrie_dual(hamt_s * s, struct hamt_list * a,
+                struct hamt_list * b, int depth)
+{
+        int path[HAMT_MAX_LEVEL];
+        int split_depth = _find_split_depth(s, a, b, depth, path);
+        struct ctrie_main * m;
+
+        if (split_depth < 0) {
+                m = _ctrie_new_main(CTRIE_LNODE, 2);
+                if (m == NULL)
+                        return NULL;
+                m->bitfield = 2;
+                m->children[0].list = a;
+                m->children[1].list = b;
+        }
+        else {
+                union ctrie_slot slot;
+                slot.list = a;
+                m = _ctrie_branch(slot, 1, b, depth, split_depth, path);
+                if (m == NULL)
+                        return NULL;
+        }
+
+        struct ctrie_inode * rv = _ctrie_new_inode(m);
+        if (rv == NULL) {
+                if (m->kind == CTRIE_LNODE)
+                        free(m);
+                else
+                        _ctrie_free_branch(m);
+        }
+        return rv;
+}
+
+/* Frees an INode built by _ctrie_dual that was never published */
+static void _ctrie_free_dual(struct ctrie_inode * i)
+{
+        if (i->main->kind == CTRIE_LNODE)
+                free(i->main);
+        else
+                _ctrie_free_branch(i->main);
+        free(i);
+}
+
+/*
+ * Folds tombed children of the CNode under 'i' (at 'depth') back into it.
+ * Best effort: if another writer changes 'i' first, they will clean it.
+ */
+static void _ctrie_clean(hamt_s * s, struct hamt_epoch_rec * rec,
+                struct ctrie_inode * i, int depth)
+{
+        struct ctrie_main * m = _ctrie_load(i);
+        if (m->kind != CTRIE_CNODE)
+                return;
+
+        int n = __builtin_popcount(m->bitfield);
+        struct ctrie_main * rv = _ctrie_new_main(CTRIE_CNODE, n);
+        if (rv == NULL)
+                return;
+
+        rv->bitfield = m->bitfield;
+        rv->entrymap = m->entrymap;
+        uint32_t map = m->bitfield;
+        for (int k = 0; k < n; ++k) {
+                uint32_t bit = map & -map;
+                rv->children[k] = m->children[k];
+                if ((m->entrymap & bit) == 0) {
+                        struct ctrie_main * sub =
+                                _ctrie_load(m->children[k].inode);
+                        if (sub->kind == CTRIE_TNODE) {
+                                rv->children[k].list = sub->children[0].list;
+                                rv->entrymap |= bit;
+                        }
+                }
+                map ^= bit;
+        }
+
+        struct ctrie_main * cntr = _ctrie_contracted(rv, depth);
+        if (!_ctrie_cas(i, m, cntr)) {
+                free(cntr);
+                return;
+        }
+
+        /* The resurrected INodes and their tombs are unreachable now */
+        map = m->bitfield;
+        for (int k = 0; k < n; ++k) {
+                uint32_t bit = map & -map;
+                if ((m->entrymap & bit) == 0) {
+                        struct ctrie_main * sub =
+                                _ctrie_load(m->children[k].inode);
+                        if (sub->kind == CTRIE_TNODE) {
+                                _ctrie_retire(s, rec, m->children[k].inode, 0);
+                                _ctrie_retire(s, rec, sub, 0);
+                        }
+                }
+                map ^= bit;
+        }
+        _ctrie_retire(s, rec, m, 0);
+}
+
+/*
+ * After a remove left 'i' (the child of 'p' at 'depth') a TNode, replaces
+ * 'i' in 'p' with the tombed entry
+ */
+static void _ctrie_clean_parent(hamt_s * s, struct hamt_epoch_rec * rec,
+                struct ctrie_inode * p, struct ctrie_inode * i, uint32_t bits,
+                int depth)
+{
+        for (;;) {
+                struct ctrie_main * m = _ctrie_load(i);
+                struct ctrie_main * pm = _ctrie_load(p);
+                if (m->kind != CTRIE_TNODE || pm->kind != CTRIE_CNODE)
+                        return;
+
+                int logical_index = find_logical_index(bits, depth);
+                uint32_t bit = 1u << logical_index;
+                if ((pm->bitfield & bit) == 0 || (pm->entrymap & bit))
+                        return;
+                int pi = find_physical_index(pm->bitfield, logical_index);
+                if (pm->children[pi].inode != i)
+                        return;
+
+                struct ctrie_main * ncn = _ctrie_updated(pm, logical_index,
+                                m->children[0], 1);
+                if (ncn == NULL)
+                        return;
+                struct ctrie_main * cntr = _ctrie_contracted(ncn, depth);
+                if (_ctrie_cas(p, pm, cntr)) {
+                        _ctrie_retire(s, rec, pm, 0);
+                        _ctrie_retire(s, rec, i, 0);
+                        _ctrie_retire(s, rec, m, 0);
+                        return;
+                }
+                free(cntr);
+        }
+}
+
+/* Returns the entry holding 'key', or NULL.  Never blocks or retries. */
+static struct hamt_list * _ctrie_find(hamt_s * s, const void * key)
+{
+        uint32_t hash = (uint32_t)s->info.hash(key);
+        uint32_t bits = hash;
+        struct ctrie_inode * i = s->croot;
+
+        for (int depth = 0; ; ++depth) {
+                struct ctrie_main * m = _ctrie_load(i);
+                if (m->kind != CTRIE_CNODE) {
+                        for (int k = 0; k < (int)m->bitfield; ++k) {
+                                struct hamt_list * e = m->children[k].list;
+                                if (e->hash == hash &&
+                                                _cmp_hamt_key(s, e->key, key) == 0)
+                                        return e;
+                        }
+                        return NULL;
+                }
+
+                if (depth > 0 && starts_hamt_gen(depth))
+                        bits = _rehash_hamt(s, key, depth / HAMT_GEN_LEVELS);
+
+                int logical_index = find_logical_index(bits, depth);
+                uint32_t bit = 1u << logical_index;
+                if ((m->bitfield & bit) == 0)
+                        return NULL;
+
+                int pi = find_physical_index(m->bitfield, logical_index);
+                if (m->entrymap & bit) {
+                        struct hamt_list * e = m->children[pi].list;
+                        if (e->hash == hash && _cmp_hamt_key(s, e->key, key) == 0)
+                                return e;
+                        return NULL;
+                }
+                i = m->children[pi].inode;
+        }
+}
+
+/*
+ * Publishes the prebuilt entry 'sn' for its key below 'i' (at 'depth').
+ * Returns 1 if the key is new, 0 if it replaced an entry, CTRIE_RESTART if
+ * another writer interfered, -1 on failure.
+ */
+static int _ctrie_insert(hamt_s * s, struct hamt_epoch_rec * rec,
+                struct ctrie_inode * i, struct ctrie_inode * parent,
+                uint32_t bits, int depth, struct hamt_list * sn)
+{
+        struct ctrie_main * m = _ctrie_load(i);
+
+        if (m->kind == CTRIE_TNODE) {
+                _ctrie_clean(s, rec, parent, depth - 1);
+                return CTRIE_RESTART;
+        }
+
+        if (m->kind == CTRIE_LNODE) {
+                int path[HAMT_MAX_LEVEL];
+                int split_depth = _find_split_depth(s, m->children[0].list,
+                                sn, depth, path);
+                if (split_depth >= 0) {
+                        /* 'sn' parts from the colliding keys further down */
+                        union ctrie_slot ln;
+                        ln.inode = _ctrie_new_inode(m);
+                        if (ln.inode == NULL)
+                                return -1;
+                        struct ctrie_main * ncn = _ctrie_branch(ln, 0, sn,
+                                        depth, split_depth, path);
+                        if (ncn == NULL) {
+                                free(ln.inode);
+                                return -1;
+                        }
+                        if (!_ctrie_cas(i, m, ncn)) {
+                                _ctrie_free_branch(ncn);
+                                return CTRIE_RESTART;
+                        }
+                        return 1;
+                }
+
+                int n = m->bitfield, k;
+                for (k = 0; k < n; ++k)
+                        if (_cmp_hamt_key(s, m->children[k].list->key,
+                                                sn->key) == 0)
+                                break;
+
+                struct ctrie_main * ln = _ctrie_new_main(CTRIE_LNODE,
+                                k < n ? n : n + 1);
+                if (ln == NULL)
+                        return -1;
+                memcpy(ln->children, m->children, n * sizeof(union ctrie_slot));
+                ln->children[k].list = sn;
+                ln->bitfield = k < n ? n : n + 1;
+                if (!_ctrie_cas(i, m, ln)) {
+                        free(ln);
+                        return CTRIE_RESTART;
+                }
+                _ctrie_retire(s, rec, m, 0);
+                if (k < n)
+                        _ctrie_retire(s, rec, m->children[k].list,
+                                        CTRIE_RETIRED_ENTRY);
+                return k < n ? 0 : 1;
+        }
+
+        int logical_index = find_logical_index(bits, depth);
+        uint32_t bit = 1u << logical_index;
+        union ctrie_slot child;
+        struct ctrie_main * ncn;
+        int rv = 1;
+
+        if ((m->bitfield & bit) == 0) {
+                child.list = sn;
+                ncn = _ctrie_inserted(m, logical_index, child, 1);
+                if (ncn == NULL)
+                        return -1;
+                if (!_ctrie_cas(i, m, ncn)) {
+                        free(ncn);
+                        return CTRIE_RESTART;
+                }
+                _ctrie_retire(s, rec, m, 0);
+                return 1;
+        }
+
+        int pi = find_physical_index(m->bitfield, logical_index);
+        if ((m->entrymap & bit) == 0) {
+                if (starts_hamt_gen(depth + 1))
+                        bits = _rehash_hamt(s, sn->key,
+                                        (depth + 1) / HAMT_GEN_LEVELS);
+                return _ctrie_insert(s, rec, m->children[pi].inode, i, bits,
+                                depth + 1, sn);
+        }
+
+        struct hamt_list * old = m->children[pi].list;
+        if (old->hash == sn->hash && _cmp_hamt_key(s, old->key, sn->key) == 0) {
+                child.list = sn;
+                ncn = _ctrie_updated(m, logical_index, child, 1);
+                rv = 0;
+        }
+        else {
+                child.inode = _ctrie_dual(s, old, sn, depth + 1);
+                if (child.inode == NULL)
+                        return -1;
+                ncn = _ctrie_updated(m, logical_index, child, 0);
+                if (ncn == NULL)
+                        _ctrie_free_dual(child.inode);
+        }
+        if (ncn == NULL)
+                return -1;
+
+        if (!_ctrie_cas(i, m, ncn)) {
+                if (rv == 1)
+                        _ctrie_free_dual(child.inode);
+                free(ncn);
+                return CTRIE_RESTART;
+        }
+
+        _ctrie_retire(s, rec, m, 0);
+        if (rv == 0)
+                _ctrie_retire(s, rec, old, CTRIE_RETIRED_ENTRY);
+        return rv;
+}
+
+/*
+ * Removes 'key' from below 'i' (at 'depth'), copying its value to 'buf'.
+ * Returns 1 if removed, 0 if not found, CTRIE_RESTART if another writer
+ * interfered, -1 on failure.
+ */
+static int _ctrie_remove(hamt_s * s, struct hamt_epoch_rec * rec,
+                struct ctrie_inode * i, struct ctrie_inode * parent,
+                uint32_t hash, uint32_t bits, int depth, const void * key,
+                void ** buf)
+{
+        struct ctrie_main * m = _ctrie_load(i);
+        struct ctrie_main * nm;
+        struct hamt_list * victim;
+
+        if (m->kind == CTRIE_TNODE) {
+                _ctrie_clean(s, rec, parent, depth - 1);
+                return CTRIE_RESTART;
+        }
+
+        if (m->kind == CTRIE_LNODE) {
+                int n = m->bitfield, k;
+                for (k = 0; k < n; ++k)
+                        if (m->children[k].list->hash == hash &&
+                                        _cmp_hamt_key(s,
+                                                m->children[k].list->key,
+                                                key) == 0)
+                                break;
+                if (k == n)
+                        return 0;
+
+                victim = m->children[k].list;
+                /* A lone survivor is tombed so the parent takes it back */
+                nm = _ctrie_new_main(n == 2 ? CTRIE_TNODE : CTRIE_LNODE,
+                                n - 1);
+                if (nm == NULL)
+                        return -1;
+                memcpy(nm->children, m->children, k * sizeof(union ctrie_slot));
+                memcpy(&nm->children[k], &m->children[k + 1],
+                                (n - k - 1) * sizeof(union ctrie_slot));
+                nm->bitfield = n - 1;
+        }
+        else {
+                int logical_index = find_logical_index(bits, depth);
+                uint32_t bit = 1u << logical_index;
+                if ((m->bitfield & bit) == 0)
+                        return 0;
+
+                int pi = find_physical_index(m->bitfield, logical_index);
+                if ((m->entrymap & bit) == 0) {
+                        struct ctrie_inode * sub = m->children[pi].inode;
+                        uint32_t nbits = bits;
+                        if (starts_hamt_gen(depth + 1))
+                                nbits = _rehash_hamt(s, key,
+                                                (depth + 1) / HAMT_GEN_LEVELS);
+                        int rv = _ctrie_remove(s, rec, sub, i, hash, nbits,
+                                        depth + 1, key, buf);
+                        if (rv == 1 && _ctrie_load(sub)->kind == CTRIE_TNODE)
+                                _ctrie_clean_parent(s, rec, i, sub, bits, depth);
+                        return rv;
+                }
+
+                victim = m->children[pi].list;
+                if (victim->hash != hash ||
+                                _cmp_hamt_key(s, victim->key, key) != 0)
+                        return 0;
+
+                int n = __builtin_popcount(m->bitfield);
+                nm = _ctrie_new_main(CTRIE_CNODE, n - 1);
+                if (nm == NULL)
+                        return -1;
+                memcpy(nm->children, m->children, pi * sizeof(union ctrie_slot));
+                memcpy(&nm->children[pi], &m->children[pi + 1],
+                                (n - pi - 1) * sizeof(union ctrie_slot));
+                nm->bitfield = m->bitfield & ~bit;
+                nm->entrymap = m->entrymap & ~bit;
+                nm = _ctrie_contracted(nm, depth);
+        }
+
+        if (!_ctrie_cas(i, m, nm)) {
+                free(nm);
+                return CTRIE_RESTART;
+        }
+
+        /* Still readable until retired entries are reclaimed */
+        if (buf != NULL)
+                _get_hamt_value(s, victim, buf);
+        _ctrie_retire(s, rec, m, 0);
+        _ctrie_retire(s, rec, victim, CTRIE_RETIRED_ENTRY);
+        return 1;
+}
+
+/* Frees a whole concurrent trie; nothing else may be using it */
+static void _ctrie_free(hamt_s * s, struct ctrie_inode * i)
+{
+        struct ctrie_main * m = i->main;
+        int n = ctrie_count(m);
+        uint32_t map = m->kind == CTRIE_CNODE ? m->bitfield : 0;
+        for (int k = 0; k < n; ++k) {
+                uint32_t bit = map & -map;
+                if (m->kind != CTRIE_CNODE || (m->entrymap & bit))
+                        _free_hamt_list_node(s, m->children[k].list);
+                else
+                        _ctrie_free(s, m->children[k].inode);
+                map ^= bit;
+        }
+        free(m);
+        free(i);
+}
+
+static struct ctrie_inode * _ctrie_empty(void)
+{
+        struct ctrie_main * m = _ctrie_new_main(CTRIE_CNODE, 0);
+        struct ctrie_inode * rv = m ? _ctrie_new_inode(m) : NULL;
+        if (rv == NULL)
+                free(m);
+        return rv;
+}
+
+HAMT * init_concurrent_hamt(struct hamtinfo * info)
+{
+        hamt_s * s = _new_hamt(info, 1);
+        if (s == NULL)
+                return NULL;
+
+        s->epoch = (struct hamt_epoch *)calloc(1, sizeof(*s->epoch));
+        s->croot = _ctrie_empty();
+        if (s->epoch == NULL || s->croot == NULL ||
+                        pthread_key_create(&s->epoch->key,
+                                _ctrie_release_rec) != 0) {
+                if (s->croot)
+                        _ctrie_free(s, s->croot);
+                free(s->epoch);
+                s->epoch = NULL;
+                s->croot = NULL;
+                free_hamt((HAMT *)s);
+                errno = ENOMEM;
+                return NULL;
+        }
+        return (HAMT *)s;
+}
+
+static int _ctrie_insert_hamt(hamt_s * s, const void * key, const void * val)
+{
+        uint32_t hash = (uint32_t)s->info.hash(key);
+        struct hamt_list * sn = _make_hamt_list_node(s, hash, key, val, NULL);
+        if (sn == NULL)
+                return -1;
+
+        struct hamt_epoch_rec * rec = _ctrie_enter(s);
+        if (rec == NULL) {
+                _free_hamt_list_node(s, sn);
+                return -1;
+        }
+
+        int rv;
+        do {
+                rv = _ctrie_insert(s, rec, s->croot, NULL, hash, 0, sn);
+        } while (rv == CTRIE_RESTART);
+        _ctrie_exit(rec);
+
+        if (rv < 0)
+                _free_hamt_list_node(s, sn);
+        else if (rv > 0)
+                __atomic_add_fetch(&s->size, 1, __ATOMIC_RELAXED);
+        return rv;
+}
+
+static int _ctrie_find_hamt(hamt_s * s, const void * key, void ** buf)
+{
+        struct hamt_epoch_rec * rec = _ctrie_enter(s);
+        if (rec == NULL)
+                return -1;
+
+        struct hamt_list * it = _ctrie_find(s, key);
+        if (it != NULL)
+                _get_hamt_value(s, it, buf);
+        else if (!inline_elems(s))
+                *buf = NULL;
+        _ctrie_exit(rec);
+        return it != NULL;
+}
+
+static int _ctrie_remove_hamt(hamt_s * s, const void * key, void ** buf)
+{
+        uint32_t hash = (uint32_t)s->info.hash(key);
+        struct hamt_epoch_rec * rec = _ctrie_enter(s);
+        if (rec == NULL)
+                return -1;
+
+        int rv;
+        do {
+                rv = _ctrie_remove(s, rec, s->croot, NULL, hash, hash, 0,
+                                key, buf);
+        } while (rv == CTRIE_RESTART);
+        _ctrie_exit(rec);
+
+        if (rv > 0)
+                __atomic_sub_fetch(&s->size, 1, __ATOMIC_RELAXED);
+        return rv;
+}
+
+/* Releases everything retired; nothing else may be using 's' */
+static void _ctrie_free_epoch(hamt_s * s)
+{
+        struct hamt_epoch_rec * rec = s->epoch->recs, * next;
+        while (rec) {
+                next = rec->next;
+                for (int k = 0; k < 3; ++k) {
+                        _ctrie_reclaim(s, &rec->limbo[k]);
+                        free(rec->limbo[k].items);
+                }
+                free(rec);
+                rec = next;
+        }
+        pthread_key_delete(s->epoch->key);
+        free(s->epoch);
+        s->epoch = NULL;
+}
+
+static void _ctrie_stats(hamt_s * s, struct ctrie_inode * i, int depth,
+                struct hamtstats * st)
+{
+        struct ctrie_main * m = _ctrie_load(i);
+        int n = ctrie_count(m);
+        uint32_t map = m->kind == CTRIE_CNODE ? m->bitfield : 0;
+
+        st->nodes += 1;
+        st->slots += n;
+        st->bytes += sizeof(*i) + ctrie_main_size(n);
+        if (m->kind == CTRIE_LNODE && (unsigned)n > st->max_chain)
+                st->max_chain = n;
+        for (int k = 0; k < n; ++k) {
+                uint32_t bit = map & -map;
+                if (m->kind != CTRIE_CNODE || (m->entrymap & bit)) {
+                        st->entries += 1;
+                        st->bytes += s->list_size;
+                        st->depth_sum += depth + 1;
+                        if (depth + 1 > st->max_depth)
+                                st->max_depth = depth + 1;
+                        if (st->max_chain == 0)
+                                st->max_chain = 1;
+                }
+                else {
+                        _ctrie_stats(s, m->children[k].inode, depth + 1, st);
+                }
+                map ^= bit;
+        }
+}
@@ -5,10 +5,16 @@ typedef void * HAMT;
 
 /*
  * struct hamtinfo is used to initialize HAMT
+ *
+ * Fixed-size mode: leave copy_key/free_key NULL to store key_size bytes of
+ * each key inline in the HAMT (cmp_key may then be NULL to use memcmp), and
+ * leave copy_elem/free_elem NULL to store elem_size bytes of each value
+ * inline.  Keys and values are then passed by address, and each insert
+ * costs a single allocation.
 */
 struct hamtinfo {
-        int key_size;
-        int elem_size;
+        int key_size;                   // Key bytes (fixed-size mode)
+        int elem_size;                  // Value bytes (fixed-size mode)
         int (*hash)(const void *);            // Hash callback function
         void * (*copy_elem)(const void *);    // Make copy of element (returns pointer)
         int (*free_elem)(void *);       // Frees copy of element (0 for success)
@@ -17,6 +23,45 @@ struct hamtinfo {
         int (*cmp_key)(const void *, const void *);
                                         // Compares two keys.
                                         // Returns 0 if they are the same.
+        int (*rehash)(const void *, int);
+                                        // Seeded secondary hash (optional).
+                                        // Called with seeds 1, 2, ... once
+                                        // all 32 bits of 'hash' are used,
+                                        // so only keys equal under every
+                                        // seed share a collision list.
+                                        // Defaults to hashing the key bytes
+                                        // in fixed-size mode.
+};
+
+/*
+ * struct hamtstats describes the memory used by a HAMT (see stats_hamt)
+*/
+struct hamtstats {
+        unsigned long nodes;            // Trie nodes allocated
+        unsigned long slots;            // Child pointers held by all nodes
+        unsigned long entries;          // Key/value list entries
+        unsigned long bytes;            // Bytes allocated by the HAMT itself
+                                        // (excludes copy_key/copy_elem data)
+        unsigned long depth_sum;        // Nodes visited to reach each entry
+        unsigned int max_depth;         // Most nodes visited for one entry
+        unsigned int max_chain;         // Longest list of colliding keys
+};
+
+/*
+ * struct hamt_cursor walks the entries of a HAMT (see begin_hamt).  It needs
+ * no allocation and may live on the stack; only 'key' and 'value' are meant
+ * to be read.  'key' is the stored key (its key_size inline bytes in
+ * fixed-size mode, otherwise the result of copy_key), likewise 'value'.
+*/
+#define HAMT_CURSOR_DEPTH 29            // Deepest path through a HAMT
+
+struct hamt_cursor {
+        const void * key;               // Key of the current entry
+        void * value;                   // Value of the current entry
+        void * entry;                   // Private
+        void * nodes[HAMT_CURSOR_DEPTH];
+        unsigned int pending[HAMT_CURSOR_DEPTH];
+        int depth;
 };
 
 /**
@@ -26,6 +71,19 @@ struct hamtinfo {
  **/
 HAMT * init_hamt(struct hamtinfo * info);
 
+/**
+ * @description: Initializes a HAMT that many threads may use at once.
+ *               insert_hamt, find_hamt, remove_hamt and size_hamt are
+ *               lock-free (lookups never block or retry); replaced nodes are
+ *               freed once no thread can still be reading them.
+ *               snapshot_hamt, pinsert_hamt, premove_hamt and find_ref_hamt
+ *               are not supported (EINVAL), and clear_hamt, stats_hamt and
+ *               free_hamt must not run alongside other calls.
+ * @param info:  a filled out struct hamtinfo
+ * @return:      A pointer to a HAMT.  On error, returns NULL (sets errno)
+ **/
+HAMT * init_concurrent_hamt(struct hamtinfo * info);
+
 /**
  * @description: Inserts 'val' at 'key' in 'H'
  * @param H: The HAMT to insert into
@@ -50,6 +108,49 @@ int insert_hamt(HAMT * H, void * key, void * val);
  **/
 int find_hamt(HAMT * H, const void * key, void ** buf);
 
+/**
+ * @description: Looks up 'n' keys at once.  The keys are walked through the
+ *               trie together, level by level, with each key's next node
+ *               prefetched while the others are visited, so the cache misses
+ *               of a batch overlap.  Faster than 'n' calls to find_hamt once
+ *               the HAMT no longer fits in cache.
+ * @param H:     The HAMT to find in
+ * @param keys:  The keys to look up
+ * @param n:     The number of keys
+ * @param bufs:  bufs[i] is the buffer for keys[i], as 'buf' of find_hamt
+ * @param found: If not NULL, found[i] is set to 1 if keys[i] was found and
+ *               to 0 otherwise
+ * @return:      The number of keys found.  On error, returns -1 (sets errno)
+ **/
+int find_many_hamt(HAMT * H, void * const * keys, int n, void ** bufs,
+                int * found);
+
+/**
+ * @description: Inserts vals[i] at keys[i] for i in [0, n), in order (a key
+ *               given twice ends up with its last value).  Keys are located
+ *               in batches as by find_many_hamt before being inserted.
+ * @param H:     The HAMT to insert into
+ * @param keys:  The keys to insert
+ * @param vals:  The values to insert
+ * @param n:     The number of key/value pairs
+ * @return:      The number of new keys inserted.  On error, returns -1 (sets
+ *               errno); the pairs before the failing one are inserted
+ **/
+int insert_many_hamt(HAMT * H, void * const * keys, void * const * vals,
+                int n);
+
+/**
+ * @description: Finds the value associated with 'key' without copying it
+ * @param H: The HAMT to find in
+ * @param key: The key associated with a value
+ * @return: A borrowed pointer to the stored value: the elem_size inline
+ *              bytes in fixed-size mode, otherwise the (void *) slot holding
+ *              the result of copy_elem.  The pointer is valid until 'H' is
+ *              next modified.  Returns NULL if key is not found or on error
+ *              (sets errno).
+ **/
+void * find_ref_hamt(HAMT * H, const void * key);
+
 /**
  * @description: Removes the 'key'/value pair and optionally copies the
  *                      value into 'buf'
@@ -64,6 +165,92 @@ int find_hamt(HAMT * H, const void * key, void ** buf);
  **/
 int remove_hamt(HAMT * H, const void * key, void ** buffer);
 
+/**
+ * @description: Takes a point-in-time snapshot of 'H' in O(1).  The snapshot
+ *               and 'H' share every node; whichever is modified afterwards
+ *               copies only the nodes on the modified path (O(log32 n)), and
+ *               nodes are reference counted so each is freed with its last
+ *               user.  A handle may only be used by one thread at a time, but
+ *               handles sharing nodes may be used and freed concurrently.
+ *               Values found through find_ref_hamt must not be written to
+ *               while they may be shared.
+ * @param H:     The HAMT to snapshot
+ * @return:      A new HAMT (release with free_hamt).  On error, returns NULL
+ *               (sets errno)
+ **/
+HAMT * snapshot_hamt(HAMT * H);
+
+/**
+ * @description: Persistent insert: returns a new version of 'H' with 'val'
+ *               at 'key', leaving 'H' unchanged (see snapshot_hamt)
+ * @return:      The new version (release with free_hamt).  On error, returns
+ *               NULL (sets errno)
+ **/
+HAMT * pinsert_hamt(HAMT * H, void * key, void * val);
+
+/**
+ * @description: Persistent remove: returns a new version of 'H' without
+ *               'key', leaving 'H' unchanged (see snapshot_hamt).  The removed
+ *               value is copied into 'buf' as by remove_hamt
+ * @return:      The new version (release with free_hamt).  On error, returns
+ *               NULL (sets errno)
+ **/
+HAMT * premove_hamt(HAMT * H, const void * key, void ** buf);
+
+/**
+ * @description: Points 'c' at the first entry of 'H'.  Entries are visited in
+ *               trie order (by hash, not by key).  The cursor stays valid
+ *               until 'H' is next modified; to modify while iterating, walk a
+ *               snapshot_hamt instead.  Not supported by concurrent HAMTs.
+ *               Typical use:
+ *                      for (begin_hamt(h, &c); !end_hamt(&c); next_hamt(&c))
+ *                              use(c.key, c.value);
+ * @param H:     The HAMT to walk
+ * @param c:     The cursor to initialize
+ * @return:      1 if 'c' is at an entry, 0 if 'H' is empty.  On error,
+ *               returns -1 (sets errno)
+ **/
+int begin_hamt(HAMT * H, struct hamt_cursor * c);
+
+/**
+ * @description: Like begin_hamt, but 'c' only visits the entries under the
+ *               root slots 'first' to 'last' - 1 (of 32, chosen by the low 5
+ *               bits of the hash).  Disjoint ranges split a HAMT into parts
+ *               that threads can walk in parallel.
+ * @param first: First root slot visited (0 to 31)
+ * @param last:  One past the last root slot visited (first + 1 to 32)
+ * @return:      1 if 'c' is at an entry, 0 if the range is empty.  On error,
+ *               returns -1 (sets errno)
+ **/
+int begin_range_hamt(HAMT * H, struct hamt_cursor * c, int first, int last);
+
+/**
+ * @description: Moves 'c' to the next entry
+ * @param c:     A cursor set up by begin_hamt or begin_range_hamt
+ * @return:      1 if 'c' is at an entry, 0 once every entry has been visited
+ **/
+int next_hamt(struct hamt_cursor * c);
+
+/**
+ * @description: Tells whether 'c' has gone past the last entry
+ * @param c:     A cursor set up by begin_hamt or begin_range_hamt
+ * @return:      1 if there is no current entry, 0 otherwise
+ **/
+int end_hamt(struct hamt_cursor * c);
+
+/**
+ * @description: Calls 'cb' with the key, value (as in struct hamt_cursor) and
+ *               'arg' of every entry of 'H', stopping early if 'cb' returns
+ *               nonzero
+ * @param H:     The HAMT to walk
+ * @param cb:    The callback; must not modify 'H'
+ * @param arg:   Passed through to 'cb'
+ * @return:      0 if every entry was visited, else the nonzero value 'cb'
+ *               returned.  On error, returns -1 (sets errno)
+ **/
+int foreach_hamt(HAMT * H, int (*cb)(const void * key, void * value,
+                        void * arg), void * arg);
+
 /**
  * @description: Returns the size of the HAMT, where size is the number of
  *               distinct key/value pairs
@@ -73,7 +260,18 @@ int remove_hamt(HAMT * H, const void * key, void ** buffer);
 unsigned int size_hamt(HAMT * H);
 
 /**
- * @description: Removes all key/value pairs from the HAMT, 'H'
+ * @description: Walks 'H' and reports how much memory its structure uses
+ * @param H:     The HAMT to inspect
+ * @param st:    Filled with the statistics of 'H'
+ * @return:      0 on success, -1 on failure (sets errno)
+ **/
+int stats_hamt(HAMT * H, struct hamtstats * st);
+
+/**
+ * @description: Removes all key/value pairs from the HAMT, 'H'.  Nodes and
+ *               entries live in a per-HAMT arena, so unless a snapshot still
+ *               shares it this releases the arena in bulk (only copied keys
+ *               and values are freed one by one)
  * @param H: The HAMT to clear
  * @return: 0 on success, -1 on failure (sets errno)
  **/
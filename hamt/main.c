@@ -1,14 +1,25 @@
 #include "hamt.h"
 #include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
 void * copy_int(const void *);
 int free_int(void *);
 int comp_int(const void *, const void *);
 int hash_int(const void *);
+int hash_int_ref(const void *);
+int hash_high_bits(const void *);
+int hash_zero(const void *);
+/* hash_int_ref, noting the size of sized_hamt at each call */
+int hash_sized(const void *);
+HAMT * sized_hamt;
+unsigned int sizes_seen[64];
+int hashes_seen;
+int rehash_str(const void * str, int seed);
 int hash_str(const void * str);
 void * copy_str(const void * str);
 int free_str(void * str);
@@ -16,6 +27,16 @@ int comp_str(const void * a, const void *b);
 int string_int_test(int pows);
 int int_int_test(int pows);
 int string_string_test(int pows);
+int inline_test(int pows);
+int collision_test(int pows);
+int persistent_test(int pows);
+int memory_test(int pows);
+int concurrent_test(int pows);
+int arena_test(int pows);
+int batch_test(int pows);
+int cursor_test(int pows);
+int churn_test(int pows);
+void report_memory(const char * name, HAMT * h);
 
 
 int main(void)
@@ -24,6 +45,15 @@ int main(void)
         string_int_test(20);
         int_int_test(10);
         string_string_test(20);
+        inline_test(16);
+        collision_test(14);
+        persistent_test(16);
+        memory_test(20);
+        concurrent_test(16);
+        arena_test(20);
+        batch_test(16);
+        cursor_test(16);
+        churn_test(16);
         exit(EXIT_SUCCESS);
 }
 
@@ -160,6 +190,950 @@ int string_string_test(int pows)
         return 0;
 }
 
+int inline_test(int pows)
+{
+        printf("Beginning test\n\tKey: int (inline)\n\tValue: long (inline)\n"
+               "\tMax Size: %d\n", 1 << pows);
+
+        struct hamtinfo info = {
+                .key_size = sizeof(int),
+                .elem_size = sizeof(long),
+                .hash = hash_int_ref,
+        };
+        HAMT * h = init_hamt(&info);
+        assert(h);
+
+        for (int i = 0; i < (1 << pows); ++i) {
+                long v = i;
+                int rv = insert_hamt(h, &i, &v);
+                assert(rv == 1);
+        }
+
+        assert(size_hamt(h) == (1 << pows));
+
+        for (int i = 0; i < (1 << pows); ++i) {
+                long * ref = find_ref_hamt(h, &i);
+                assert(ref && *ref == i);
+                *ref = 3L * i;
+        }
+
+        int missing = 1 << pows;
+        assert(find_ref_hamt(h, &missing) == NULL);
+
+        for (int i = 0; i < (1 << pows); ++i) {
+                long v = -1;
+                int rv = find_hamt(h, &i, (void**)&v);
+                assert(rv == 1 && v == 3L * i);
+                v = 5L * i;
+                rv = insert_hamt(h, &i, &v);
+                assert(rv == 0);
+        }
+
+        for (int i = 0; i < (1 << pows); ++i) {
+                long v = -1;
+                int rv = remove_hamt(h, &i, (void**)&v);
+                assert(rv == 1 && v == 5L * i);
+        }
+
+        assert(size_hamt(h) == 0);
+        free_hamt(h);
+        printf("Test Successfull\n\n");
+        return 0;
+}
+
+/*
+ * Keys whose primary hashes collide: ints hashed into the top 7 bits only,
+ * and strings that all hash to 0.  A secondary hash must keep the collision
+ * lists bounded; without one every string shares a single list.
+ */
+int collision_test(int pows)
+{
+        printf("Beginning collision test\n\tMax Size: %d\n", 1 << pows);
+
+        struct hamtinfo int_info = {
+                .key_size = sizeof(int),
+                .elem_size = sizeof(int),
+                .hash = hash_high_bits,
+        };
+        struct hamtinfo str_info = {
+                .key_size = sizeof( char *),
+                .elem_size = sizeof( int ),
+                .hash = hash_zero,
+                .copy_elem = copy_int,
+                .free_elem = free_int,
+                .copy_key = copy_str,
+                .free_key = free_str,
+                .cmp_key = comp_str,
+                .rehash = rehash_str
+        };
+        struct hamtstats st;
+        char buffer[20];
+
+        HAMT * h = init_hamt(&int_info);
+        assert(h);
+        for (int i = 0; i < (1 << pows); ++i)
+                insert_hamt(h, &i, &i);
+        for (int i = 0; i < (1 << pows); ++i) {
+                int * ref = find_ref_hamt(h, &i);
+                assert(ref && *ref == i);
+        }
+        assert(stats_hamt(h, &st) == 0 && st.max_chain == 1);
+        report_memory("top-bits int", h);
+        for (int i = 0; i < (1 << pows); ++i)
+                assert(remove_hamt(h, &i, NULL) == 1);
+        assert(size_hamt(h) == 0);
+        free_hamt(h);
+
+        h = init_hamt(&str_info);
+        assert(h);
+        for (int i = 0; i < (1 << pows); ++i) {
+                sprintf(buffer, "%d", i);
+                insert_hamt(h, (void*)buffer, (void*)(uintptr_t)i);
+        }
+        assert(stats_hamt(h, &st) == 0 && st.max_chain == 1);
+        report_memory("zero-hash str", h);
+        for (int i = 0; i < (1 << pows); ++i) {
+                sprintf(buffer, "%d", i);
+                uintptr_t buf = -1;
+                assert(remove_hamt(h, (void*)buffer, (void**)&buf) == 1);
+                assert((int)buf == i);
+        }
+        assert(size_hamt(h) == 0);
+        free_hamt(h);
+
+        /* No secondary hash: a single list, but still correct */
+        str_info.rehash = NULL;
+        h = init_hamt(&str_info);
+        assert(h);
+        for (int i = 0; i < (1 << (pows / 2)); ++i) {
+                sprintf(buffer, "%d", i);
+                insert_hamt(h, (void*)buffer, (void*)(uintptr_t)i);
+        }
+        assert(stats_hamt(h, &st) == 0 && st.max_chain == 1 << (pows / 2));
+        for (int i = 0; i < (1 << (pows / 2)); ++i) {
+                sprintf(buffer, "%d", i);
+                uintptr_t buf = -1;
+                assert(find_hamt(h, (void*)buffer, (void**)&buf) == 1);
+                assert((int)buf == i);
+        }
+        free_hamt(h);
+
+        printf("Test Successfull\n\n");
+        return 0;
+}
+
+/*
+ * Versions made by snapshot_hamt/pinsert_hamt/premove_hamt must keep their
+ * contents while the HAMT they came from keeps changing
+ */
+int persistent_test(int pows)
+{
+        printf("Beginning persistent test\n\tMax Size: %d\n", 1 << pows);
+
+        struct hamtinfo int_info = {
+                .key_size = sizeof(int),
+                .elem_size = sizeof(int),
+                .hash = hash_int_ref,
+        };
+        struct hamtinfo str_info = {
+                .key_size = sizeof( char *),
+                .elem_size = sizeof( char * ),
+                .hash = hash_str,
+                .copy_elem = copy_str,
+                .free_elem = free_str,
+                .copy_key = copy_str,
+                .free_key = free_str,
+                .cmp_key = comp_str
+        };
+
+        HAMT * h = init_hamt(&int_info);
+        assert(h);
+        for (int i = 0; i < (1 << pows); ++i)
+                insert_hamt(h, &i, &i);
+
+        HAMT * snap = snapshot_hamt(h);
+        assert(snap && size_hamt(snap) == (1 << pows));
+
+        /* Rewrite the even keys, drop the odd ones, add as many again */
+        for (int i = 0; i < (1 << pows); ++i) {
+                int v = -i;
+                if (i & 1)
+                        assert(remove_hamt(h, &i, NULL) == 1);
+                else
+                        assert(insert_hamt(h, &i, &v) == 0);
+        }
+        for (int i = (1 << pows); i < (3 << (pows - 1)); ++i)
+                assert(insert_hamt(h, &i, &i) == 1);
+
+        assert(size_hamt(h) == (1 << pows));
+        for (int i = 0; i < (1 << pows); ++i) {
+                int * ref = find_ref_hamt(snap, &i);
+                assert(ref && *ref == i);
+                ref = find_ref_hamt(h, &i);
+                assert((i & 1) ? ref == NULL : *ref == -i);
+        }
+
+        /* The original goes away first; the snapshot must survive it */
+        free_hamt(h);
+        for (int i = 0; i < (1 << pows); ++i) {
+                int * ref = find_ref_hamt(snap, &i);
+                assert(ref && *ref == i);
+        }
+        free_hamt(snap);
+
+        /* A chain of versions with copied keys/values */
+        char key_buffer[20];
+        char val_buffer[20];
+        int n = 1 << (pows / 2);
+        HAMT ** versions = malloc((n + 1) * sizeof(*versions));
+        assert(versions);
+        versions[0] = init_hamt(&str_info);
+        assert(versions[0]);
+        for (int i = 0; i < n; ++i) {
+                sprintf(key_buffer, "%d", i % (n / 2));
+                sprintf(val_buffer, "%d", i);
+                versions[i + 1] = pinsert_hamt(versions[i], key_buffer,
+                                val_buffer);
+                assert(versions[i + 1]);
+        }
+
+        for (int i = 0; i <= n; ++i) {
+                int expect = i < n / 2 ? i : n / 2;
+                assert(size_hamt(versions[i]) == (unsigned)expect);
+                for (int k = 0; k < expect; ++k) {
+                        sprintf(key_buffer, "%d", k);
+                        char * vbuf = NULL;
+                        assert(find_hamt(versions[i], key_buffer,
+                                        (void**)&vbuf) == 1);
+                        int last = k + n / 2 < i ? k + n / 2 : k;
+                        assert(atoi(vbuf) == last);
+                        free(vbuf);
+                }
+        }
+
+        sprintf(key_buffer, "%d", 0);
+        char * vbuf = NULL;
+        HAMT * removed = premove_hamt(versions[n], key_buffer, (void**)&vbuf);
+        assert(removed && vbuf && atoi(vbuf) == n / 2);
+        free(vbuf);
+        assert(size_hamt(removed) == (unsigned)(n / 2 - 1));
+        assert(find_ref_hamt(removed, key_buffer) == NULL);
+        assert(find_ref_hamt(versions[n], key_buffer) != NULL);
+
+        /* Release every other version first */
+        for (int i = 0; i <= n; i += 2)
+                free_hamt(versions[i]);
+        for (int i = 1; i <= n; i += 2)
+                free_hamt(versions[i]);
+        free_hamt(removed);
+        free(versions);
+
+        printf("Test Successfull\n\n");
+        return 0;
+}
+
+/*
+ * Prints the structural memory per key of 'h' next to what the same trie
+ * would cost if every node carried a fixed 32-slot child array
+ */
+void report_memory(const char * name, HAMT * h)
+{
+        struct hamtstats st;
+        int rv = stats_hamt(h, &st);
+        assert(rv == 0);
+        assert(st.entries == size_hamt(h));
+
+        unsigned long fixed = st.bytes +
+                (st.nodes * 32 - st.slots) * sizeof(void *);
+        printf("\t%-16s %8lu keys %8lu nodes  %6.1f bytes/key "
+               "(32-slot nodes: %6.1f bytes/key)  depth %.2f avg %u max\n",
+               name, st.entries, st.nodes, (double)st.bytes / st.entries,
+               (double)fixed / st.entries,
+               (double)st.depth_sum / st.entries, st.max_depth);
+}
+
+int memory_test(int pows)
+{
+        printf("Beginning memory test\n\tMax Size: %d\n", 1 << pows);
+
+        struct hamtinfo int_info = {
+                .key_size = sizeof(int),
+                .elem_size = sizeof(int),
+                .hash = hash_int,
+                .copy_elem = copy_int,
+                .free_elem = free_int,
+                .copy_key = copy_int,
+                .free_key = free_int,
+                .cmp_key = comp_int
+        };
+        struct hamtinfo inline_info = {
+                .key_size = sizeof(int),
+                .elem_size = sizeof(int),
+                .hash = hash_int_ref,
+        };
+        struct hamtinfo str_info = {
+                .key_size = sizeof( char *),
+                .elem_size = sizeof( int ),
+                .hash = hash_str,
+                .copy_elem = copy_int,
+                .free_elem = free_int,
+                .copy_key = copy_str,
+                .free_key = free_str,
+                .cmp_key = comp_str
+        };
+
+        char buffer[20];
+        for (int p = pows - 8; p <= pows; p += 4) {
+                HAMT * h = init_hamt(&int_info);
+                assert(h);
+                for (int i = 0; i < (1 << p); ++i)
+                        insert_hamt(h, (void*)(uintptr_t)i, (void*)(uintptr_t)i);
+                report_memory("int->int", h);
+                free_hamt(h);
+
+                h = init_hamt(&inline_info);
+                assert(h);
+                for (int i = 0; i < (1 << p); ++i)
+                        insert_hamt(h, &i, &i);
+                report_memory("inline int->int", h);
+                free_hamt(h);
+
+                h = init_hamt(&str_info);
+                assert(h);
+                for (int i = 0; i < (1 << p); ++i) {
+                        sprintf(buffer, "%d", i);
+                        insert_hamt(h, (void*)buffer, (void*)(uintptr_t)i);
+                }
+                report_memory("string->int", h);
+                free_hamt(h);
+        }
+
+        printf("Test Successfull\n\n");
+        return 0;
+}
+
+#define CONCURRENT_THREADS 4
+
+struct concurrent_arg {
+        HAMT * h;
+        int id;
+        int n;
+        int strings;
+};
+
+/*
+ * Each thread inserts the keys congruent to its id, checks them while the
+ * others are still inserting theirs, removes its odd keys, and then fights
+ * the other threads over a small shared range
+ */
+void * concurrent_worker(void * p)
+{
+        struct concurrent_arg * a = (struct concurrent_arg *)p;
+        char buffer[20];
+        uintptr_t sbuf;
+
+        for (int i = a->id; i < a->n; i += CONCURRENT_THREADS) {
+                if (a->strings) {
+                        sprintf(buffer, "%d", i);
+                        assert(insert_hamt(a->h, buffer,
+                                        (void*)(uintptr_t)i) == 1);
+                }
+                else {
+                        assert(insert_hamt(a->h, &i, &i) == 1);
+                }
+        }
+
+        for (int i = 0; i < a->n; ++i) {
+                int v = -1;
+                int rv;
+                if (a->strings) {
+                        sprintf(buffer, "%d", i);
+                        rv = find_hamt(a->h, buffer, (void**)&sbuf);
+                        v = rv ? (int)sbuf : -1;
+                }
+                else {
+                        rv = find_hamt(a->h, &i, (void**)&v);
+                }
+                /* Other threads' keys may not be there yet */
+                assert(rv == 0 || v == i);
+                if (i % CONCURRENT_THREADS == a->id)
+                        assert(rv == 1);
+        }
+
+        for (int i = a->id; i < a->n; i += CONCURRENT_THREADS) {
+                if ((i & 1) == 0)
+                        continue;
+                if (a->strings) {
+                        sprintf(buffer, "%d", i);
+                        assert(remove_hamt(a->h, buffer, (void**)&sbuf) == 1);
+                        assert((int)sbuf == i);
+                }
+                else {
+                        int v = -1;
+                        assert(remove_hamt(a->h, &i, (void**)&v) == 1);
+                        assert(v == i);
+                }
+        }
+
+        if (a->strings)
+                return NULL;
+
+        /* Shared keys live above 'n'; values always equal the key */
+        for (int round = 0; round < 64; ++round) {
+                for (int k = a->n; k < a->n + 256; ++k) {
+                        int v = -1;
+                        if ((k + round + a->id) % 3 == 0)
+                                assert(insert_hamt(a->h, &k, &k) >= 0);
+                        else if ((k + round + a->id) % 3 == 1)
+                                assert(remove_hamt(a->h, &k, (void**)&v) >= 0);
+                        else if (find_hamt(a->h, &k, (void**)&v) == 1)
+                                assert(v == k);
+                }
+        }
+        return NULL;
+}
+
+void run_concurrent(HAMT * h, int n, int strings)
+{
+        pthread_t threads[CONCURRENT_THREADS];
+        struct concurrent_arg args[CONCURRENT_THREADS];
+        for (int t = 0; t < CONCURRENT_THREADS; ++t) {
+                args[t] = (struct concurrent_arg){ h, t, n, strings };
+                int rv = pthread_create(&threads[t], NULL, concurrent_worker,
+                                &args[t]);
+                assert(rv == 0);
+        }
+        for (int t = 0; t < CONCURRENT_THREADS; ++t)
+                pthread_join(threads[t], NULL);
+}
+
+/*
+ * Threads inserting, finding and removing in one concurrent HAMT, with keys
+ * spread by their top bits (deep, contended paths) and with every key
+ * colliding (LNodes)
+ */
+int concurrent_test(int pows)
+{
+        printf("Beginning concurrent test\n\tThreads: %d\n\tMax Size: %d\n",
+                        CONCURRENT_THREADS, 1 << pows);
+
+        struct hamtinfo int_info = {
+                .key_size = sizeof(int),
+                .elem_size = sizeof(int),
+                .hash = hash_high_bits,
+        };
+        struct hamtinfo str_info = {
+                .key_size = sizeof( char *),
+                .elem_size = sizeof( int ),
+                .hash = hash_zero,
+                .copy_elem = copy_int,
+                .free_elem = free_int,
+                .copy_key = copy_str,
+                .free_key = free_str,
+                .cmp_key = comp_str
+        };
+        struct hamtstats st;
+        int n = 1 << pows;
+
+        HAMT * h = init_concurrent_hamt(&int_info);
+        assert(h);
+        assert(snapshot_hamt(h) == NULL && find_ref_hamt(h, &n) == NULL);
+        run_concurrent(h, n, 0);
+
+        /* The even keys stay; the shared range is whatever won last */
+        unsigned int expect = n / 2;
+        for (int i = 0; i < n + 256; ++i) {
+                int v = -1;
+                int rv = find_hamt(h, &i, (void**)&v);
+                if (i < n)
+                        assert(rv == ((i & 1) == 0));
+                else
+                        expect += rv;
+                assert(rv == 0 || v == i);
+        }
+        assert(size_hamt(h) == expect);
+        assert(stats_hamt(h, &st) == 0 && st.entries == expect);
+        report_memory("concurrent int", h);
+
+        for (int i = 0; i < n + 256; ++i)
+                remove_hamt(h, &i, NULL);
+        assert(size_hamt(h) == 0);
+        assert(clear_hamt(h) == 0);
+        free_hamt(h);
+
+        /* Without a secondary hash every key shares one LNode */
+        h = init_concurrent_hamt(&str_info);
+        assert(h);
+        run_concurrent(h, 1 << (pows / 2), 1);
+        assert(size_hamt(h) == 1 << (pows / 2 - 1));
+        assert(stats_hamt(h, &st) == 0 && st.max_chain == 1 << (pows / 2 - 1));
+        free_hamt(h);
+
+        printf("Test Successfull\n\n");
+        return 0;
+}
+
+double elapsed(struct timespec * start)
+{
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        return (end.tv_sec - start->tv_sec) +
+                (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Nodes and entries come from a per-HAMT arena: clearing releases it in
+ * bulk (walking only to free copied keys/values), except while a snapshot
+ * still shares it
+ */
+int arena_test(int pows)
+{
+        printf("Beginning arena test\n\tMax Size: %d\n", 1 << pows);
+
+        struct hamtinfo inline_info = {
+                .key_size = sizeof(int),
+                .elem_size = sizeof(int),
+                .hash = hash_int_ref,
+        };
+        struct hamtinfo str_info = {
+                .key_size = sizeof( char *),
+                .elem_size = sizeof( int ),
+                .hash = hash_str,
+                .copy_elem = copy_int,
+                .free_elem = free_int,
+                .copy_key = copy_str,
+                .free_key = free_str,
+                .cmp_key = comp_str
+        };
+        struct timespec start;
+        char buffer[20];
+
+        HAMT * h = init_hamt(&inline_info);
+        assert(h);
+        for (int round = 0; round < 2; ++round) {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (int i = 0; i < (1 << pows); ++i)
+                        assert(insert_hamt(h, &i, &i) == 1);
+                double ins = elapsed(&start);
+
+                /* Churn half the keys through the free lists */
+                for (int i = 0; i < (1 << pows); i += 2)
+                        assert(remove_hamt(h, &i, NULL) == 1);
+                for (int i = 0; i < (1 << pows); i += 2)
+                        assert(insert_hamt(h, &i, &i) == 1);
+                for (int i = 0; i < (1 << pows); ++i) {
+                        int * ref = find_ref_hamt(h, &i);
+                        assert(ref && *ref == i);
+                }
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                assert(clear_hamt(h) == 0);
+                printf("\tinline int: insert %.3fs, clear %.6fs\n", ins,
+                                elapsed(&start));
+                assert(size_hamt(h) == 0 && find_ref_hamt(h, &round) == NULL);
+        }
+
+        /* A snapshot keeps the arena alive across clear and free */
+        for (int i = 0; i < (1 << (pows / 2)); ++i)
+                insert_hamt(h, &i, &i);
+        HAMT * snap = snapshot_hamt(h);
+        assert(snap);
+        assert(clear_hamt(h) == 0 && size_hamt(h) == 0);
+        for (int i = 0; i < (1 << (pows / 2)); ++i)
+                assert(insert_hamt(h, &i, &i) == 1);
+        free_hamt(h);
+        for (int i = 0; i < (1 << (pows / 2)); ++i) {
+                int * ref = find_ref_hamt(snap, &i);
+                assert(ref && *ref == i);
+        }
+        assert(clear_hamt(snap) == 0);
+        free_hamt(snap);
+
+        /* Copied keys are still freed one by one */
+        h = init_hamt(&str_info);
+        assert(h);
+        for (int i = 0; i < (1 << (pows / 2)); ++i) {
+                sprintf(buffer, "%d", i);
+                insert_hamt(h, buffer, (void*)(uintptr_t)i);
+        }
+        assert(clear_hamt(h) == 0 && size_hamt(h) == 0);
+        sprintf(buffer, "%d", 1);
+        assert(insert_hamt(h, buffer, (void*)(uintptr_t)1) == 1);
+        free_hamt(h);
+
+        printf("Test Successfull\n\n");
+        return 0;
+}
+
+/*
+ * find_many_hamt/insert_many_hamt must agree with find_hamt/insert_hamt,
+ * including for missing keys, repeated keys and batch-size remainders
+ */
+int batch_test(int pows)
+{
+        printf("Beginning batch test\n\tMax Size: %d\n", 1 << pows);
+
+        struct hamtinfo inline_info = {
+                .key_size = sizeof(int),
+                .elem_size = sizeof(int),
+                .hash = hash_high_bits,
+        };
+        struct hamtinfo str_info = {
+                .key_size = sizeof( char *),
+                .elem_size = sizeof( int ),
+                .hash = hash_str,
+                .copy_elem = copy_int,
+                .free_elem = free_int,
+                .copy_key = copy_str,
+                .free_key = free_str,
+                .cmp_key = comp_str
+        };
+
+        int n = 1 << pows;
+        int * ints = malloc(2 * n * sizeof(*ints));
+        int * vals = malloc(2 * n * sizeof(*vals));
+        int * found = malloc(2 * n * sizeof(*found));
+        void ** keys = malloc(2 * n * sizeof(*keys));
+        void ** vptrs = malloc(2 * n * sizeof(*vptrs));
+        char (*strs)[20] = malloc(2 * n * sizeof(*strs));
+        assert(ints && vals && found && keys && vptrs && strs);
+
+        /* Inline keys: the second half repeats the first with new values */
+        for (int i = 0; i < 2 * n; ++i) {
+                ints[i] = i % n;
+                vals[i] = i;
+                keys[i] = &ints[i];
+                vptrs[i] = &vals[i];
+        }
+        for (int mode = 0; mode < 2; ++mode) {
+                HAMT * h = mode ? init_concurrent_hamt(&inline_info) :
+                        init_hamt(&inline_info);
+                assert(h);
+                assert(insert_many_hamt(h, keys, vptrs, n + n / 2 + 3) == n);
+                assert(size_hamt(h) == n);
+
+                /* Look up every key and as many missing ones */
+                for (int i = 0; i < 2 * n; ++i) {
+                        ints[i] = i;
+                        vals[i] = -1;
+                }
+                assert(find_many_hamt(h, keys, 2 * n - 5, vptrs, found) == n);
+                for (int i = 0; i < 2 * n - 5; ++i) {
+                        int expect = i < n / 2 + 3 ? n + i : i;
+                        assert(found[i] == (i < n));
+                        assert(i >= n || vals[i] == expect);
+                        int v = -1;
+                        assert(find_hamt(h, &i, (void**)&v) == found[i]);
+                        assert(!found[i] || v == vals[i]);
+                }
+                free_hamt(h);
+                for (int i = 0; i < 2 * n; ++i) {
+                        ints[i] = i % n;
+                        vals[i] = i;
+                }
+        }
+
+        /* Copied string keys, looked up without the found flags */
+        HAMT * h = init_hamt(&str_info);
+        assert(h);
+        for (int i = 0; i < n; ++i) {
+                sprintf(strs[i], "%d", i);
+                keys[i] = strs[i];
+                vptrs[i] = (void*)(uintptr_t)i;
+        }
+        assert(insert_many_hamt(h, keys, vptrs, n) == n);
+        assert(insert_many_hamt(h, keys, vptrs, n / 2) == 0);
+        uintptr_t * out = malloc(n * sizeof(*out));
+        assert(out);
+        for (int i = 0; i < n; ++i)
+                vptrs[i] = &out[i];
+        sprintf(strs[n - 1], "missing");
+        assert(find_many_hamt(h, keys, n, vptrs, NULL) == n - 1);
+        for (int i = 0; i < n - 1; ++i)
+                assert(out[i] == (uintptr_t)i);
+        assert(out[n - 1] == 0);
+        free_hamt(h);
+
+        /*
+         * Batching stops only while a snapshot shares the nodes.  A batch
+         * hashes all its keys before inserting any, one key at a time
+         * inserts as it goes; a shared remove looks the key up first.
+         */
+        struct hamtinfo sized_info = {
+                .key_size = sizeof(int),
+                .elem_size = sizeof(int),
+                .hash = hash_sized,
+        };
+        sized_hamt = h = init_hamt(&sized_info);
+        assert(h);
+        for (int i = 0; i < 32; ++i) {
+                ints[i] = i;
+                keys[i] = &ints[i];
+                vptrs[i] = &ints[i];
+        }
+        HAMT * snap = snapshot_hamt(h);
+        assert(snap);
+        hashes_seen = 0;
+        assert(insert_many_hamt(h, keys, vptrs, 16) == 16);
+        assert(hashes_seen == 16);
+        for (int i = 0; i < 16; ++i)
+                assert(sizes_seen[i] == (unsigned)i);
+        hashes_seen = 0;
+        assert(remove_hamt(h, &ints[0], NULL) == 1 && hashes_seen == 2);
+
+        free_hamt(snap);
+        hashes_seen = 0;
+        assert(insert_many_hamt(h, keys + 16, vptrs + 16, 16) == 16);
+        assert(hashes_seen == 16);
+        for (int i = 0; i < 16; ++i)
+                assert(sizes_seen[i] == 15);
+        hashes_seen = 0;
+        assert(remove_hamt(h, &ints[1], NULL) == 1 && hashes_seen == 1);
+        for (int i = 2; i < 32; ++i)
+                assert(*(int *)find_ref_hamt(h, &i) == i);
+        free_hamt(h);
+
+        free(out);
+        free(ints);
+        free(vals);
+        free(found);
+        free(keys);
+        free(vptrs);
+        free(strs);
+        printf("Test Successfull\n\n");
+        return 0;
+}
+
+struct split_arg {
+        HAMT * h;
+        int first;
+        int count;
+        long sum;
+};
+
+void * split_worker(void * p)
+{
+        struct split_arg * a = (struct split_arg *)p;
+        struct hamt_cursor c;
+        for (begin_range_hamt(a->h, &c, a->first, a->first + 8);
+                        !end_hamt(&c); next_hamt(&c)) {
+                /* Root slots pick the low 5 hash bits (the key here) */
+                assert((*(const int *)c.key & 0x1f) >= a->first);
+                assert((*(const int *)c.key & 0x1f) < a->first + 8);
+                a->count += 1;
+                a->sum += *(int *)c.value;
+        }
+        return NULL;
+}
+
+int count_entries(const void * key, void * value, void * arg)
+{
+        (void)key;
+        (void)value;
+        return ++*(int *)arg == 100 ? 7 : 0;
+}
+
+/*
+ * Cursors must visit every entry exactly once: deep paths, collision lists,
+ * serializing to text and back, and threads splitting a snapshot by root
+ * slot while the original keeps changing
+ */
+int cursor_test(int pows)
+{
+        printf("Beginning cursor test\n\tMax Size: %d\n", 1 << pows);
+
+        struct hamtinfo deep_info = {
+                .key_size = sizeof(int),
+                .elem_size = sizeof(int),
+                .hash = hash_high_bits,
+        };
+        struct hamtinfo inline_info = {
+                .key_size = sizeof(int),
+                .elem_size = sizeof(int),
+                .hash = hash_int_ref,
+        };
+        struct hamtinfo str_info = {
+                .key_size = sizeof( char *),
+                .elem_size = sizeof( char * ),
+                .hash = hash_zero,
+                .copy_elem = copy_str,
+                .free_elem = free_str,
+                .copy_key = copy_str,
+                .free_key = free_str,
+                .cmp_key = comp_str,
+                .rehash = rehash_str
+        };
+        struct hamt_cursor c;
+        int n = 1 << pows;
+        char * seen = calloc(n, 1);
+        assert(seen);
+
+        HAMT * h = init_hamt(&deep_info);
+        assert(h);
+        assert(begin_hamt(h, &c) == 0 && end_hamt(&c));
+        for (int i = 0; i < n; ++i) {
+                int v = 3 * i;
+                insert_hamt(h, &i, &v);
+        }
+        int count = 0;
+        for (begin_hamt(h, &c); !end_hamt(&c); next_hamt(&c)) {
+                int k = *(const int *)c.key;
+                assert(k >= 0 && k < n && !seen[k]);
+                assert(*(int *)c.value == 3 * k);
+                seen[k] = 1;
+                count += 1;
+        }
+        assert(count == n && next_hamt(&c) == 0);
+
+        count = 0;
+        assert(foreach_hamt(h, count_entries, &count) == 7 && count == 100);
+        free_hamt(h);
+
+        /* Serialize (all keys share a hash) and read back */
+        h = init_hamt(&str_info);
+        assert(h);
+        char key_buffer[20];
+        char val_buffer[20];
+        for (int i = 0; i < n / 16; ++i) {
+                sprintf(key_buffer, "k%d", i);
+                sprintf(val_buffer, "v%d", 2 * i);
+                insert_hamt(h, key_buffer, val_buffer);
+        }
+        size_t len = 0;
+        char * text = malloc(n / 16 * 40 + 1);
+        assert(text);
+        for (begin_hamt(h, &c); !end_hamt(&c); next_hamt(&c))
+                len += sprintf(text + len, "%s %s\n", (const char *)c.key,
+                                (char *)c.value);
+
+        HAMT * copy = init_hamt(&str_info);
+        assert(copy);
+        for (char * line = strtok(text, "\n"); line;
+                        line = strtok(NULL, "\n")) {
+                assert(sscanf(line, "%19s %19s", key_buffer, val_buffer) == 2);
+                assert(insert_hamt(copy, key_buffer, val_buffer) == 1);
+        }
+        assert(size_hamt(copy) == size_hamt(h));
+        for (int i = 0; i < n / 16; ++i) {
+                char * vbuf = NULL;
+                sprintf(key_buffer, "k%d", i);
+                assert(find_hamt(copy, key_buffer, (void**)&vbuf) == 1);
+                assert(atoi(vbuf + 1) == 2 * i);
+                free(vbuf);
+        }
+        free(text);
+        free_hamt(copy);
+        free_hamt(h);
+
+        /* Four threads walk a snapshot while the original changes */
+        h = init_hamt(&inline_info);
+        assert(h);
+        long sum = 0;
+        for (int i = 0; i < n; ++i) {
+                insert_hamt(h, &i, &i);
+                sum += i;
+        }
+        HAMT * snap = snapshot_hamt(h);
+        assert(snap);
+        pthread_t threads[4];
+        struct split_arg args[4];
+        for (int t = 0; t < 4; ++t) {
+                args[t] = (struct split_arg){ snap, 8 * t, 0, 0 };
+                int rv = pthread_create(&threads[t], NULL, split_worker,
+                                &args[t]);
+                assert(rv == 0);
+        }
+        for (int i = 0; i < n; i += 2)
+                remove_hamt(h, &i, NULL);
+        count = 0;
+        for (int t = 0; t < 4; ++t) {
+                pthread_join(threads[t], NULL);
+                count += args[t].count;
+                sum -= args[t].sum;
+        }
+        assert(count == n && sum == 0);
+
+        count = 0;
+        for (begin_hamt(h, &c); !end_hamt(&c); next_hamt(&c))
+                count += 1;
+        assert(count == n / 2);
+        free_hamt(h);
+        free_hamt(snap);
+        free(seen);
+
+        printf("Test Successfull\n\n");
+        return 0;
+}
+
+/*
+ * Keeps a sliding window of 2^pows keys for many insert/remove cycles and
+ * checks that the trie ends up shaped exactly like one built from scratch
+ * with the surviving keys: no dead interior nodes, no excess depth
+ */
+int churn_test(int pows)
+{
+        printf("Beginning churn test\n\tSteady Size: %d\n", 1 << pows);
+
+        struct hamtinfo infos[] = {
+                {
+                        .key_size = sizeof(int),
+                        .elem_size = sizeof(int),
+                        .hash = hash_int_ref,
+                },
+                {
+                        .key_size = sizeof(int),
+                        .elem_size = sizeof(int),
+                        .hash = hash_high_bits,
+                },
+        };
+        const char * names[] = { "churned int", "churned deep int" };
+        int n = 1 << pows;
+        int step = n / 16;
+        int cycles = 64;
+
+        for (int k = 0; k < 2; ++k) {
+                HAMT * h = init_hamt(&infos[k]);
+                assert(h);
+                for (int i = 0; i < n; ++i)
+                        insert_hamt(h, &i, &i);
+
+                struct timespec start;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                int base = 0;
+                for (int c = 0; c < cycles; ++c, base += step) {
+                        for (int i = base; i < base + step; ++i)
+                                assert(remove_hamt(h, &i, NULL) == 1);
+                        for (int i = base + n; i < base + n + step; ++i)
+                                assert(insert_hamt(h, &i, &i) == 1);
+                }
+                double secs = elapsed(&start);
+                assert(size_hamt(h) == n);
+
+                HAMT * fresh = init_hamt(&infos[k]);
+                assert(fresh);
+                for (int i = base; i < base + n; ++i)
+                        insert_hamt(fresh, &i, &i);
+
+                struct hamtstats st, fst;
+                assert(stats_hamt(h, &st) == 0 && stats_hamt(fresh, &fst) == 0);
+                assert(st.nodes == fst.nodes && st.slots == fst.slots);
+                assert(st.depth_sum == fst.depth_sum);
+                assert(st.max_depth == fst.max_depth);
+                report_memory(names[k], h);
+                printf("\t%-16s %.1f ns per insert/remove\n", names[k],
+                                secs * 1e9 / (2.0 * cycles * step));
+
+                /* Emptying it leaves just the root */
+                for (int i = base; i < base + n; ++i)
+                        assert(remove_hamt(h, &i, NULL) == 1);
+                assert(stats_hamt(h, &st) == 0 && st.nodes == 1);
+                free_hamt(fresh);
+                free_hamt(h);
+        }
+
+        printf("Test Successfull\n\n");
+        return 0;
+}
 
 void * copy_str(const void * str)
 {
@@ -219,3 +1193,35 @@ int hash_int(const void * num)
         return (uintptr_t)num;
 }
 
+
+int hash_int_ref(const void * num)
+{
+        return *(const int *)num;
+}
+
+int hash_high_bits(const void * num)
+{
+        return (int)((uint32_t)*(const int *)num << 25);
+}
+
+int hash_sized(const void * num)
+{
+        sizes_seen[hashes_seen++ % 64] = size_hamt(sized_hamt);
+        return hash_int_ref(num);
+}
+
+int hash_zero(const void * str)
+{
+        (void)str;
+        return 0;
+}
+
+int rehash_str(const void * str, int seed)
+{
+        uint32_t rv = 2166136261u ^ (uint32_t)seed * 0x9e3779b9u;
+        for (const char * s = (const char *)str; *s; ++s) {
+                rv ^= (unsigned char)*s;
+                rv *= 16777619u;
+        }
+        return (int)(rv ^ (rv >> 15));
+}
@@ -0,0 +1,458 @@
+#include "btree.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BT_ORDER 16                     // Most keys in a node (two cache lines)
+#define BT_MIN   (BT_ORDER / 2 - 1)     // Fewest keys in a node but the root
+#define _BT_TREE_VALID 0x2b7e15
+
+struct bt_tree {
+        struct rbtreeinfo info;
+        struct bt_node * root;
+        int size;
+        uint32_t valid;
+};
+
+struct bt_node {
+        int n;          // Keys in use
+        int leaf;
+        void * keys[BT_ORDER];
+        union {
+                // Interior: keys[i] separates child[i] (smaller keys) from
+                // child[i + 1] (keys equal or greater)
+                struct bt_node * child[BT_ORDER + 1];
+                struct {
+                        void * data[BT_ORDER];
+                        struct bt_node * next;  // Next leaf to the right
+                };
+        };
+};
+
+BTREE * bt_init(struct rbtreeinfo * info)
+{
+        struct bt_tree * rv = (struct bt_tree *)malloc(sizeof * rv);
+        if (rv) {
+                rv->root = NULL;
+                rv->size = 0;
+                rv->valid = _BT_TREE_VALID;
+                memcpy(&(rv->info), info, sizeof *info);
+        }
+        return (BTREE *)rv;
+}
+
+struct bt_node * bt_make_node(int leaf)
+{
+        struct bt_node * rv = (struct bt_node *)calloc(1, sizeof *rv);
+        if (rv != NULL)
+                rv->leaf = leaf;
+        return rv;
+}
+
+/*
+ * Counts the keys of 'node' less than 'key' ('upper' 0), or not greater than
+ * 'key' ('upper' 1).  The halving loop runs a fixed number of times for a
+ * given node size and picks each half with a conditional move, so it does not
+ * mispredict however the keys fall.
+ */
+int bt_search(struct bt_tree * tree, struct bt_node * node, void * key,
+                int upper)
+{
+        if (node->n == 0)
+                return 0;
+
+        void ** base = node->keys;
+        int len = node->n;
+        while (len > 1) {
+                int half = len / 2;
+                base += tree->info.keycomp(base[half], key) < upper ? half : 0;
+                len -= half;
+        }
+        return (base - node->keys) + (tree->info.keycomp(*base, key) < upper);
+}
+
+// Finds the leaf that holds 'key' if it is present
+struct bt_node * bt_find_leaf(struct bt_tree * tree, void * key)
+{
+        struct bt_node * node = tree->root;
+        while (node != NULL && !node->leaf)
+                node = node->child[bt_search(tree, node, key, 1)];
+        return node;
+}
+
+int bt_has(BTREE * t, void * key)
+{
+        return bt_find(t, key) != NULL;
+}
+
+void ** bt_find(BTREE * t, void * key)
+{
+        struct bt_tree * tree = (struct bt_tree *)t;
+        if (tree->valid != _BT_TREE_VALID) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        struct bt_node * leaf = bt_find_leaf(tree, key);
+        if (leaf == NULL)
+                return NULL;
+        int i = bt_search(tree, leaf, key, 0);
+        if (i < leaf->n && tree->info.keycomp(leaf->keys[i], key) == 0)
+                return &leaf->data[i];
+        return NULL;
+}
+
+int bt_size(BTREE * t)
+{
+        if (t == NULL)
+                return 0;
+
+        struct bt_tree * tree = (struct bt_tree *)t;
+        if (tree->valid != _BT_TREE_VALID) return -1;
+        return tree->size;
+}
+
+/*
+ * Splits the full child 'i' of 'parent' in two and adds the separator to
+ * 'parent' (which has room).  A leaf's separator is a copy of the first key
+ * of its new right half; an interior node gives up its middle key.
+ */
+int bt_split_child(struct bt_tree * tree, struct bt_node * parent, int i)
+{
+        struct bt_node * left = parent->child[i];
+        struct bt_node * right = bt_make_node(left->leaf);
+        if (right == NULL)
+                return -1;
+
+        int mid = BT_ORDER / 2;
+        void * sep = NULL;
+        if (left->leaf) {
+                right->n = left->n - mid;
+                memcpy(right->keys, left->keys + mid, right->n * sizeof(void *));
+                memcpy(right->data, left->data + mid, right->n * sizeof(void *));
+                right->next = left->next;
+                left->next = right;
+                tree->info.keycopy(&sep, &right->keys[0]);
+        }
+        else {
+                sep = left->keys[mid];
+                right->n = left->n - mid - 1;
+                memcpy(right->keys, left->keys + mid + 1,
+                                right->n * sizeof(void *));
+                memcpy(right->child, left->child + mid + 1,
+                                (right->n + 1) * sizeof(void *));
+        }
+        left->n = mid;
+
+        memmove(parent->keys + i + 1, parent->keys + i,
+                        (parent->n - i) * sizeof(void *));
+        memmove(parent->child + i + 2, parent->child + i + 1,
+                        (parent->n - i) * sizeof(void *));
+        parent->keys[i] = sep;
+        parent->child[i + 1] = right;
+        parent->n += 1;
+        return 0;
+}
+
+int bt_insert(BTREE * t, void * key, void * data)
+{
+        struct bt_tree * tree = (struct bt_tree *)t;
+        if (tree->valid != _BT_TREE_VALID) return -1;
+
+        if (tree->root == NULL) {
+                tree->root = bt_make_node(1);
+                if (tree->root == NULL)
+                        return -1;
+        }
+
+        // Split full nodes on the way down, so a split never has to climb
+        if (tree->root->n == BT_ORDER) {
+                struct bt_node * root = bt_make_node(0);
+                if (root == NULL)
+                        return -1;
+                root->child[0] = tree->root;
+                if (bt_split_child(tree, root, 0) != 0) {
+                        free(root);
+                        return -1;
+                }
+                tree->root = root;
+        }
+
+        struct bt_node * node = tree->root;
+        while (!node->leaf) {
+                int i = bt_search(tree, node, key, 1);
+                if (node->child[i]->n == BT_ORDER) {
+                        if (bt_split_child(tree, node, i) != 0)
+                                return -1;
+                        i += tree->info.keycomp(node->keys[i], key) <= 0;
+                }
+                node = node->child[i];
+        }
+
+        int i = bt_search(tree, node, key, 0);
+        if (i < node->n && tree->info.keycomp(node->keys[i], key) == 0) {
+                // Already present: update the value
+                if (node->data[i] != data) {
+                        if (tree->info.datafree != NULL)
+                                tree->info.datafree(node->data[i]);
+                        node->data[i] = data;
+                }
+                return 0;
+        }
+
+        memmove(node->keys + i + 1, node->keys + i,
+                        (node->n - i) * sizeof(void *));
+        memmove(node->data + i + 1, node->data + i,
+                        (node->n - i) * sizeof(void *));
+        node->keys[i] = NULL;
+        tree->info.keycopy(&node->keys[i], &key);
+        node->data[i] = data;
+        node->n += 1;
+        tree->size += 1;
+        return 1;
+}
+
+// Moves the last entry of child 'i - 1' of 'parent' to the front of child 'i'
+void bt_borrow_left(struct bt_tree * tree, struct bt_node * parent, int i)
+{
+        struct bt_node * node = parent->child[i];
+        struct bt_node * left = parent->child[i - 1];
+
+        memmove(node->keys + 1, node->keys, node->n * sizeof(void *));
+        if (node->leaf) {
+                memmove(node->data + 1, node->data, node->n * sizeof(void *));
+                node->keys[0] = left->keys[left->n - 1];
+                node->data[0] = left->data[left->n - 1];
+                tree->info.keyfree(parent->keys[i - 1]);
+                parent->keys[i - 1] = NULL;
+                tree->info.keycopy(&parent->keys[i - 1], &node->keys[0]);
+        }
+        else {
+                memmove(node->child + 1, node->child,
+                                (node->n + 1) * sizeof(void *));
+                node->keys[0] = parent->keys[i - 1];
+                node->child[0] = left->child[left->n];
+                parent->keys[i - 1] = left->keys[left->n - 1];
+        }
+        left->n -= 1;
+        node->n += 1;
+}
+
+// Moves the first entry of child 'i + 1' of 'parent' to the end of child 'i'
+void bt_borrow_right(struct bt_tree * tree, struct bt_node * parent, int i)
+{
+        struct bt_node * node = parent->child[i];
+        struct bt_node * right = parent->child[i + 1];
+
+        if (node->leaf) {
+                node->keys[node->n] = right->keys[0];
+                node->data[node->n] = right->data[0];
+                memmove(right->data, right->data + 1,
+                                (right->n - 1) * sizeof(void *));
+        }
+        else {
+                node->keys[node->n] = parent->keys[i];
+                node->child[node->n + 1] = right->child[0];
+                parent->keys[i] = right->keys[0];
+                memmove(right->child, right->child + 1,
+                                right->n * sizeof(void *));
+        }
+        memmove(right->keys, right->keys + 1, (right->n - 1) * sizeof(void *));
+        node->n += 1;
+        right->n -= 1;
+
+        if (node->leaf) {
+                tree->info.keyfree(parent->keys[i]);
+                parent->keys[i] = NULL;
+                tree->info.keycopy(&parent->keys[i], &right->keys[0]);
+        }
+}
+
+// Folds child 'i + 1' of 'parent' and their separator into child 'i'
+void bt_merge(struct bt_tree * tree, struct bt_node * parent, int i)
+{
+        struct bt_node * left = parent->child[i];
+        struct bt_node * right = parent->child[i + 1];
+
+        if (left->leaf) {
+                memcpy(left->keys + left->n, right->keys,
+                                right->n * sizeof(void *));
+                memcpy(left->data + left->n, right->data,
+                                right->n * sizeof(void *));
+                left->n += right->n;
+                left->next = right->next;
+                tree->info.keyfree(parent->keys[i]);
+        }
+        else {
+                left->keys[left->n] = parent->keys[i];
+                memcpy(left->keys + left->n + 1, right->keys,
+                                right->n * sizeof(void *));
+                memcpy(left->child + left->n + 1, right->child,
+                                (right->n + 1) * sizeof(void *));
+                left->n += right->n + 1;
+        }
+        free(right);
+
+        memmove(parent->keys + i, parent->keys + i + 1,
+                        (parent->n - i - 1) * sizeof(void *));
+        memmove(parent->child + i + 1, parent->child + i + 2,
+                        (parent->n - i - 1) * sizeof(void *));
+        parent->n -= 1;
+}
+
+int bt_remove_node(struct bt_tree * tree, struct bt_node * node, void * key)
+{
+        if (node->leaf) {
+                int i = bt_search(tree, node, key, 0);
+                if (i == node->n || tree->info.keycomp(node->keys[i], key) != 0)
+                        return 0;
+
+                tree->info.keyfree(node->keys[i]);
+                if (tree->info.datafree != NULL)
+                        tree->info.datafree(node->data[i]);
+                memmove(node->keys + i, node->keys + i + 1,
+                                (node->n - i - 1) * sizeof(void *));
+                memmove(node->data + i, node->data + i + 1,
+                                (node->n - i - 1) * sizeof(void *));
+                node->n -= 1;
+                return 1;
+        }
+
+        // Separators may outlive the key they were copied from; they still
+        // divide the keys correctly
+        int i = bt_search(tree, node, key, 1);
+        if (bt_remove_node(tree, node->child[i], key) == 0)
+                return 0;
+
+        if (node->child[i]->n < BT_MIN) {
+                if (i > 0 && node->child[i - 1]->n > BT_MIN)
+                        bt_borrow_left(tree, node, i);
+                else if (i < node->n && node->child[i + 1]->n > BT_MIN)
+                        bt_borrow_right(tree, node, i);
+                else
+                        bt_merge(tree, node, i > 0 ? i - 1 : i);
+        }
+        return 1;
+}
+
+int bt_remove(BTREE * t, void * key)
+{
+        struct bt_tree * tree = (struct bt_tree *)t;
+        if (tree->valid != _BT_TREE_VALID) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (tree->root == NULL)
+                return 0;
+
+        int rv = bt_remove_node(tree, tree->root, key);
+        tree->size -= rv;
+
+        // The tree loses a level once the root is down to one child
+        struct bt_node * root = tree->root;
+        if (root->n == 0) {
+                tree->root = root->leaf ? NULL : root->child[0];
+                free(root);
+        }
+        return rv;
+}
+
+void bt_free_node(struct bt_tree * tree, struct bt_node * node)
+{
+        for (int i = 0; i < node->n; ++i) {
+                tree->info.keyfree(node->keys[i]);
+                if (node->leaf && tree->info.datafree != NULL)
+                        tree->info.datafree(node->data[i]);
+        }
+        if (!node->leaf)
+                for (int i = 0; i <= node->n; ++i)
+                        bt_free_node(tree, node->child[i]);
+        free(node);
+}
+
+int bt_free(BTREE * t)
+{
+        struct bt_tree * tree = (struct bt_tree *)t;
+        if (tree->valid != _BT_TREE_VALID) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (tree->root != NULL)
+                bt_free_node(tree, tree->root);
+        free(tree);
+        return 0;
+}
+
+/*
+ * Checks the subtree at 'node', whose keys must lie in [lo, hi) (NULL bounds
+ * are open).  Returns the number of levels down to its leaves, or -1.
+ */
+int _bt_assert(struct bt_tree * tree, struct bt_node * node, void ** lo,
+                void ** hi, int * keys)
+{
+        int (*comp)(void *, void *) = tree->info.keycomp;
+
+        if (node != tree->root && node->n < BT_MIN) {
+                fprintf(stderr, "Underfull Node\n");
+                return -1;
+        }
+        for (int i = 0; i < node->n; ++i) {
+                if ((i > 0 && comp(node->keys[i - 1], node->keys[i]) >= 0) ||
+                                (lo && comp(node->keys[i], *lo) < 0) ||
+                                (hi && comp(node->keys[i], *hi) >= 0)) {
+                        fprintf(stderr, "Order Violation\n");
+                        return -1;
+                }
+        }
+
+        if (node->leaf) {
+                *keys += node->n;
+                return 1;
+        }
+
+        int depth = 0;
+        for (int i = 0; i <= node->n; ++i) {
+                int d = _bt_assert(tree, node->child[i],
+                                i > 0 ? &node->keys[i - 1] : lo,
+                                i < node->n ? &node->keys[i] : hi, keys);
+                if (d < 0 || (depth != 0 && d != depth)) {
+                        if (d >= 0)
+                                fprintf(stderr, "Leaf Depth Violation\n");
+                        return -1;
+                }
+                depth = d;
+        }
+        return depth + 1;
+}
+
+int bt_assert(BTREE * t)
+{
+        struct bt_tree * tree = (struct bt_tree *)t;
+        if (tree->root == NULL)
+                return tree->size == 0;
+
+        int keys = 0;
+        if (_bt_assert(tree, tree->root, NULL, NULL, &keys) < 0)
+                return 0;
+
+        // The leaf chain must hold every key in order too
+        struct bt_node * leaf = tree->root;
+        while (!leaf->leaf)
+                leaf = leaf->child[0];
+        int chained = 0;
+        for (void * last = NULL; leaf != NULL; leaf = leaf->next) {
+                for (int i = 0; i < leaf->n; ++i, ++chained) {
+                        if (chained > 0 &&
+                                        tree->info.keycomp(last, leaf->keys[i]) >= 0) {
+                                fprintf(stderr, "Leaf Chain Violation\n");
+                                return 0;
+                        }
+                        last = leaf->keys[i];
+                }
+        }
+        return keys == tree->size && chained == keys;
+}
@@ -0,0 +1,47 @@
+/**
+ * A B+-tree with the same interface as RBTREE, for large trees.
+ *
+ * Every key lives in a leaf; interior nodes hold copies of separating keys
+ * and up to BT_ORDER + 1 children.  A node keeps its keys side by side, so
+ * the search within one costs a couple of cache lines instead of a miss per
+ * comparison, and the tree is only log_(BT_ORDER / 2)(N) nodes deep.  Leaves
+ * are chained left to right.
+ **/
+
+#ifndef _NBLEI_BTREE_H_
+#define _NBLEI_BTREE_H_
+#include "rbtree.h"
+
+typedef void * BTREE;
+
+/**
+ * 'info' is used as by rb_init: keys are copied into and freed from a
+ * (void *) slot, and values dropped by the tree are passed to 'datafree'.
+ **/
+BTREE * bt_init(struct rbtreeinfo * info);
+int bt_free(BTREE * tree);
+
+/**
+ * Checks the order, occupancy and leaf depth of every node.  Returns 1 if
+ * the tree is valid and 0 otherwise.
+ **/
+int bt_assert(BTREE * tree);
+
+/**
+ * Inserts 'key' with the value 'data', or replaces the value if 'key' is
+ * already present.  Returns 1 if 'key' is new, 0 if its value was replaced
+ * and -1 on error.
+ **/
+int bt_insert(BTREE * tree, void * key, void * data);
+int bt_size(BTREE * tree);
+int bt_has(BTREE * tree, void * key);
+
+/**
+ * Returns a borrowed pointer to the value stored with 'key', or NULL if 'key'
+ * is not present.  The pointer stays valid until the tree is next modified.
+ **/
+void ** bt_find(BTREE * tree, void * key);
+
+int bt_remove(BTREE * tree, void * key);
+
+#endif
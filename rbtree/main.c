@@ -1,22 +1,101 @@
 #include "rbtree.h"
+#include "btree.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+
+// Trees specialized for integer keys and for 16-byte keys
+struct key16 { unsigned char b[16]; };
+
+#define RB_SPEC_NAME rbi
+#define RB_SPEC_KEY  intptr_t
+#include "rbtree_spec.h"
+
+#define RB_SPEC_NAME rbk
+#define RB_SPEC_KEY  struct key16
+#define RB_SPEC_COMP(p, q) memcmp((p).b, (q).b, sizeof((p).b))
+#include "rbtree_spec.h"
 
 int int_copy(void * dest, void * src);
 int int_comp(void * p, void * q);
 int int_free(void * p);
+int data_free(void * p);
+int key_copy(void * dest, void * src);
+int key_free(void * p);
+int data_copy(void * dest, void * src);
 
 int test_insert_remove(int n);
+int test_find_update(int n);
+int test_rank_select(int n);
+int test_iterate(int n);
+int * shuffled(int n);
+int range_sum(void * key, void * data, void * arg);
+int test_btree(int n);
+int test_spec(int n);
+int test_pool(int n);
+int test_build_merge(int n);
+int test_set_ops(int n);
+int check_set_ops(struct rbtreeinfo * info, int n);
+RBTREE * multiples(struct rbtreeinfo * info, int step, int n, int tag);
+int test_concurrent(int n);
+struct reader_arg {
+        RBTREE * tree;
+        int n;
+        atomic_int * stop;
+};
+void * concurrent_reader(void * p);
+int test_snapshot(int n);
+int test_check(int n);
+int ref_copy(void * dest, void * src);
+int ref_comp(void * p, void * q);
+int ref_free(void * p);
+int check_version(RBTREE * tree, const char * present, void * const * values,
+                int range);
+void * churn_version(void * p);
+int ptr_comp(const void * p, const void * q);
+int bench(int max);
+int bench_readers(int max);
+struct bench_arg {
+        RBTREE * tree;
+        pthread_rwlock_t * lock;        // NULL for the concurrent tree
+        unsigned int seed;
+        long ops;
+        int range;
+        atomic_int * stop;
+        long writes;
+};
+void * bench_reader(void * p);
+void * bench_writer(void * p);
+double elapsed(struct timespec * start);
+
+static atomic_int freed_data = 0;     // Set operations free from threads
+static atomic_int copied_data = 0;    // Values duplicated by data_copy
+static atomic_int live_keys = 0;      // Copied by key_copy, not yet freed
 
 int main(int argc, char ** argv)
 {
+        if (argc == 2 || argc == 3) {
+                if (strcmp(argv[1], "bench") == 0) {
+                        bench(argc == 3 ? atoi(argv[2]) : 10000000);
+                        exit(EXIT_SUCCESS);
+                }
+                if (strcmp(argv[1], "readers") == 0) {
+                        bench_readers(argc == 3 ? atoi(argv[2]) : 8);
+                        exit(EXIT_SUCCESS);
+                }
+        }
         if (argc != 2) {
-                fprintf(stderr, "Usage: main <number of iterations>\n");
+                fprintf(stderr, "Usage: main <number of iterations>\n"
+                                "       main bench [max keys]\n"
+                                "       main readers [max threads]\n");
                 exit(1);
         }
 
@@ -24,6 +103,17 @@ int main(int argc, char ** argv)
 
 
         test_insert_remove(n);
+        test_find_update(n);
+        test_rank_select(n);
+        test_iterate(n);
+        test_btree(n);
+        test_spec(n);
+        test_pool(n);
+        test_build_merge(n);
+        test_set_ops(n);
+        test_concurrent(n);
+        test_snapshot(n);
+        test_check(n);
 
         exit(EXIT_SUCCESS);
 }
@@ -96,6 +186,1233 @@ int test_insert_remove(int n)
         return 0;
 }
 
+int test_find_update(int n)
+{
+        struct rbtreeinfo info = {
+                .keycopy = int_copy,
+                .keycomp = int_comp,
+                .keyfree = int_free,
+                .datafree = data_free,
+        };
+        RBTREE * tree = rb_init(&info);
+        assert(tree);
+
+        for (int i = 0; i < n; ++i)
+                assert(rb_insert(tree, (void *)(uintptr_t)i,
+                                        (void *)(uintptr_t)(3 * i + 1)) == 1);
+        assert(rb_size(tree) == n);
+        assert(rb_find(tree, (void *)(uintptr_t)n) == NULL);
+
+        // Replacing a value releases the old one
+        for (int i = 0; i < n; ++i) {
+                void ** data = rb_find(tree, (void *)(uintptr_t)i);
+                assert(data && *data == (void *)(uintptr_t)(3 * i + 1));
+                assert(rb_insert(tree, (void *)(uintptr_t)i,
+                                        (void *)(uintptr_t)(5 * i + 2)) == 0);
+        }
+        assert(rb_size(tree) == n && freed_data == n);
+
+        // Values written through rb_find stay with their keys
+        for (int i = 0; i < n; ++i)
+                *rb_find(tree, (void *)(uintptr_t)i) = (void *)(uintptr_t)(7 * i + 3);
+        for (int i = 0; i < n; i += 2) {
+                assert(rb_remove(tree, (void *)(uintptr_t)i) == 1);
+                assert(rb_find(tree, (void *)(uintptr_t)i) == NULL);
+        }
+        for (int i = 1; i < n; i += 2) {
+                void ** data = rb_find(tree, (void *)(uintptr_t)i);
+                assert(data && *data == (void *)(uintptr_t)(7 * i + 3));
+        }
+        assert(freed_data == n + (n + 1) / 2);
+
+        // Batched lookups agree with rb_has, whatever the batch boundaries
+        void ** keys = malloc((2 * n + 1) * sizeof(*keys));
+        int * found = malloc((2 * n + 1) * sizeof(*found));
+        assert(keys && found);
+        for (int i = 0; i < 2 * n; ++i)
+                keys[i] = (void *)(uintptr_t)(i * 7 % (2 * n));
+        assert(rb_has_many(tree, keys, 2 * n, found) == n / 2);
+        for (int i = 0; i < 2 * n; ++i)
+                assert(found[i] == rb_has(tree, keys[i]));
+        assert(rb_has_many(tree, keys, 2 * n, NULL) == n / 2);
+        assert(rb_has_many(tree, keys, -1, found) == -1 && errno == EINVAL);
+        free(keys);
+        free(found);
+
+        rb_free(tree);
+        assert(freed_data == 2 * n);
+        return 0;
+}
+
+int test_rank_select(int n)
+{
+        struct rbtreeinfo info = {
+                .keycopy = int_copy,
+                .keycomp = int_comp,
+                .keyfree = int_free,
+        };
+        RBTREE * tree = rb_init(&info);
+        assert(tree);
+
+        // Even keys 0 .. 2n - 2, inserted in a scrambled order
+        int * order = shuffled(n);
+        for (int i = 0; i < n; ++i)
+                rb_insert(tree, (void *)(uintptr_t)(2 * order[i]),
+                                (void *)(uintptr_t)order[i]);
+        assert(rb_assert(tree));
+
+        for (int i = 0; i < n; ++i) {
+                void * key, * data;
+                assert(rb_rank(tree, (void *)(uintptr_t)(2 * i)) == i);
+                assert(rb_rank(tree, (void *)(uintptr_t)(2 * i + 1)) == i + 1);
+                assert(rb_select(tree, i, &key, &data) == 1);
+                assert(key == (void *)(uintptr_t)(2 * i));
+                assert(data == (void *)(uintptr_t)i);
+        }
+        assert(rb_select(tree, -1, NULL, NULL) == 0);
+        assert(rb_select(tree, n, NULL, NULL) == 0);
+
+        // Drop every third key; the survivors close up their ranks
+        for (int i = 0; i < n; ++i)
+                if (order[i] % 3 == 0)
+                        assert(rb_remove(tree, (void *)(uintptr_t)(2 * order[i])) == 1);
+        assert(rb_assert(tree));
+        int k = 0;
+        for (int i = 0; i < n; ++i) {
+                if (i % 3 == 0)
+                        continue;
+                void * key;
+                assert(rb_rank(tree, (void *)(uintptr_t)(2 * i)) == k);
+                assert(rb_select(tree, k, &key, NULL) == 1);
+                assert(key == (void *)(uintptr_t)(2 * i));
+                ++k;
+        }
+        assert(rb_size(tree) == k);
+
+        // Updating present keys and removing absent ones change no counts
+        for (int i = 0; i < n; ++i) {
+                void * key = (void *)(uintptr_t)(2 * i);
+                if (i % 3)
+                        assert(rb_insert(tree, key, (void *)(uintptr_t)i) == 0);
+                else
+                        assert(rb_remove(tree, key) == 0);
+                assert(rb_remove(tree, (void *)(uintptr_t)(2 * i + 1)) == 0);
+        }
+        assert(rb_assert(tree) && rb_size(tree) == k);
+
+        free(order);
+        rb_free(tree);
+        return 0;
+}
+
+int test_iterate(int n)
+{
+        struct rbtreeinfo info = {
+                .keycopy = int_copy,
+                .keycomp = int_comp,
+                .keyfree = int_free,
+        };
+        RBTREE * tree = rb_init(&info);
+        assert(tree);
+
+        struct rb_iter it;
+        assert(rb_first(tree, &it) == 0 && rb_end(&it));
+        assert(rb_lower_bound(tree, &it, (void *)(uintptr_t)0) == 0);
+
+        int * order = shuffled(n);
+        for (int i = 0; i < n; ++i)
+                rb_insert(tree, (void *)(uintptr_t)(2 * order[i]),
+                                (void *)(uintptr_t)order[i]);
+        free(order);
+
+        // Both directions visit every key once, in order
+        int i = 0;
+        for (rb_first(tree, &it); !rb_end(&it); rb_next(&it), ++i)
+                assert(it.key == (void *)(uintptr_t)(2 * i) &&
+                                it.data == (void *)(uintptr_t)i);
+        assert(i == n && rb_next(&it) == 0);
+        for (rb_last(tree, &it); !rb_end(&it); rb_prev(&it))
+                --i, assert(it.key == (void *)(uintptr_t)(2 * i));
+        assert(i == 0);
+
+        for (i = 0; i < n; ++i) {
+                void * even = (void *)(uintptr_t)(2 * i);
+                void * odd = (void *)(uintptr_t)(2 * i + 1);
+                assert(rb_lower_bound(tree, &it, even) == 1 && it.key == even);
+                if (i > 0)
+                        assert(rb_prev(&it) == 1 &&
+                                        it.key == (void *)(uintptr_t)(2 * i - 2));
+                assert(rb_upper_bound(tree, &it, even) == (i < n - 1));
+                assert(rb_lower_bound(tree, &it, odd) == (i < n - 1));
+                if (i < n - 1)
+                        assert(it.key == (void *)(uintptr_t)(2 * i + 2));
+        }
+
+        // [3, 2n) holds the keys 4 .. 2n - 2, with values 2 .. n - 1
+        long sum = 0;
+        assert(rb_range(tree, (void *)(uintptr_t)3, (void *)(uintptr_t)(2 * n),
+                                range_sum, &sum) == 0);
+        assert(n < 2 || sum == (long)n * (n - 1) / 2 - 1);
+        sum = -1;
+        assert(rb_range(tree, (void *)(uintptr_t)0, (void *)(uintptr_t)(2 * n),
+                                range_sum, &sum) == (n > 0 ? 1 : 0));
+        sum = 0;
+        assert(rb_range(tree, (void *)(uintptr_t)4, (void *)(uintptr_t)4,
+                                range_sum, &sum) == 0 && sum == 0);
+
+        rb_free(tree);
+        return 0;
+}
+
+int test_btree(int n)
+{
+        struct rbtreeinfo info = {
+                .keycopy = int_copy,
+                .keycomp = int_comp,
+                .keyfree = int_free,
+                .datafree = data_free,
+        };
+        BTREE * tree = bt_init(&info);
+        assert(tree);
+        assert(bt_size(tree) == 0 && !bt_has(tree, (void *)(uintptr_t)0));
+        assert(bt_remove(tree, (void *)(uintptr_t)0) == 0);
+
+        freed_data = 0;
+        int * order = shuffled(n);
+        for (int i = 0; i < n; ++i) {
+                void * key = (void *)(uintptr_t)(2 * order[i]);
+                assert(!bt_has(tree, key));
+                assert(bt_insert(tree, key, (void *)(uintptr_t)(3 * i + 1)) == 1);
+                assert(bt_has(tree, key) && bt_size(tree) == i + 1);
+                if (i % 64 == 0)
+                        assert(bt_assert(tree));
+        }
+        assert(bt_assert(tree));
+
+        // Odd keys fall between the stored ones
+        for (int i = 0; i < n; ++i) {
+                void * key = (void *)(uintptr_t)(2 * order[i]);
+                assert(!bt_has(tree, (void *)(uintptr_t)(2 * i + 1)));
+                assert(*bt_find(tree, key) == (void *)(uintptr_t)(3 * i + 1));
+                assert(bt_insert(tree, key, (void *)(uintptr_t)(5 * i + 2)) == 0);
+        }
+        assert(bt_size(tree) == n && freed_data == n);
+
+        // Remove in reverse, checking the rebalancing as we go
+        for (int i = 0; i < n; ++i) {
+                void * key = (void *)(uintptr_t)(2 * order[n - 1 - i]);
+                assert(bt_remove(tree, key) == 1);
+                assert(!bt_has(tree, key) && bt_remove(tree, key) == 0);
+                assert(bt_size(tree) == n - i - 1);
+                if (i % 64 == 0)
+                        assert(bt_assert(tree));
+        }
+        assert(bt_assert(tree) && freed_data == 2 * n);
+
+        for (int i = 0; i < n; ++i)
+                bt_insert(tree, (void *)(uintptr_t)i, NULL);
+        free(order);
+        bt_free(tree);
+        assert(freed_data == 3 * n);
+        return 0;
+}
+
+int test_pool(int n)
+{
+        struct rbtreeinfo info = {
+                .keycopy = int_copy,
+                .keycomp = int_comp,
+                .keyfree = int_free,
+                .datafree = data_free,
+                .pool = 1,
+        };
+        RBTREE * tree = rb_init(&info);
+        assert(tree);
+
+        freed_data = 0;
+        int * order = shuffled(n);
+        for (int i = 0; i < n; ++i)
+                assert(rb_insert(tree, (void *)(uintptr_t)order[i],
+                                        (void *)(uintptr_t)i) == 1);
+        assert(rb_assert(tree) && rb_size(tree) == n);
+
+        // Remember where every node lives
+        void ** slots = malloc(n * sizeof(*slots));
+        assert(n == 0 || slots);
+        for (int i = 0; i < n; ++i)
+                slots[i] = rb_find(tree, (void *)(uintptr_t)i);
+        qsort(slots, n, sizeof(*slots), ptr_comp);
+
+        // Churn: removed nodes are reused, so new keys land in old nodes
+        for (int round = 0; round < 4; ++round) {
+                for (int i = round; i < n; i += 4)
+                        assert(rb_remove(tree, (void *)(uintptr_t)order[i]) == 1);
+                for (int i = round; i < n; i += 4) {
+                        order[i] += n;
+                        assert(rb_insert(tree, (void *)(uintptr_t)order[i],
+                                                (void *)(uintptr_t)i) == 1);
+                        void * slot = rb_find(tree, (void *)(uintptr_t)order[i]);
+                        assert(bsearch(&slot, slots, n, sizeof(*slots),
+                                                ptr_comp) != NULL);
+                }
+                assert(rb_assert(tree) && rb_size(tree) == n);
+        }
+        for (int i = 0; i < n; ++i)
+                assert(*rb_find(tree, (void *)(uintptr_t)order[i]) ==
+                                (void *)(uintptr_t)i);
+        assert(freed_data == n);
+
+        // Freeing sweeps the chunks and still drops every value
+        rb_free(tree);
+        assert(freed_data == 2 * n);
+        free(slots);
+        free(order);
+        return 0;
+}
+
+int test_build_merge(int n)
+{
+        struct rbtreeinfo info = {
+                .keycopy = int_copy,
+                .keycomp = int_comp,
+                .keyfree = int_free,
+                .datafree = data_free,
+        };
+
+        // Even keys, each with half its key as value
+        void ** keys = malloc((2 * n + 1) * sizeof(*keys));
+        void ** values = malloc((2 * n + 1) * sizeof(*values));
+        assert(keys && values);
+        for (int i = 0; i < n; ++i) {
+                keys[i] = (void *)(uintptr_t)(2 * i);
+                values[i] = (void *)(uintptr_t)i;
+        }
+        if (n > 1) {
+                RBTREE * tree = rb_build_sorted(&info, keys + 1, NULL, n - 1);
+                assert(tree && rb_assert(tree) && rb_size(tree) == n - 1);
+                rb_free(tree);
+                void * t = keys[0];
+                keys[0] = keys[1], keys[1] = t;
+                assert(rb_build_sorted(&info, keys, values, n) == NULL);
+                assert(errno == EINVAL);
+                keys[1] = keys[0], keys[0] = t;
+        }
+
+        freed_data = 0;
+        RBTREE * tree = rb_build_sorted(&info, keys, values, n);
+        assert(tree && rb_assert(tree) && rb_size(tree) == n);
+
+        // Perfectly balanced: no path is longer than ceil(log2(n + 1))
+        int height = 0;
+        while ((1L << height) < n + 1L)
+                height++;
+        struct rb_iter it;
+        int i = 0;
+        for (rb_first(tree, &it); !rb_end(&it); rb_next(&it), ++i) {
+                assert(it.depth <= height);
+                assert(it.key == keys[i] && it.data == values[i]);
+        }
+        assert(i == n);
+
+        // A batch as large as the tree is merged: new keys 4i + 1 and
+        // 4i + 3, and new values for the keys 4i
+        int m = 0;
+        for (i = 0; i < n / 2; ++i) {
+                keys[m] = (void *)(uintptr_t)(4 * i);
+                values[m++] = (void *)(uintptr_t)(n + i);
+                keys[m] = (void *)(uintptr_t)(4 * i + 1);
+                values[m++] = (void *)(uintptr_t)(n + i);
+                keys[m] = (void *)(uintptr_t)(4 * i + 3);
+                values[m++] = (void *)(uintptr_t)(n + i);
+        }
+        int added = 2 * (n / 2), dropped = n / 2;
+        assert(rb_merge_sorted(tree, keys, values, m) == added);
+        assert(rb_assert(tree) && rb_size(tree) == n + added);
+        assert(freed_data == dropped);
+        for (int k = 0; k < m; ++k)
+                assert(*rb_find(tree, keys[k]) == values[k]);
+        for (rb_first(tree, &it); !rb_end(&it); rb_next(&it))
+                assert(it.depth <= height + 1);
+
+        // A small one is inserted
+        void * extra[] = { (void *)(uintptr_t)(4 * n + 1),
+                (void *)(uintptr_t)(4 * n + 3) };
+        if (n > 64) {
+                assert(rb_merge_sorted(tree, extra, NULL, 2) == 2);
+                assert(rb_has(tree, extra[0]) && rb_has(tree, extra[1]));
+                assert(rb_remove(tree, extra[0]) == 1);
+                assert(rb_assert(tree) && rb_size(tree) == n + added + 1);
+                dropped += 2;
+        }
+
+        rb_free(tree);
+        assert(freed_data == dropped + n + added);
+        free(keys);
+        free(values);
+        return 0;
+}
+
+int test_set_ops(int n)
+{
+        struct rbtreeinfo info = {
+                .keycopy = int_copy,
+                .keycomp = int_comp,
+                .keyfree = int_free,
+                .datafree = data_free,
+        };
+        check_set_ops(&info, n);
+        info.pool = 1;
+        check_set_ops(&info, n);
+
+        // Pooled and unpooled nodes can't be mixed
+        RBTREE * a = multiples(&info, 2, n, 1);
+        info.pool = 0;
+        RBTREE * b = multiples(&info, 3, n, 2);
+        assert(rb_union(a, b) == -1 && errno == EINVAL);
+        assert(rb_size(a) == n && rb_size(b) == n);
+        rb_free(a);
+        rb_free(b);
+
+        // Two trees that share their pools with others can't be combined,
+        // until one of those others is freed
+        info.pool = 1;
+        a = multiples(&info, 2, n, 1);
+        b = multiples(&info, 3, n, 2);
+        RBTREE * a2 = rb_split(a, (void *)(uintptr_t)n);
+        RBTREE * b2 = rb_split(b, (void *)(uintptr_t)n);
+        assert(a2 && b2);
+        assert(rb_union(a, b) == -1 && errno == EINVAL);
+        rb_free(b2);
+        assert(rb_union(a, b) > 0 && rb_size(b) == 0 && rb_assert(a));
+        rb_free(a);
+        rb_free(b);
+        rb_free(a2);
+        info.pool = 0;
+
+        // Large enough for the operations to fork threads
+        check_set_ops(&info, 1 << 15);
+        info.pool = 1;
+        check_set_ops(&info, 1 << 15);
+        return 0;
+}
+
+/*
+ * Combines the multiples of 2 below 6n (value 10k + 1 for key k) with the
+ * multiples of 3 (value 10k + 2) in every way, then splits and rejoins
+ */
+int check_set_ops(struct rbtreeinfo * info, int n)
+{
+        freed_data = 0;
+        RBTREE * a = multiples(info, 2, 3 * n, 1);
+        RBTREE * b = multiples(info, 3, 2 * n, 2);
+        assert(rb_union(a, b) == 4 * n && rb_size(b) == 0);
+        assert(rb_assert(a) && freed_data == n);
+        for (int k = 0; k < 6 * n; ++k) {
+                void ** data = rb_find(a, (void *)(uintptr_t)k);
+                assert((data != NULL) == (k % 2 == 0 || k % 3 == 0));
+                if (data != NULL)
+                        assert(*data == (void *)(uintptr_t)(10 * k +
+                                                (k % 3 == 0 ? 2 : 1)));
+        }
+        rb_free(a);
+        rb_free(b);
+
+        freed_data = 0;
+        a = multiples(info, 2, 3 * n, 1);
+        b = multiples(info, 3, 2 * n, 2);
+        assert(rb_intersect(a, b) == n && rb_size(b) == 0);
+        assert(rb_assert(a) && freed_data == 4 * n);
+        for (int k = 0; k < 6 * n; ++k) {
+                void ** data = rb_find(a, (void *)(uintptr_t)k);
+                assert((data != NULL) == (k % 6 == 0));
+                assert(data == NULL || *data == (void *)(uintptr_t)(10 * k + 1));
+        }
+        rb_free(a);
+        rb_free(b);
+
+        freed_data = 0;
+        a = multiples(info, 2, 3 * n, 1);
+        b = multiples(info, 3, 2 * n, 2);
+        assert(rb_difference(a, b) == 2 * n && rb_size(b) == 0);
+        assert(rb_assert(a) && freed_data == 3 * n);
+        for (int k = 0; k < 6 * n; ++k)
+                assert(rb_has(a, (void *)(uintptr_t)k) ==
+                                (k % 2 == 0 && k % 3 != 0));
+        rb_free(a);
+        rb_free(b);
+
+        // Split anywhere, then join back
+        a = multiples(info, 1, n, 1);
+        int cuts[] = { -1, 0, n / 3, n / 2, n - 1, n };
+        for (int c = 0; c < 6; ++c) {
+                int cut = cuts[c];
+                RBTREE * right = rb_split(a, (void *)(uintptr_t)cut);
+                int lo = cut < 0 ? 0 : cut;
+                assert(right && rb_assert(a) && rb_assert(right));
+                assert(rb_size(a) == lo && rb_size(right) == n - lo);
+                assert(lo == 0 || rb_has(a, (void *)(uintptr_t)(lo - 1)));
+                assert(lo == n || rb_has(right, (void *)(uintptr_t)lo));
+                if (lo > 0 && lo < n)
+                        assert(rb_join(right, a) == -1 && errno == EINVAL);
+                assert(rb_join(a, right) == n && rb_size(right) == 0);
+                assert(rb_assert(a));
+                rb_free(right);
+        }
+        for (int k = 0; k < n; ++k)
+                assert(*rb_find(a, (void *)(uintptr_t)k) ==
+                                (void *)(uintptr_t)(10 * k + 1));
+        rb_free(a);
+        return 0;
+}
+
+// The keys 0, step, .. (n - 1) * step, inserted in a scrambled order
+RBTREE * multiples(struct rbtreeinfo * info, int step, int n, int tag)
+{
+        RBTREE * tree = rb_init(info);
+        assert(tree);
+        int * order = shuffled(n);
+        for (int i = 0; i < n; ++i) {
+                int k = step * order[i];
+                rb_insert(tree, (void *)(uintptr_t)k,
+                                (void *)(uintptr_t)(10 * k + tag));
+        }
+        free(order);
+        return tree;
+}
+
+int test_concurrent(int n)
+{
+        struct rbtreeinfo info = {
+                .keycopy = int_copy,
+                .keycomp = int_comp,
+                .keyfree = int_free,
+                .datafree = data_free,
+        };
+
+        // On one thread the copying writes must leave the same tree
+        for (info.pool = 0; info.pool < 2; ++info.pool) {
+                RBTREE * tree = rb_init_concurrent(&info);
+                assert(tree);
+                freed_data = 0;
+                int * order = shuffled(n);
+                for (int i = 0; i < n; ++i) {
+                        assert(rb_insert(tree, (void *)(uintptr_t)order[i],
+                                                (void *)(uintptr_t)i) == 1);
+                        assert(i % 64 || rb_assert(tree));
+                }
+                assert(rb_assert(tree) && rb_size(tree) == n);
+                for (int i = 0; i < n; ++i)
+                        assert(rb_insert(tree, (void *)(uintptr_t)order[i],
+                                                (void *)(uintptr_t)(n + i)) == 0);
+                for (int i = 0; i < n; i += 2) {
+                        assert(rb_remove(tree, (void *)(uintptr_t)order[i]) == 1);
+                        assert(rb_remove(tree, (void *)(uintptr_t)order[i]) == 0);
+                        assert(i % 64 || rb_assert(tree));
+                }
+                assert(rb_assert(tree) && rb_size(tree) == n / 2);
+
+                for (int i = 0; i < n; ++i) {
+                        void ** data = rb_find(tree, (void *)(uintptr_t)order[i]);
+                        assert((data != NULL) == (i % 2 == 1));
+                        assert(data == NULL || *data == (void *)(uintptr_t)(n + i));
+                }
+                for (int k = 0; k < n / 2; ++k) {
+                        void * key;
+                        assert(rb_select(tree, k, &key, NULL) == 1);
+                        assert(rb_rank(tree, key) == k);
+                }
+
+                struct rb_iter it;
+                int count = 0, last = -1;
+                assert(rb_read_lock(tree) == 0 && rb_read_lock(tree) == 0);
+                for (rb_first(tree, &it); !rb_end(&it); rb_next(&it)) {
+                        assert((int)(uintptr_t)it.key > last);
+                        last = (int)(uintptr_t)it.key;
+                        ++count;
+                }
+                assert(rb_read_unlock(tree) == 0 && rb_read_unlock(tree) == 0);
+                assert(count == n / 2);
+
+                // Operations that relink nodes in place are refused
+                void * one = (void *)(uintptr_t)n;
+                assert(rb_merge_sorted(tree, &one, NULL, 1) == -1 &&
+                                errno == EINVAL);
+                assert(rb_split(tree, one) == NULL && errno == EINVAL);
+
+                // Replaced and removed values went to limbo, not away
+                rb_free(tree);
+                assert(freed_data == 2 * n);
+                free(order);
+        }
+
+        // Readers check keys that stay put while a writer churns the rest
+        info.pool = 0;
+        RBTREE * tree = rb_init_concurrent(&info);
+        assert(tree);
+        for (int k = 0; k < 2 * n; k += 2)
+                assert(rb_insert(tree, (void *)(uintptr_t)k,
+                                        (void *)(uintptr_t)k) == 1);
+
+        atomic_int stop = 0;
+        struct reader_arg arg = { tree, n, &stop };
+        pthread_t readers[4];
+        for (int t = 0; t < 4; ++t)
+                assert(pthread_create(&readers[t], NULL, concurrent_reader,
+                                        &arg) == 0);
+        for (int round = 0; round < 4; ++round) {
+                for (int k = 1; k < 2 * n; k += 2)
+                        assert(rb_insert(tree, (void *)(uintptr_t)k, NULL) == 1);
+                for (int k = 0; k < 2 * n; k += 2)
+                        assert(rb_insert(tree, (void *)(uintptr_t)k,
+                                                (void *)(uintptr_t)k) == 0);
+                for (int k = 1; k < 2 * n; k += 2)
+                        assert(rb_remove(tree, (void *)(uintptr_t)k) == 1);
+        }
+        atomic_store(&stop, 1);
+        for (int t = 0; t < 4; ++t)
+                pthread_join(readers[t], NULL);
+        assert(rb_assert(tree) && rb_size(tree) == n);
+        rb_free(tree);
+        return 0;
+}
+
+// Looks up the even keys below 2n, which must all be there, until stopped
+void * concurrent_reader(void * p)
+{
+        struct reader_arg * arg = (struct reader_arg *)p;
+        do {
+                assert(rb_size(arg->tree) >= arg->n);
+                for (int k = 0; k < 2 * arg->n; ++k) {
+                        if (k % 2 == 1) {
+                                assert(rb_has(arg->tree,
+                                                (void *)(uintptr_t)k) >= 0);
+                                continue;
+                        }
+                        assert(rb_read_lock(arg->tree) == 0);
+                        void ** data = rb_find(arg->tree, (void *)(uintptr_t)k);
+                        assert(data && *data == (void *)(uintptr_t)k);
+                        assert(rb_read_unlock(arg->tree) == 0);
+                }
+        } while (!atomic_load(arg->stop));
+        return NULL;
+}
+
+int test_snapshot(int n)
+{
+        struct rbtreeinfo info = {
+                .keycopy = key_copy,
+                .keycomp = int_comp,
+                .keyfree = key_free,
+                .datafree = data_free,
+        };
+        enum { VERSIONS = 8 };
+        int range = 2 * n + 1;
+
+        // Owned values can't be shared without a way to copy them
+        RBTREE * tree = rb_init(&info);
+        assert(tree && rb_snapshot(tree) == NULL && errno == EINVAL);
+        rb_free(tree);
+        info.datacopy = data_copy;
+
+        for (info.pool = 0; info.pool < 2; ++info.pool) {
+                freed_data = copied_data = 0;
+                int handed = 0;         // Values passed to the trees
+                RBTREE * versions[VERSIONS];
+                char * present = calloc(VERSIONS, range);
+                void ** values = calloc(VERSIONS * range, sizeof(*values));
+                assert(present && values);
+
+                versions[0] = rb_init(&info);
+                assert(versions[0]);
+                int * order = shuffled(n);
+                for (int i = 0; i < n; ++i) {
+                        int k = order[i];
+                        rb_insert(versions[0], (void *)(uintptr_t)k,
+                                        (void *)(uintptr_t)k);
+                        present[k] = 1;
+                        values[k] = (void *)(uintptr_t)k;
+                        ++handed;
+                }
+                free(order);
+
+                // Each version is the one before with random changes
+                unsigned int x = 2463534242u;
+                for (int v = 1; v < VERSIONS; ++v) {
+                        versions[v] = rb_snapshot(versions[v - 1]);
+                        assert(versions[v]);
+                        memcpy(present + v * range, present + (v - 1) * range,
+                                        range);
+                        memcpy(values + v * range, values + (v - 1) * range,
+                                        range * sizeof(*values));
+                        for (int i = 0; i < n / 4 + 1; ++i) {
+                                x ^= x << 13, x ^= x >> 17, x ^= x << 5;
+                                int k = (x >> 1) % range, at = v * range + k;
+                                void * key = (void *)(uintptr_t)k;
+                                if (x & 1) {
+                                        void * value =
+                                                (void *)(uintptr_t)(10 * k + v);
+                                        assert(rb_insert(versions[v], key,
+                                                        value) == !present[at]);
+                                        handed += !present[at] ||
+                                                values[at] != value;
+                                        present[at] = 1;
+                                        values[at] = value;
+                                } else {
+                                        assert(rb_remove(versions[v], key) ==
+                                                        present[at]);
+                                        present[at] = 0;
+                                }
+                        }
+                }
+                for (int v = 0; v < VERSIONS; ++v)
+                        check_version(versions[v], present + v * range,
+                                        values + v * range, range);
+
+                // rb_pinsert and rb_premove leave their source alone
+                RBTREE * more = rb_pinsert(versions[0], (void *)(uintptr_t)n,
+                                (void *)(uintptr_t)n);
+                RBTREE * fewer = rb_premove(versions[0], (void *)(uintptr_t)0);
+                assert(more && fewer);
+                ++handed;
+                assert(rb_size(more) == n + 1 && rb_has(more,
+                                        (void *)(uintptr_t)n));
+                assert(rb_size(fewer) == n - (n > 0) &&
+                                !rb_has(fewer, (void *)(uintptr_t)0));
+                check_version(versions[0], present, values, range);
+
+                // Shared trees can't be relinked in place
+                assert(rb_split(more, (void *)(uintptr_t)1) == NULL &&
+                                errno == EINVAL);
+                assert(rb_join(more, fewer) == -1 && errno == EINVAL);
+                rb_free(more);
+                rb_free(fewer);
+
+                // Every version stays whole whichever are freed first
+                int freed[VERSIONS] = { 0 };
+                for (int i = 0; i < VERSIONS; ++i) {
+                        int v = (3 * i + 1) % VERSIONS;
+                        rb_free(versions[v]);
+                        freed[v] = 1;
+                        for (int w = 0; w < VERSIONS; ++w)
+                                if (!freed[w])
+                                        check_version(versions[w],
+                                                        present + w * range,
+                                                        values + w * range,
+                                                        range);
+                }
+                assert(live_keys == 0);
+                assert(freed_data == handed + copied_data);
+                free(present);
+                free(values);
+
+                // With its snapshot freed, a tree writes in place again
+                tree = rb_init(&info);
+                assert(tree);
+                for (int k = 0; k < n; ++k)
+                        rb_insert(tree, (void *)(uintptr_t)k, NULL);
+                rb_free(rb_snapshot(tree));
+                copied_data = 0;
+                assert(rb_insert(tree, (void *)(uintptr_t)0, NULL) == 0);
+                assert(rb_remove(tree, (void *)(uintptr_t)1) == 1);
+                assert(copied_data == 0 && live_keys == n - 1);
+                RBTREE * right = rb_split(tree, (void *)(uintptr_t)(n / 2));
+                assert(right && rb_assert(tree) && rb_assert(right));
+                assert(rb_size(tree) + rb_size(right) == n - 1);
+                rb_free(tree);
+                rb_free(right);
+                assert(live_keys == 0);
+        }
+
+        // Versions sharing nodes may be changed and freed on other threads
+        for (info.pool = 0; info.pool < 2; ++info.pool) {
+                freed_data = copied_data = 0;
+                RBTREE * base = rb_init(&info);
+                assert(base);
+                for (int k = 0; k < n; ++k)
+                        rb_insert(base, (void *)(uintptr_t)k, NULL);
+                RBTREE * copies[4];
+                pthread_t threads[4];
+                for (int t = 0; t < 4; ++t) {
+                        copies[t] = rb_snapshot(base);
+                        assert(copies[t]);
+                }
+                rb_free(base);
+                for (int t = 0; t < 4; ++t)
+                        assert(pthread_create(&threads[t], NULL, churn_version,
+                                                copies[t]) == 0);
+                for (int t = 0; t < 4; ++t)
+                        pthread_join(threads[t], NULL);
+                assert(live_keys == 0);
+                assert(freed_data == n + 2 * ((n + 1) / 2) * 4 + copied_data);
+        }
+        return 0;
+}
+
+/*
+ * Replaces the values of the even keys (below the tree's size) of the tree
+ * 'p' twice and removes the odd ones, then frees the tree
+ */
+void * churn_version(void * p)
+{
+        RBTREE * tree = (RBTREE *)p;
+        int n = rb_size(tree);
+        for (int round = 1; round <= 2; ++round)
+                for (int k = 0; k < n; k += 2)
+                        assert(rb_insert(tree, (void *)(uintptr_t)k,
+                                        (void *)(uintptr_t)round) == 0);
+        for (int k = 1; k < n; k += 2)
+                assert(rb_remove(tree, (void *)(uintptr_t)k) == 1);
+        assert(rb_assert(tree) && rb_size(tree) == (n + 1) / 2);
+        rb_free(tree);
+        return NULL;
+}
+
+// Checks that 'tree' holds exactly the keys k < 'range' with present[k]
+int check_version(RBTREE * tree, const char * present, void * const * values,
+                int range)
+{
+        int size = 0;
+        for (int k = 0; k < range; ++k) {
+                void ** data = rb_find(tree, (void *)(uintptr_t)k);
+                assert((data != NULL) == present[k]);
+                assert(data == NULL || *data == values[k]);
+                size += present[k];
+        }
+        assert(rb_assert(tree) && rb_size(tree) == size);
+        return 0;
+}
+
+// Keys are pointers to ints, ordered by the ints
+int ref_copy(void * dest, void * src)
+{
+        *(void **)dest = *(void **)src;
+        return 0;
+}
+
+int ref_comp(void * p, void * q)
+{
+        int a = *(int *)p, b = *(int *)q;
+        return (a > b) - (a < b);
+}
+
+int ref_free(void * p)
+{
+        (void)p;
+        return 0;
+}
+
+int test_check(int n)
+{
+        // Big enough for rb_check to use several threads.  The ints are laid
+        // out in decreasing order, so comparing the key pointers themselves
+        // gets every pair of keys backwards
+        int size = n > (1 << 17) ? n : 1 << 17;
+        int * ints = malloc(size * sizeof(*ints));
+        void ** keys = malloc(size * sizeof(*keys));
+        assert(ints && keys);
+        for (int i = 0; i < size; ++i) {
+                ints[size - 1 - i] = 2 * i;
+                keys[i] = &ints[size - 1 - i];
+        }
+        struct rbtreeinfo info = { ref_copy, ref_comp, ref_free, NULL };
+        RBTREE * tree = rb_build_sorted(&info, keys, NULL, size);
+        assert(tree != NULL);
+
+        struct rb_stats one, four;
+        assert(rb_check(tree, 1, &one) == 1 && rb_assert(tree));
+        assert(rb_check(tree, 4, &four) == 1);
+        assert(memcmp(&one, &four, sizeof(one)) == 0);
+        assert(one.size == size && one.black_height > 0);
+        assert(one.black_height <= one.min_depth);
+        assert(one.min_depth <= one.max_depth);
+        assert(one.max_depth <= 2 * one.black_height);
+        assert(rb_check(tree, 0, NULL) == -1 && errno == EINVAL);
+
+        // Move a key past its successor: in order, but for one ancestor
+        // that may be far above it, every key still fits its parent
+        fprintf(stderr, "test_check: expect BST violations\n");
+        int at[] = { 1, size / 2, size - 1 };
+        for (int i = 0; i < 3; ++i) {
+                int * key = (int *)keys[at[i] - 1];
+                int was = *key;
+                *key = *(int *)keys[at[i]] + 1;
+                assert(rb_check(tree, 1, NULL) == 0);
+                assert(rb_check(tree, 4, NULL) == 0);
+                *key = was;
+        }
+        assert(rb_check(tree, 4, NULL) == 1);
+
+        // Each key removed and put back; smaller trees check on one thread
+        for (int i = 0; i < n; ++i) {
+                assert(rb_remove(tree, keys[i]) == 1);
+                assert(i % 64 || rb_check(tree, 4, NULL) == 1);
+                assert(rb_insert(tree, keys[i], NULL) == 1);
+        }
+        assert(rb_check(tree, 2, &one) == 1 && one.size == size);
+        rb_free(tree);
+
+        tree = rb_init(&info);
+        assert(rb_check(tree, 4, &one) == 1);
+        assert(one.size == 0 && one.black_height == 0 && one.max_depth == 0);
+        rb_free(tree);
+        free(keys);
+        free(ints);
+        return 0;
+}
+
+int ptr_comp(const void * p, const void * q)
+{
+        uintptr_t a = (uintptr_t)*(void * const *)p;
+        uintptr_t b = (uintptr_t)*(void * const *)q;
+        return (a > b) - (a < b);
+}
+
+// Big-endian bytes of 'i', so byte order is numeric order
+struct key16 key16(int i)
+{
+        struct key16 k = { { 0 } };
+        for (int b = 0; b < 4; ++b)
+                k.b[15 - b] = (unsigned char)(i >> (8 * b));
+        return k;
+}
+
+int test_spec(int n)
+{
+        struct rbi_tree ti;
+        struct rbk_tree tk;
+        rbi_init(&ti, data_free);
+        rbk_init(&tk, NULL);
+
+        freed_data = 0;
+        int * order = shuffled(n);
+        for (int i = 0; i < n; ++i) {
+                int k = 2 * order[i];
+                assert(rbi_insert(&ti, k, (void *)(uintptr_t)(3 * i + 1)) == 1);
+                assert(rbk_insert(&tk, key16(k), (void *)(uintptr_t)i) == 1);
+        }
+        assert(rbi_assert(&ti) && rbk_assert(&tk));
+        assert(rbi_size(&ti) == n && rbk_size(&tk) == n);
+
+        for (int i = 0; i < n; ++i) {
+                int k = 2 * order[i];
+                assert(!rbi_has(&ti, k + 1) && !rbk_has(&tk, key16(k + 1)));
+                assert(*rbk_find(&tk, key16(k)) == (void *)(uintptr_t)i);
+                assert(*rbi_find(&ti, k) == (void *)(uintptr_t)(3 * i + 1));
+                assert(rbi_insert(&ti, k, (void *)(uintptr_t)(5 * i + 2)) == 0);
+        }
+        assert(rbi_size(&ti) == n && freed_data == n);
+
+        for (int i = 0; i < n; i += 2) {
+                int k = 2 * order[i];
+                assert(rbi_remove(&ti, k) == 1 && rbi_remove(&ti, k) == 0);
+                assert(rbk_remove(&tk, key16(k)) == 1);
+                assert(!rbi_has(&ti, k) && !rbk_has(&tk, key16(k)));
+        }
+        assert(rbi_assert(&ti) && rbk_assert(&tk));
+        assert(rbi_size(&ti) == n / 2 && rbk_size(&tk) == n / 2);
+        for (int i = 1; i < n; i += 2) {
+                int k = 2 * order[i];
+                assert(*rbi_find(&ti, k) == (void *)(uintptr_t)(5 * i + 2));
+                assert(*rbk_find(&tk, key16(k)) == (void *)(uintptr_t)i);
+        }
+
+        free(order);
+        rbi_free(&ti);
+        rbk_free(&tk);
+        assert(freed_data == 2 * n);
+        return 0;
+}
+
+/*
+ * Insert, lookup and teardown times of each tree for 1e5 random keys, and
+ * ten times more per round up to 'max'
+ */
+int bench(int max)
+{
+        struct rbtreeinfo info = {
+                .keycopy = int_copy,
+                .keycomp = int_comp,
+                .keyfree = int_free,
+        };
+        struct rbtreeinfo pooled = info;
+        pooled.pool = 1;
+
+        printf("%10s  %-8s  %10s  %10s  %10s\n", "keys", "tree", "insert ns",
+                        "lookup ns", "free ms");
+        for (long n = 100000; n <= max; n *= 10) {
+                // Keys are looked up in a different order than inserted
+                int * keys = malloc(n * sizeof(*keys));
+                int * probe = malloc(n * sizeof(*probe));
+                assert(keys && probe);
+                unsigned int x = 2463534242u;
+                for (int i = 0; i < n; ++i) {
+                        x ^= x << 13, x ^= x >> 17, x ^= x << 5;
+                        probe[i] = keys[i] = x & INT_MAX;
+                }
+                for (int i = n - 1; i > 0; --i) {
+                        x ^= x << 13, x ^= x >> 17, x ^= x << 5;
+                        int j = x % (i + 1), t = probe[i];
+                        probe[i] = probe[j], probe[j] = t;
+                }
+
+                struct timespec start;
+                double insert[4], lookup[4], teardown[4];
+                long hits = 0;
+
+                // Every tree starts from fresh memory: freeing one first
+                // would leave the next its scattered blocks
+                RBTREE * rb = rb_init(&info);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (int i = 0; i < n; ++i)
+                        rb_insert(rb, (void *)(uintptr_t)keys[i], NULL);
+                insert[0] = elapsed(&start);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (int i = 0; i < n; ++i)
+                        hits += rb_has(rb, (void *)(uintptr_t)probe[i]);
+                lookup[0] = elapsed(&start);
+
+                struct rbi_tree rbi;
+                rbi_init(&rbi, NULL);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (int i = 0; i < n; ++i)
+                        rbi_insert(&rbi, keys[i], NULL);
+                insert[1] = elapsed(&start);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (int i = 0; i < n; ++i)
+                        hits += rbi_has(&rbi, probe[i]);
+                lookup[1] = elapsed(&start);
+
+                RBTREE * rbp = rb_init(&pooled);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (int i = 0; i < n; ++i)
+                        rb_insert(rbp, (void *)(uintptr_t)keys[i], NULL);
+                insert[2] = elapsed(&start);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (int i = 0; i < n; ++i)
+                        hits += rb_has(rbp, (void *)(uintptr_t)probe[i]);
+                lookup[2] = elapsed(&start);
+
+                BTREE * bt = bt_init(&info);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (int i = 0; i < n; ++i)
+                        bt_insert(bt, (void *)(uintptr_t)keys[i], NULL);
+                insert[3] = elapsed(&start);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (int i = 0; i < n; ++i)
+                        hits += bt_has(bt, (void *)(uintptr_t)probe[i]);
+                lookup[3] = elapsed(&start);
+
+                // The pooled tree goes first, before glibc has the blocks
+                // of the others to consolidate
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                rb_free(rbp);
+                teardown[2] = elapsed(&start);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                bt_free(bt);
+                teardown[3] = elapsed(&start);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                rbi_free(&rbi);
+                teardown[1] = elapsed(&start);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                rb_free(rb);
+                teardown[0] = elapsed(&start);
+
+                const char * names[] = { "rbtree", "rbi", "rbpool", "btree" };
+                for (int t = 0; t < 4; ++t)
+                        printf("%10ld  %-8s  %10.1f  %10.1f  %10.1f\n", n,
+                                        names[t], insert[t] * 1e9 / n,
+                                        lookup[t] * 1e9 / n, teardown[t] * 1e3);
+                fflush(stdout);
+
+                // Loading keys that are already in order
+                void ** sorted = malloc(n * sizeof(*sorted));
+                assert(sorted);
+                for (int i = 0; i < n; ++i)
+                        sorted[i] = (void *)(uintptr_t)i;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                rb = rb_init(&info);
+                for (int i = 0; i < n; ++i)
+                        rb_insert(rb, sorted[i], NULL);
+                double by_insert = elapsed(&start);
+                rb_free(rb);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                rb = rb_build_sorted(&info, sorted, NULL, n);
+                double by_build = elapsed(&start);
+                rb_free(rb);
+                printf("%10ld  sorted load: %.1f ms by rb_insert, %.1f ms by "
+                                "rb_build_sorted\n", n, by_insert * 1e3,
+                                by_build * 1e3);
+                free(sorted);
+
+                // One lookup at a time against interleaved batches
+                rb = rb_init(&info);
+                for (int i = 0; i < n; ++i)
+                        rb_insert(rb, (void *)(uintptr_t)keys[i], NULL);
+                void ** probes = malloc(n * sizeof(*probes));
+                assert(probes);
+                for (int i = 0; i < n; ++i)
+                        probes[i] = (void *)(uintptr_t)probe[i];
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (int i = 0; i < n; ++i)
+                        hits += rb_has(rb, probes[i]);
+                double one = elapsed(&start);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                hits += rb_has_many(rb, probes, n, NULL);
+                double many = elapsed(&start);
+                printf("%10ld  lookup: %.1f ns by rb_has, %.1f ns by "
+                                "rb_has_many\n", n, one * 1e9 / n,
+                                many * 1e9 / n);
+                rb_free(rb);
+                free(probes);
+
+                assert(hits == 6 * n);
+                free(keys);
+                free(probe);
+        }
+        return 0;
+}
+
+/*
+ * Lookup throughput of a concurrent tree against a plain tree behind a
+ * rwlock, for 1, 2, 4 .. 'max' reader threads, while one writer inserts and
+ * removes a key every 10us.  Every reader looks up 2^20 random keys from
+ * twice the preloaded range.
+ */
+int bench_readers(int max)
+{
+        struct rbtreeinfo info = {
+                .keycopy = int_copy,
+                .keycomp = int_comp,
+                .keyfree = int_free,
+        };
+        const int keys = 1 << 16;
+        const long ops = 1 << 20;
+
+        printf("%8s  %-10s  %12s  %10s\n", "threads", "tree",
+                        "lookups/us", "writes");
+        for (int nthreads = 1; nthreads <= max; nthreads *= 2) {
+                for (int concurrent = 0; concurrent < 2; ++concurrent) {
+                        pthread_rwlock_t lock;
+                        pthread_rwlock_init(&lock, NULL);
+                        RBTREE * tree = concurrent ? rb_init_concurrent(&info) :
+                                rb_init(&info);
+                        assert(tree);
+                        for (int k = 0; k < 2 * keys; k += 2)
+                                rb_insert(tree, (void *)(uintptr_t)k, NULL);
+
+                        atomic_int stop = 0;
+                        struct bench_arg args[nthreads + 1];
+                        pthread_t threads[nthreads + 1];
+                        for (int t = 0; t <= nthreads; ++t)
+                                args[t] = (struct bench_arg){ tree,
+                                        concurrent ? NULL : &lock,
+                                        2463534242u + t, ops, 2 * keys,
+                                        &stop, 0 };
+
+                        struct timespec start;
+                        clock_gettime(CLOCK_MONOTONIC, &start);
+                        pthread_create(&threads[nthreads], NULL, bench_writer,
+                                        &args[nthreads]);
+                        for (int t = 0; t < nthreads; ++t)
+                                pthread_create(&threads[t], NULL, bench_reader,
+                                                &args[t]);
+                        for (int t = 0; t < nthreads; ++t)
+                                pthread_join(threads[t], NULL);
+                        double secs = elapsed(&start);
+                        atomic_store(&stop, 1);
+                        pthread_join(threads[nthreads], NULL);
+
+                        printf("%8d  %-10s  %12.1f  %10ld\n", nthreads,
+                                        concurrent ? "concurrent" : "rwlock",
+                                        nthreads * ops / secs / 1e6,
+                                        args[nthreads].writes);
+                        fflush(stdout);
+                        rb_free(tree);
+                        pthread_rwlock_destroy(&lock);
+                }
+        }
+        return 0;
+}
+
+static unsigned int next_rand(unsigned int * x)
+{
+        *x ^= *x << 13;
+        *x ^= *x >> 17;
+        *x ^= *x << 5;
+        return *x;
+}
+
+void * bench_reader(void * p)
+{
+        struct bench_arg * a = (struct bench_arg *)p;
+        unsigned int x = a->seed;
+        long hits = 0;
+        for (long i = 0; i < a->ops; ++i) {
+                void * key = (void *)(uintptr_t)(next_rand(&x) % a->range);
+                if (a->lock)
+                        pthread_rwlock_rdlock(a->lock);
+                hits += rb_has(a->tree, key);
+                if (a->lock)
+                        pthread_rwlock_unlock(a->lock);
+        }
+        assert(hits > 0);
+        return NULL;
+}
+
+// Inserts and removes odd keys until stopped
+void * bench_writer(void * p)
+{
+        struct bench_arg * a = (struct bench_arg *)p;
+        struct timespec pause = { 0, 10000 };
+        unsigned int x = a->seed;
+        while (!atomic_load(a->stop)) {
+                void * key = (void *)(uintptr_t)(next_rand(&x) % a->range | 1);
+                if (a->lock)
+                        pthread_rwlock_wrlock(a->lock);
+                if (rb_insert(a->tree, key, NULL) == 0)
+                        rb_remove(a->tree, key);
+                if (a->lock)
+                        pthread_rwlock_unlock(a->lock);
+                a->writes += 1;
+                nanosleep(&pause, NULL);
+        }
+        return NULL;
+}
+
+double elapsed(struct timespec * start)
+{
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        return (end.tv_sec - start->tv_sec) +
+                (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Adds each value to *arg, stopping at once if *arg starts out negative
+int range_sum(void * key, void * data, void * arg)
+{
+        long * sum = (long *)arg;
+        if (*sum < 0)
+                return 1;
+        *sum += (long)(uintptr_t)data;
+        return 0;
+}
+
+// Returns 0 .. n - 1 in a scrambled but repeatable order
+int * shuffled(int n)
+{
+        unsigned int x = 2463534242u;
+        int * order = malloc(n * sizeof(*order));
+        assert(n == 0 || order);
+        for (int i = 0; i < n; ++i)
+                order[i] = i;
+        for (int i = n - 1; i > 0; --i) {
+                x ^= x << 13, x ^= x >> 17, x ^= x << 5;
+                int j = x % (i + 1), t = order[i];
+                order[i] = order[j], order[j] = t;
+        }
+        return order;
+}
+
 int int_copy(void * dest, void * src)
 {
         int * d = (int *)dest;
@@ -121,3 +1438,29 @@ int int_free(void * p)
         (void)p;
         return 0;
 }
+
+int key_copy(void * dest, void * src)
+{
+        live_keys += 1;
+        return int_copy(dest, src);
+}
+
+int key_free(void * p)
+{
+        live_keys -= 1;
+        return int_free(p);
+}
+
+int data_copy(void * dest, void * src)
+{
+        copied_data += 1;
+        *(void **)dest = *(void **)src;
+        return 0;
+}
+
+int data_free(void * p)
+{
+        (void)p;
+        freed_data += 1;
+        return 0;
+}
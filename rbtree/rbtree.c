@@ -1,6 +1,7 @@
 // eternallyconfuzzled.com/tuts/datastructures/jsw_tut_rbtree.aspx
 #include "rbtree.h"
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -13,28 +14,89 @@
 #define _RB_TREE_VALID 0x158df3
 // NULL nodes are black
 #define is_red(node) ( ((node) != NULL) && ((node)->color == RBT_RED) )
+// Number of nodes in the subtree at 'node' (NULL subtrees are empty)
+#define node_size(node) ( (node) != NULL ? (node)->size : 0 )
+// Nodes in the first and the largest pool chunks (see struct rb_chunk)
+#define RB_CHUNK_MIN 32
+#define RB_CHUNK_MAX 8192
+// Keys looked up together by rb_has_many
+#define RB_BATCH 16
+// Nodes per thread below which rb_check uses fewer threads
+#define RB_CHECK_GRAIN (1 << 15)
 
 struct rb_tree {
         struct rbtreeinfo info;
         struct rb_node * root;
         uint32_t valid;
+        struct rb_pool * pool;          // NULL unless info.pool is set
+        struct rb_epoch * epoch;        // NULL unless rb_init_concurrent
+        uint32_t * versions;            // Trees sharing nodes with this one,
+                                        // itself included (NULL until
+                                        // snapshotted; see rb_snapshot)
 };
 
 typedef enum { ROT_LEFT , ROT_RIGHT } rotation_t;
 
+// Whether other versions are alive that may share the tree's nodes
+static inline int rb_shared(struct rb_tree * tree)
+{
+        return tree->versions != NULL &&
+                __atomic_load_n(tree->versions, __ATOMIC_ACQUIRE) > 1;
+}
+
 struct rb_node {
         uint8_t  color;
+        uint32_t size;  // Nodes in this subtree
+        uint32_t refs;  // Parents and trees sharing the node (see rb_snapshot)
         void * key; void *   data;
         struct rb_node * link[2];
 };
 
+/*
+ * With info.pool set, nodes are handed out from chunks that double in size
+ * up to RB_CHUNK_MAX nodes: first from the free list of removed nodes, then
+ * by bumping the count of the newest chunk.  A pooled node with color 0 is
+ * not in a tree, so rb_free can sweep the chunks instead of the tree.
+ *
+ * Trees split from one another (or combined by the set operations) share a
+ * pool, since their nodes came from the same chunks.  A pool that other
+ * trees are using too, or that a set operation is using from several
+ * threads, is locked around every allocation and release.
+ */
+struct rb_chunk {
+        struct rb_chunk * next;
+        int n;                  // Nodes handed out
+        int cap;                // Nodes in 'nodes'
+        struct rb_node nodes[];
+};
+
+struct rb_pool {
+        struct rb_chunk * chunks;       // Newest first
+        struct rb_node * free;          // Released nodes (via link[0])
+        int refs;                       // Trees using the pool
+        int threads;                    // Set during a parallel set operation
+        pthread_mutex_t lock;
+};
+
 RBTREE * rb_init(struct rbtreeinfo * info)
 {
         struct rb_tree * rv = (struct rb_tree *)malloc(sizeof * rv);
         if (rv) {
                 rv->root = NULL;
                 rv->valid = _RB_TREE_VALID;
+                rv->pool = NULL;
+                rv->epoch = NULL;
+                rv->versions = NULL;
                 memcpy(&(rv->info), info, sizeof *info);
+                if (info->pool) {
+                        rv->pool = (struct rb_pool *)calloc(1, sizeof *rv->pool);
+                        if (rv->pool == NULL) {
+                                free(rv);
+                                return NULL;
+                        }
+                        rv->pool->refs = 1;
+                        pthread_mutex_init(&rv->pool->lock, NULL);
+                }
         }
         return (RBTREE *)rv;
 }
@@ -47,6 +109,10 @@ struct rb_node * rotation(struct rb_node * root, int direction)
         root->link[direction ^ 1] = parent->link[direction];
         parent->link[direction]   = root;
 
+        // Parent takes over root's subtree; root's shrinks
+        parent->size = root->size;
+        root->size = 1 + node_size(root->link[0]) + node_size(root->link[1]);
+
         // Structre is fixed, now change colors:
         root->color   = RBT_RED;
         parent->color = RBT_BLACK;
@@ -61,201 +127,1690 @@ struct rb_node * double_rotation(struct rb_node * root, int dir)
         return rotation(root, dir);
 }
 
-int _rb_assert(struct rb_node * root)
-{
-        if (root == NULL) return 1;
+/*
+ * rb_check walks the tree depth first with an explicit stack of frames, each
+ * a subtree with the open interval of keys its ancestors allow.  A valid
+ * tree is at most RB_MAX_DEPTH deep, so the stack is bounded and deeper
+ * paths are themselves a violation.  On several threads the top levels are
+ * checked first and the subtrees below handed out round robin.
+ */
+struct rb_frame {
+        struct rb_node * node;
+        void ** lo, ** hi;      // Bounds on the keys below (NULL if none)
+        int depth;              // Nodes above 'node'
+        int blacks;             // Black nodes above 'node'
+};
 
-        int lh, rh;
-        struct rb_node * ln = root->link[0];
-        struct rb_node * rn = root->link[1];
+struct rb_checker {
+        struct rb_tree * tree;
+        struct rb_frame * frames;       // Subtrees to check: frames[i] for
+        int n, first, stride;           // i = first, first + stride, ...
+        int valid;
+        struct rb_stats stats;          // black_height is -1 until a NULL
+                                        // link has been reached
+        pthread_t thread;
+        int forked;                     // Set if 'thread' runs the checker
+};
 
-        // Check for red children of red node
-        if (is_red(root))
-                if (is_red(ln) || is_red(rn)) {
-                        fprintf(stderr, "Red Node Violation\n");
+// Checks for a violation at 'f', recording the frame's NULL link if it is one
+int rb_check_frame(struct rb_checker * c, struct rb_frame * f)
+{
+        struct rb_node * node = f->node;
+        struct rb_stats * stats = &c->stats;
+        if (node == NULL) {
+                if (stats->black_height < 0)
+                        stats->black_height = f->blacks;
+                else if (stats->black_height != f->blacks) {
+                        fprintf(stderr, "Black Height Violation\n");
                         return 0;
                 }
+                if (stats->min_depth > f->depth)
+                        stats->min_depth = f->depth;
+                if (stats->max_depth < f->depth)
+                        stats->max_depth = f->depth;
+                return 1;
+        }
 
-        lh = _rb_assert(ln);
-        rh = _rb_assert(rn);
+        struct rb_node * ln = node->link[0];
+        struct rb_node * rn = node->link[1];
+        int (*keycomp)(void *, void *) = c->tree->info.keycomp;
 
-        // Check for BST violations
-        // TODO: Use comparator
-        if ((ln && ln->key >= root->key) || (rn && rn->key <= root->key)) {
-                fprintf(stderr, "BST Violation");
+        if (node->color != RBT_RED && node->color != RBT_BLACK) {
+                fprintf(stderr, "Color Violation\n");
                 return 0;
         }
-
-        // Check blackheight violation
-        if (lh != 0 && rh != 0 && lh != rh) {
-                fprintf(stderr, "Black Height Violation");
+        if (is_red(node) && (is_red(ln) || is_red(rn))) {
+                fprintf(stderr, "Red Node Violation\n");
+                return 0;
+        }
+        if ((f->lo != NULL && keycomp(node->key, *f->lo) <= 0) ||
+                        (f->hi != NULL && keycomp(node->key, *f->hi) >= 0)) {
+                fprintf(stderr, "BST Violation\n");
+                return 0;
+        }
+        if (node->size != 1 + node_size(ln) + node_size(rn)) {
+                fprintf(stderr, "Size Violation\n");
+                return 0;
+        }
+        if (f->depth >= RB_MAX_DEPTH) {
+                fprintf(stderr, "Depth Violation\n");
                 return 0;
         }
+        stats->size++;
+        return 1;
+}
 
-        if (lh != 0 && rh != 0)
-                return is_red(root) ? lh : lh + 1;
+// The frame of the 'dir' subtree of 'f' (whose node is not NULL)
+struct rb_frame rb_frame_child(struct rb_frame * f, int dir)
+{
+        struct rb_node * node = f->node;
+        struct rb_frame rv = { node->link[dir], f->lo, f->hi, f->depth + 1,
+                        f->blacks + (node->color == RBT_BLACK) };
+        if (dir)
+                rv.lo = &node->key;
         else
-                return 0;
+                rv.hi = &node->key;
+        return rv;
+}
+
+void * rb_check_run(void * arg)
+{
+        struct rb_checker * c = (struct rb_checker *)arg;
+        struct rb_frame stack[RB_MAX_DEPTH + 1];
+
+        for (int i = c->first; c->valid && i < c->n; i += c->stride) {
+                int top = 0;
+                stack[top++] = c->frames[i];
+                while (top > 0) {
+                        struct rb_frame f = stack[--top];
+                        if (!rb_check_frame(c, &f)) {
+                                c->valid = 0;
+                                break;
+                        }
+                        if (f.node != NULL) {
+                                stack[top++] = rb_frame_child(&f, 1);
+                                stack[top++] = rb_frame_child(&f, 0);
+                        }
+                }
+        }
+        return NULL;
+}
+
+// Folds the results of 'from' into 'into'
+void rb_check_merge(struct rb_checker * into, struct rb_checker * from)
+{
+        struct rb_stats * a = &into->stats, * b = &from->stats;
+        into->valid = into->valid && from->valid;
+        if (b->black_height >= 0) {
+                if (a->black_height >= 0 && a->black_height != b->black_height) {
+                        if (into->valid)
+                                fprintf(stderr, "Black Height Violation\n");
+                        into->valid = 0;
+                }
+                a->black_height = b->black_height;
+        }
+        a->size += b->size;
+        if (a->min_depth > b->min_depth)
+                a->min_depth = b->min_depth;
+        if (a->max_depth < b->max_depth)
+                a->max_depth = b->max_depth;
+}
+
+int rb_check(RBTREE * t, int threads, struct rb_stats * stats)
+{
+        struct rb_tree * tree = (struct rb_tree *)t;
+        if (tree == NULL || threads < 1) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        struct rb_node * root = tree->root;
+        if (threads > (int)(node_size(root) / RB_CHECK_GRAIN))
+                threads = node_size(root) / RB_CHECK_GRAIN;
+        if (threads < 1)
+                threads = 1;
+        // A few subtrees per thread, so that uneven ones even out
+        int want = threads > 1 ? 4 * threads : 1;
+
+        // Each level of frames[0, n) is expanded into frames[want, want + 2n)
+        struct rb_frame * frames = malloc(3 * want * sizeof(*frames));
+        struct rb_checker * checkers = calloc(threads, sizeof(*checkers));
+        if (frames == NULL || checkers == NULL) {
+                free(frames);
+                free(checkers);
+                errno = ENOMEM;
+                return -1;
+        }
+
+        struct rb_stats empty = { 0, -1, RB_MAX_DEPTH + 1, 0 };
+        struct rb_checker top = { tree, frames, 0, 0, 1, 1, empty };
+        struct rb_frame start = { root, NULL, NULL, 0, 0 };
+        frames[top.n++] = start;
+        if (is_red(root)) {
+                fprintf(stderr, "Root Red Violation\n");
+                top.valid = 0;
+        }
+
+        // Check the top levels here until there are enough subtrees
+        while (top.valid && top.n > 0 && top.n < want) {
+                int n = 0;
+                for (int i = 0; i < top.n; ++i) {
+                        struct rb_frame * f = &frames[i];
+                        if (!rb_check_frame(&top, f)) {
+                                top.valid = 0;
+                                break;
+                        }
+                        if (f->node != NULL) {
+                                frames[want + n++] = rb_frame_child(f, 0);
+                                frames[want + n++] = rb_frame_child(f, 1);
+                        }
+                }
+                memmove(frames, frames + want, n * sizeof(*frames));
+                top.n = n;
+        }
+
+        // The first checker runs on this thread, the others on their own
+        for (int i = 0; top.valid && i < threads; ++i) {
+                checkers[i] = top;
+                checkers[i].first = i;
+                checkers[i].stride = threads;
+                checkers[i].stats = empty;
+                checkers[i].forked = i > 0 && pthread_create(
+                                &checkers[i].thread, NULL, rb_check_run,
+                                &checkers[i]) == 0;
+        }
+        for (int i = 0; top.valid && i < threads; ++i) {
+                if (checkers[i].forked)
+                        pthread_join(checkers[i].thread, NULL);
+                else
+                        rb_check_run(&checkers[i]);
+        }
+        for (int i = 0; top.valid && i < threads; ++i)
+                rb_check_merge(&top, &checkers[i]);
+
+        if (stats != NULL) {
+                *stats = top.stats;
+                if (stats->black_height < 0)
+                        stats->black_height = 0;
+                if (stats->min_depth > stats->max_depth)
+                        stats->min_depth = stats->max_depth;
+        }
+        free(frames);
+        free(checkers);
+        return top.valid;
 }
 
 int rb_assert(RBTREE * tree)
 {
-        return _rb_assert( ((struct rb_tree *)tree)->root);
+        return rb_check(tree, 1, NULL) == 1;
+}
+// Whether trees other than the caller's are using 'pool'
+static inline int rb_pool_shared(struct rb_pool * pool)
+{
+        return __atomic_load_n(&pool->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+// Locks 'pool' if other threads may be using it; returns whether it did
+int rb_pool_lock(struct rb_pool * pool)
+{
+        if (!rb_pool_shared(pool) && !pool->threads)
+                return 0;
+        pthread_mutex_lock(&pool->lock);
+        return 1;
+}
+
+// Counts one more tree using 'pool', which then locks
+void rb_pool_share(struct rb_pool * pool)
+{
+        int locked = rb_pool_lock(pool);
+        __atomic_add_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL);
+        if (locked)
+                pthread_mutex_unlock(&pool->lock);
+}
+
+// Adds an empty chunk of 'cap' nodes to the pool (locked as needed)
+struct rb_chunk * rb_pool_chunk(struct rb_pool * pool, int cap)
+{
+        struct rb_chunk * chunk = (struct rb_chunk *)malloc(sizeof *chunk +
+                        cap * sizeof(struct rb_node));
+        if (chunk == NULL)
+                return NULL;
+        chunk->next = pool->chunks;
+        chunk->n = 0;
+        chunk->cap = cap;
+        pool->chunks = chunk;
+        return chunk;
+}
+
+// Takes a zeroed node from the pool, adding a chunk if it is used up
+struct rb_node * rb_pool_node(struct rb_pool * pool)
+{
+        int locked = rb_pool_lock(pool);
+        struct rb_node * rv = pool->free;
+        if (rv != NULL) {
+                pool->free = rv->link[0];
+        }
+        else {
+                struct rb_chunk * chunk = pool->chunks;
+                if (chunk == NULL || chunk->n == chunk->cap) {
+                        int cap = chunk == NULL ? RB_CHUNK_MIN : 2 * chunk->cap;
+                        chunk = rb_pool_chunk(pool, cap > RB_CHUNK_MAX ?
+                                        RB_CHUNK_MAX : cap);
+                }
+                if (chunk != NULL)
+                        rv = &chunk->nodes[chunk->n++];
+        }
+        if (locked)
+                pthread_mutex_unlock(&pool->lock);
+
+        if (rv != NULL)
+                memset(rv, 0, sizeof *rv);
+        return rv;
+}
+
+// Gives back a node that has left the tree
+void rb_release_node(struct rb_tree * tree, struct rb_node * node)
+{
+        struct rb_pool * pool = tree->pool;
+        if (pool == NULL) {
+                free(node);
+                return;
+        }
+        int locked = rb_pool_lock(pool);
+        node->color = 0;
+        node->link[0] = pool->free;
+        pool->free = node;
+        if (locked)
+                pthread_mutex_unlock(&pool->lock);
+}
+
+// A zeroed node, from the pool if the tree has one
+struct rb_node * rb_alloc_node(struct rb_tree * tree)
+{
+        return tree->pool != NULL ? rb_pool_node(tree->pool) :
+                (struct rb_node *)calloc(1, sizeof(struct rb_node));
 }
 
 struct rb_node * rb_make_node(struct rb_tree * tree, void * key, void * data)
 {
-        (void)data; //TODO
-        struct rb_node * rv = (struct rb_node *)calloc(1, sizeof *rv);
+        struct rb_node * rv = rb_alloc_node(tree);
         if (rv == NULL)
                 return NULL;
 
         rv->color = RBT_RED;
+        rv->size = 1;
+        rv->refs = 1;
         tree->info.keycopy(&(rv->key), &key);
+        rv->data = data;
         return rv;
 }
 
-struct rb_node * rb_insert_node(struct rb_tree * tree, struct rb_node * root,
-                void * key, void * data)
+/*
+ * Walks the search path for 'key' (stopping at the node holding it), adding
+ * 'delta' to each size.  rb_insert and rb_remove count the key in or out on
+ * the way down, and use this to take it back when they change nothing.
+ */
+void rb_adjust_sizes(struct rb_tree * tree, void * key, int delta)
+{
+        for (struct rb_node * it = tree->root; it != NULL; ) {
+                it->size += delta;
+                int comp = tree->info.keycomp(it->key, key);
+                if (comp == 0)
+                        break;
+                it = it->link[comp < 0];
+        }
+}
+
+// Drops the value held by 'node' (if the tree owns values)
+void rb_free_data(struct rb_tree * tree, struct rb_node * node)
+{
+        if (tree->info.datafree != NULL)
+                tree->info.datafree(node->data);
+}
+
+/*
+ * Copying writes, for concurrent trees (rb_init_concurrent) and for trees
+ * that share nodes with a snapshot.  A write never changes a node that is
+ * already in the tree: it copies the nodes it would change (the search
+ * path, plus siblings that are recolored or rotated), links the copies to
+ * the untouched subtrees and then swaps in the new root.
+ *
+ * In a concurrent tree, writers take 'writer' and publish the root with one
+ * release store.  Readers load the root once and walk whichever version it
+ * was, without locking or retrying.  Replaced nodes are retired to limbo
+ * and freed by epoch-based reclamation, as in the concurrent HAMT, once no
+ * reader can still be inside the version they belonged to.  Copies share
+ * the key and value of the node they replace.
+ *
+ * In a shared tree the nodes are reference counted instead (a node's refs
+ * counts its parents and the trees rooted at it), and every copy owns a copy
+ * of its key and value, so each version frees its own.  Publishing links the
+ * copies' untouched children one more time and releases the old root, which
+ * frees whatever no other version still uses.
+ */
+
+// Tags on retired nodes: also free the key or the value (or both)
+#define RB_RETIRE_KEY  ((uintptr_t)1)
+#define RB_RETIRE_DATA ((uintptr_t)2)
+#define RB_RETIRE_TAGS (RB_RETIRE_KEY | RB_RETIRE_DATA)
+
+// Retired nodes are reclaimed this many retires apart, at most
+#define RB_ADVANCE_PERIOD 64
+
+// Nodes one write may copy: the path and a sibling or two per level
+#define RB_COW_MAX (4 * RB_MAX_DEPTH)
+
+struct rb_limbo {
+        uintptr_t * items;              // Tagged nodes
+        size_t n, cap;
+        uint64_t epoch;
+};
+
+/*
+ * Per-thread reader record.  'local' is (epoch << 1) | 1 while the thread
+ * is reading and 0 otherwise; each record has a cache line to itself so
+ * that readers never write to a line another thread reads often.
+ */
+struct rb_reader {
+        uint64_t local;
+        int nest;                       // rb_read_lock depth
+        int in_use;
+        struct rb_reader * next;
+} __attribute__((aligned(64)));
+
+/*
+ * Only writers retire and reclaim, under 'writer', so the limbo lists are
+ * the tree's: nodes retired during epoch e sit in limbo[e % 3] until the
+ * global epoch reaches e + 2.
+ */
+struct rb_epoch {
+        uint64_t global;
+        struct rb_reader * readers;
+        pthread_key_t key;
+        pthread_mutex_t writer;
+        unsigned int retires;
+        struct rb_limbo limbo[3];
+};
+
+/*
+ * The nodes copied and replaced by one write.  Copies have refs 0 until the
+ * write is published.  The node whose key or value changes ('target') gets
+ * its new entry only then, so that a failed write can free the copies as
+ * they were made.
+ */
+struct rb_cow {
+        struct rb_tree * tree;
+        int shared;                     // Reference counted (not concurrent)
+        struct rb_node * made;          // Node added by an insert, if any
+        struct rb_node * target;        // Takes the entry of 'from', or if
+        struct rb_node * from;          // that is NULL, the value 'data'
+        void * data;
+        int failed;                     // An allocation failed
+        int ncopies, nstale;
+        struct rb_node * copies[RB_COW_MAX];
+        uintptr_t stale[RB_COW_MAX];    // Tagged, retired once published
+};
+
+// The current root, as readers of a concurrent tree must load it
+struct rb_node * rb_root(struct rb_tree * tree)
+{
+        return __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+}
+
+void rb_release_reader(void * p)
+{
+        struct rb_reader * rec = (struct rb_reader *)p;
+        __atomic_store_n(&rec->local, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+// Returns the calling thread's reader record, claiming one on first use
+struct rb_reader * rb_reader(struct rb_tree * tree)
+{
+        struct rb_epoch * ep = tree->epoch;
+        struct rb_reader * rec = pthread_getspecific(ep->key);
+        if (rec != NULL)
+                return rec;
+
+        // Reuse the record of an exited thread
+        for (rec = __atomic_load_n(&ep->readers, __ATOMIC_ACQUIRE); rec;
+                        rec = rec->next) {
+                int free_rec = 0;
+                if (__atomic_compare_exchange_n(&rec->in_use, &free_rec, 1,
+                                0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                        break;
+        }
+
+        if (rec == NULL) {
+                rec = (struct rb_reader *)aligned_alloc(
+                                __alignof__(struct rb_reader), sizeof *rec);
+                if (rec == NULL) {
+                        errno = ENOMEM;
+                        return NULL;
+                }
+                memset(rec, 0, sizeof *rec);
+                rec->in_use = 1;
+                rec->next = __atomic_load_n(&ep->readers, __ATOMIC_RELAXED);
+                while (!__atomic_compare_exchange_n(&ep->readers, &rec->next,
+                                rec, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                        ;
+        }
+
+        rec->nest = 0;
+        if (pthread_setspecific(ep->key, rec) != 0) {
+                rb_release_reader(rec);
+                return NULL;
+        }
+        return rec;
+}
+
+/*
+ * Announces that the calling thread may read nodes of 'tree' until the
+ * matching rb_exit.  Returns NULL on error.
+ */
+struct rb_reader * rb_enter(struct rb_tree * tree)
+{
+        struct rb_reader * rec = rb_reader(tree);
+        if (rec == NULL || rec->nest++ > 0)
+                return rec;
+
+        uint64_t e = __atomic_load_n(&tree->epoch->global, __ATOMIC_ACQUIRE);
+        for (;;) {
+                __atomic_store_n(&rec->local, (e << 1) | 1, __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                uint64_t now = __atomic_load_n(&tree->epoch->global,
+                                __ATOMIC_ACQUIRE);
+                if (now == e)
+                        return rec;
+                e = now;
+        }
+}
+
+void rb_exit(struct rb_reader * rec)
+{
+        if (rec != NULL && rec->nest > 0 && --rec->nest == 0)
+                __atomic_store_n(&rec->local, 0, __ATOMIC_RELEASE);
+}
+
+// rb_enter for any tree: sets *rec (NULL unless concurrent); 0 or -1
+int rb_read_begin(struct rb_tree * tree, struct rb_reader ** rec)
+{
+        *rec = NULL;
+        if (tree->epoch == NULL)
+                return 0;
+        *rec = rb_enter(tree);
+        return *rec != NULL ? 0 : -1;
+}
+
+// Frees everything in 'l' (no reader can still see it)
+void rb_reclaim(struct rb_tree * tree, struct rb_limbo * l)
+{
+        for (size_t i = 0; i < l->n; ++i) {
+                struct rb_node * node =
+                        (struct rb_node *)(l->items[i] & ~RB_RETIRE_TAGS);
+                if (l->items[i] & RB_RETIRE_KEY)
+                        tree->info.keyfree(node->key);
+                if (l->items[i] & RB_RETIRE_DATA)
+                        rb_free_data(tree, node);
+                rb_release_node(tree, node);
+        }
+        l->n = 0;
+}
+
+// Moves the global epoch on if every reader has caught up to it
+void rb_try_advance(struct rb_tree * tree)
+{
+        struct rb_epoch * ep = tree->epoch;
+        uint64_t e = ep->global;
+        for (struct rb_reader * rec =
+                        __atomic_load_n(&ep->readers, __ATOMIC_ACQUIRE);
+                        rec; rec = rec->next) {
+                uint64_t local = __atomic_load_n(&rec->local,
+                                __ATOMIC_ACQUIRE);
+                if ((local & 1) && (local >> 1) != e)
+                        return;
+        }
+
+        __atomic_store_n(&ep->global, ++e, __ATOMIC_RELEASE);
+        for (int i = 0; i < 3; ++i)
+                if (ep->limbo[i].n && ep->limbo[i].epoch + 2 <= e)
+                        rb_reclaim(tree, &ep->limbo[i]);
+}
+
+// Hands an unlinked node over to be freed once no reader can see it
+void rb_retire(struct rb_tree * tree, uintptr_t item)
+{
+        struct rb_epoch * ep = tree->epoch;
+        uint64_t e = ep->global;
+        struct rb_limbo * l = &ep->limbo[e % 3];
+        if (l->epoch != e) {
+                // Left over from epoch e - 3 or earlier: safe now
+                rb_reclaim(tree, l);
+                l->epoch = e;
+        }
+
+        if (l->n == l->cap) {
+                size_t cap = l->cap ? 2 * l->cap : 256;
+                uintptr_t * items = realloc(l->items, cap * sizeof(*items));
+                if (items == NULL)
+                        return; // Leak rather than free too early
+                l->items = items;
+                l->cap = cap;
+        }
+        l->items[l->n++] = item;
+
+        if (++ep->retires % RB_ADVANCE_PERIOD == 0)
+                rb_try_advance(tree);
+}
+
+void rb_cow_init(struct rb_cow * cow, struct rb_tree * tree)
+{
+        cow->tree = tree;
+        cow->shared = tree->epoch == NULL;
+        cow->made = cow->target = cow->from = NULL;
+        cow->data = NULL;
+        cow->failed = cow->ncopies = cow->nstale = 0;
+}
+
+/*
+ * Schedules 'node' to be retired (with 'tag') once the write is published.
+ * A shared tree drops nothing itself: releasing the old root does.
+ */
+void rb_cow_drop(struct rb_cow * cow, struct rb_node * node, uintptr_t tag)
+{
+        if (!cow->shared)
+                cow->stale[cow->nstale++] = (uintptr_t)node | tag;
+}
+
+// Makes 'dest' hold its own copy of the value of 'src' (if values are owned)
+void rb_copy_data(struct rb_tree * tree, struct rb_node * dest,
+                struct rb_node * src)
+{
+        if (tree->info.datacopy != NULL)
+                tree->info.datacopy(&dest->data, &src->data);
+        else
+                dest->data = src->data;
+}
+
+// A copy of 'node' that the write may change; 'node' itself is dropped
+struct rb_node * rb_cow_copy(struct rb_cow * cow, struct rb_node * node,
+                uintptr_t tag)
+{
+        struct rb_node * rv = cow->failed ? NULL : rb_alloc_node(cow->tree);
+        if (rv == NULL) {
+                cow->failed = 1;
+                return NULL;
+        }
+        memcpy(rv, node, sizeof *rv);
+        rv->refs = 0;
+        if (cow->shared) {
+                cow->tree->info.keycopy(&rv->key, &node->key);
+                rb_copy_data(cow->tree, rv, node);
+        }
+        cow->copies[cow->ncopies++] = rv;
+        rb_cow_drop(cow, node, tag);
+        return rv;
+}
+
+// As rb_insert_node, but on copies, and recoloring only to fix a red child
+struct rb_node * rb_cow_insert(struct rb_cow * cow, struct rb_node * root,
+                void * key, void * data, int * rv)
 {
         if (root == NULL) {
-                root = rb_make_node(tree, key, data);
+                cow->made = rb_make_node(cow->tree, key, data);
+                if (cow->made != NULL)
+                        cow->made->refs = 0;
+                cow->failed |= cow->made == NULL;
+                *rv = 1;
+                return cow->made;
+        }
+
+        int comp = cow->tree->info.keycomp(root->key, key);
+        if (comp == 0) {
+                // Already present: the copy takes the new value
+                int replace = root->data != data;
+                root = rb_cow_copy(cow, root, replace ? RB_RETIRE_DATA : 0);
+                if (replace) {
+                        cow->target = root;
+                        cow->data = data;
+                }
+                *rv = 0;
+                return root;
+        }
+
+        int dir = comp < 0;
+        struct rb_node * child = rb_cow_insert(cow, root->link[dir], key,
+                        data, rv);
+        root = rb_cow_copy(cow, root, 0);
+        if (cow->failed)
+                return NULL;
+        root->link[dir] = child;
+        root->size += *rv;
+
+        // Only the copied child can be red with a red child
+        if (is_red(child) && (is_red(child->link[0]) ||
+                                is_red(child->link[1]))) {
+                if (is_red(root->link[dir ^ 1])) {
+                        // Case 1
+                        struct rb_node * uncle = rb_cow_copy(cow,
+                                        root->link[dir ^ 1], 0);
+                        if (uncle == NULL)
+                                return NULL;
+                        root->link[dir ^ 1] = uncle;
+                        root->color = RBT_RED;
+                        child->color = RBT_BLACK;
+                        uncle->color = RBT_BLACK;
+                }
+                else if (is_red(child->link[dir])) {
+                        // Case 3
+                        root = rotation(root, dir ^ 1);
+                }
+                else {
+                        // Case 2
+                        root = double_rotation(root, dir ^ 1);
+                }
+        }
+        return root;
+}
+
+/*
+ * Restores the black height of the copy 'p' after its 'dir' subtree lost a
+ * black node.  Clears *shorter unless all of 'p' had to lose one too.
+ */
+struct rb_node * rb_cow_fix(struct rb_cow * cow, struct rb_node * p, int dir,
+                int * shorter)
+{
+        struct rb_node * s = rb_cow_copy(cow, p->link[dir ^ 1], 0);
+        if (s == NULL)
+                return NULL;
+        p->link[dir ^ 1] = s;
+
+        if (is_red(s)) {
+                // Rotate the red sibling up: p turns red, and its new
+                // sibling is black, so fixing p ends there
+                struct rb_node * top = rotation(p, dir);
+                top->link[dir] = rb_cow_fix(cow, p, dir, shorter);
+                return cow->failed ? NULL : top;
+        }
+
+        struct rb_node * outer = s->link[dir ^ 1], * inner = s->link[dir];
+        if (!is_red(outer) && !is_red(inner)) {
+                // Color flip, which p passes up unless it was red
+                s->color = RBT_RED;
+                *shorter = !is_red(p);
+                p->color = RBT_BLACK;
+                return p;
+        }
+
+        int color = p->color;
+        struct rb_node * top;
+        if (is_red(outer)) {
+                s->link[dir ^ 1] = rb_cow_copy(cow, outer, 0);
+                if (cow->failed)
+                        return NULL;
+                top = rotation(p, dir);
         }
         else {
-                int dir;
-                //dir = root->key < key ? 1 : 0;
-                dir = tree->info.keycomp(root->key, key) < 0 ? 1 : 0;
+                s->link[dir] = rb_cow_copy(cow, inner, 0);
+                if (cow->failed)
+                        return NULL;
+                top = double_rotation(p, dir);
+        }
+        top->color = color;
+        top->link[0]->color = RBT_BLACK;
+        top->link[1]->color = RBT_BLACK;
+        *shorter = 0;
+        return top;
+}
 
-                root->link[dir] = rb_insert_node(tree, root->link[dir], key, data);
+// Drops 'node', which has at most one child, and returns what replaces it
+struct rb_node * rb_cow_unlink(struct rb_cow * cow, struct rb_node * node,
+                uintptr_t tag, int * shorter)
+{
+        struct rb_node * child = node->link[node->link[0] == NULL];
+        rb_cow_drop(cow, node, tag);
+        *shorter = 0;
+        if (is_red(node))
+                return child;   // A red leaf
+        if (child == NULL) {
+                *shorter = 1;
+                return NULL;
+        }
+        // A black node's only child is a red leaf, which takes its place
+        child = rb_cow_copy(cow, child, 0);
+        if (child != NULL)
+                child->color = RBT_BLACK;
+        return child;
+}
 
-                if (is_red(root->link[dir])) {
-                        if (is_red(root->link[dir ^ 1])) {
-                                // Case 1
-                                root->color = RBT_RED;
-                                root->link[0]->color = RBT_BLACK;
-                                root->link[1]->color = RBT_BLACK;
-                        }
-                        else if (is_red(root->link[dir]->link[dir])) {
-                                // Case 3
-                                root = rotation(root, dir ^ 1);
+// Removes the smallest node below a copy of 'root' into *min
+struct rb_node * rb_cow_remove_min(struct rb_cow * cow, struct rb_node * root,
+                struct rb_node ** min, int * shorter)
+{
+        if (root->link[0] == NULL) {
+                *min = root;
+                return rb_cow_unlink(cow, root, 0, shorter);
+        }
+
+        struct rb_node * left = rb_cow_remove_min(cow, root->link[0], min,
+                        shorter);
+        root = rb_cow_copy(cow, root, 0);
+        if (cow->failed)
+                return NULL;
+        root->link[0] = left;
+        root->size -= 1;
+        return *shorter ? rb_cow_fix(cow, root, 0, shorter) : root;
+}
+
+/*
+ * Removes 'key', which must be present, below a copy of 'root'.  Sets
+ * *shorter if the black height of the subtree fell by one.
+ */
+struct rb_node * rb_cow_remove(struct rb_cow * cow, struct rb_node * root,
+                void * key, int * shorter)
+{
+        int comp = cow->tree->info.keycomp(root->key, key);
+        if (comp == 0 && root->link[0] != NULL && root->link[1] != NULL) {
+                // The copy takes over the key and value of the successor
+                struct rb_node * min = NULL;
+                struct rb_node * right = rb_cow_remove_min(cow,
+                                root->link[1], &min, shorter);
+                root = rb_cow_copy(cow, root, RB_RETIRE_TAGS);
+                if (cow->failed)
+                        return NULL;
+                cow->target = root;
+                cow->from = min;
+                root->link[1] = right;
+                root->size -= 1;
+                return *shorter ? rb_cow_fix(cow, root, 1, shorter) : root;
+        }
+        if (comp == 0)
+                return rb_cow_unlink(cow, root, RB_RETIRE_TAGS, shorter);
+
+        int dir = comp < 0;
+        struct rb_node * child = rb_cow_remove(cow, root->link[dir], key,
+                        shorter);
+        root = rb_cow_copy(cow, root, 0);
+        if (cow->failed)
+                return NULL;
+        root->link[dir] = child;
+        root->size -= 1;
+        return *shorter ? rb_cow_fix(cow, root, dir, shorter) : root;
+}
+
+// Drops a reference to 'root', freeing its subtree with the last one
+void rb_node_release(struct rb_tree * tree, struct rb_node * root)
+{
+        while (root != NULL) {
+                // A node only this tree holds can't be taken meanwhile
+                if (__atomic_load_n(&root->refs, __ATOMIC_ACQUIRE) != 1 &&
+                                __atomic_sub_fetch(&root->refs, 1,
+                                        __ATOMIC_ACQ_REL) != 0)
+                        return;
+                struct rb_node * right = root->link[1];
+                rb_node_release(tree, root->link[0]);
+                tree->info.keyfree(root->key);
+                rb_free_data(tree, root);
+                rb_release_node(tree, root);
+                root = right;
+        }
+}
+
+// Gives cow->target its new entry (see struct rb_cow)
+void rb_cow_entry(struct rb_cow * cow)
+{
+        struct rb_tree * tree = cow->tree;
+        struct rb_node * target = cow->target, * from = cow->from;
+        if (target == NULL)
+                return;
+
+        if (from == NULL) {
+                if (cow->shared)
+                        rb_free_data(tree, target);
+                target->data = cow->data;
+        }
+        else if (cow->shared) {
+                tree->info.keyfree(target->key);
+                rb_free_data(tree, target);
+                tree->info.keycopy(&target->key, &from->key);
+                rb_copy_data(tree, target, from);
+        }
+        else {
+                target->key = from->key;
+                target->data = from->data;
+        }
+}
+
+/*
+ * Publishes 'root' as the new version and retires or releases the nodes it
+ * replaced, or, if the write failed, frees its copies.  Returns 0 or -1
+ * (sets errno).
+ */
+int rb_cow_finish(struct rb_cow * cow, struct rb_node * root)
+{
+        struct rb_tree * tree = cow->tree;
+        if (cow->failed) {
+                for (int i = 0; i < cow->ncopies; ++i) {
+                        if (cow->shared) {
+                                tree->info.keyfree(cow->copies[i]->key);
+                                rb_free_data(tree, cow->copies[i]);
                         }
-                        else if (is_red(root->link[dir]->link[dir ^ 1])) {
-                                // Case 2
-                                root = double_rotation(root, dir ^ 1);
+                        rb_release_node(tree, cow->copies[i]);
+                }
+                if (cow->made != NULL) {
+                        tree->info.keyfree(cow->made->key);
+                        rb_release_node(tree, cow->made);
+                }
+                errno = ENOMEM;
+                return -1;
+        }
+
+        rb_cow_entry(cow);
+        if (cow->made != NULL)
+                cow->copies[cow->ncopies++] = cow->made;
+        if (cow->shared) {
+                // Children that weren't copied gain a parent
+                for (int i = 0; i < cow->ncopies; ++i) {
+                        for (int dir = 0; dir < 2; ++dir) {
+                                struct rb_node * child =
+                                        cow->copies[i]->link[dir];
+                                if (child != NULL && __atomic_load_n(
+                                                &child->refs,
+                                                __ATOMIC_ACQUIRE) != 0)
+                                        __atomic_add_fetch(&child->refs, 1,
+                                                        __ATOMIC_RELAXED);
                         }
                 }
         }
-        return root;
+        for (int i = 0; i < cow->ncopies; ++i)
+                cow->copies[i]->refs = 1;
+
+        if (root != NULL)
+                root->color = RBT_BLACK;
+        struct rb_node * old = tree->root;
+        __atomic_store_n(&tree->root, root, __ATOMIC_RELEASE);
+        if (cow->shared)
+                rb_node_release(tree, old);
+        for (int i = 0; i < cow->nstale; ++i)
+                rb_retire(tree, cow->stale[i]);
+        return 0;
+}
+
+// rb_insert for a concurrent or shared tree
+int rb_insert_copying(struct rb_tree * tree, void * key, void * data)
+{
+        struct rb_cow cow;
+        rb_cow_init(&cow, tree);
+
+        int rv = 0;
+        if (tree->epoch != NULL)
+                pthread_mutex_lock(&tree->epoch->writer);
+        struct rb_node * root = rb_cow_insert(&cow, tree->root, key, data,
+                        &rv);
+        if (rb_cow_finish(&cow, root) != 0)
+                rv = -1;
+        if (tree->epoch != NULL)
+                pthread_mutex_unlock(&tree->epoch->writer);
+        return rv;
+}
+
+// rb_remove for a concurrent or shared tree
+int rb_remove_copying(struct rb_tree * tree, void * key)
+{
+        struct rb_cow cow;
+        rb_cow_init(&cow, tree);
+
+        int rv = 0;
+        if (tree->epoch != NULL)
+                pthread_mutex_lock(&tree->epoch->writer);
+        // Look first: copying the path for a missing key would be waste
+        struct rb_node * it = tree->root;
+        while (it != NULL) {
+                int comp = tree->info.keycomp(key, it->key);
+                if (comp == 0)
+                        break;
+                it = it->link[comp > 0];
+        }
+        if (it != NULL) {
+                int shorter;
+                struct rb_node * root = rb_cow_remove(&cow, tree->root, key,
+                                &shorter);
+                rv = rb_cow_finish(&cow, root) == 0 ? 1 : -1;
+        }
+        if (tree->epoch != NULL)
+                pthread_mutex_unlock(&tree->epoch->writer);
+        return rv;
+}
+
+RBTREE * rb_snapshot(RBTREE * t)
+{
+        struct rb_tree * tree = (struct rb_tree *)t;
+        if (tree->valid != _RB_TREE_VALID || tree->epoch != NULL ||
+                        (tree->info.datafree != NULL &&
+                         tree->info.datacopy == NULL)) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        struct rb_tree * rv = (struct rb_tree *)malloc(sizeof *rv);
+        if (rv == NULL)
+                return NULL;
+        if (tree->versions == NULL) {
+                tree->versions = (uint32_t *)malloc(sizeof *tree->versions);
+                if (tree->versions == NULL) {
+                        free(rv);
+                        return NULL;
+                }
+                *tree->versions = 1;
+        }
+        memcpy(rv, tree, sizeof *rv);
+        if (tree->root != NULL)
+                __atomic_add_fetch(&tree->root->refs, 1, __ATOMIC_RELAXED);
+        if (tree->pool != NULL)
+                rb_pool_share(tree->pool);
+        __atomic_add_fetch(tree->versions, 1, __ATOMIC_ACQ_REL);
+        return (RBTREE *)rv;
+}
+
+RBTREE * rb_pinsert(RBTREE * tree, void * key, void * data)
+{
+        RBTREE * rv = rb_snapshot(tree);
+        if (rv == NULL)
+                return NULL;
+
+        if (rb_insert(rv, key, data) < 0) {
+                rb_free(rv);
+                return NULL;
+        }
+        return rv;
+}
+
+RBTREE * rb_premove(RBTREE * tree, void * key)
+{
+        RBTREE * rv = rb_snapshot(tree);
+        if (rv == NULL)
+                return NULL;
+
+        if (rb_remove(rv, key) < 0) {
+                rb_free(rv);
+                return NULL;
+        }
+        return rv;
+}
+
+// Releases the reader records and everything retired
+void rb_free_epoch(struct rb_tree * tree)
+{
+        struct rb_epoch * ep = tree->epoch;
+        for (int i = 0; i < 3; ++i) {
+                rb_reclaim(tree, &ep->limbo[i]);
+                free(ep->limbo[i].items);
+        }
+        struct rb_reader * rec = ep->readers, * next;
+        while (rec != NULL) {
+                next = rec->next;
+                free(rec);
+                rec = next;
+        }
+        pthread_key_delete(ep->key);
+        pthread_mutex_destroy(&ep->writer);
+        free(ep);
+        tree->epoch = NULL;
+}
+
+RBTREE * rb_init_concurrent(struct rbtreeinfo * info)
+{
+        struct rb_tree * tree = (struct rb_tree *)rb_init(info);
+        if (tree == NULL)
+                return NULL;
+
+        struct rb_epoch * ep = (struct rb_epoch *)calloc(1, sizeof *ep);
+        if (ep == NULL || pthread_key_create(&ep->key,
+                                rb_release_reader) != 0) {
+                free(ep);
+                rb_free((RBTREE *)tree);
+                errno = ENOMEM;
+                return NULL;
+        }
+        pthread_mutex_init(&ep->writer, NULL);
+        tree->epoch = ep;
+        return (RBTREE *)tree;
+}
+
+int rb_read_lock(RBTREE * t)
+{
+        struct rb_tree * tree = (struct rb_tree *)t;
+        if (tree->valid != _RB_TREE_VALID) {
+                errno = EINVAL;
+                return -1;
+        }
+        struct rb_reader * rec;
+        return rb_read_begin(tree, &rec);
+}
+
+int rb_read_unlock(RBTREE * t)
+{
+        struct rb_tree * tree = (struct rb_tree *)t;
+        if (tree->valid != _RB_TREE_VALID) {
+                errno = EINVAL;
+                return -1;
+        }
+        if (tree->epoch != NULL)
+                rb_exit(pthread_getspecific(tree->epoch->key));
+        return 0;
+}
+
+struct rb_node * rb_insert_node(struct rb_tree * tree, struct rb_node * root,
+                void * key, void * data)
+{
+        if (root == NULL) {
+                root = rb_make_node(tree, key, data);
+        }
+        else {
+                int dir;
+                //dir = root->key < key ? 1 : 0;
+                dir = tree->info.keycomp(root->key, key) < 0 ? 1 : 0;
+
+                root->link[dir] = rb_insert_node(tree, root->link[dir], key, data);
+
+                if (is_red(root->link[dir])) {
+                        if (is_red(root->link[dir ^ 1])) {
+                                // Case 1
+                                root->color = RBT_RED;
+                                root->link[0]->color = RBT_BLACK;
+                                root->link[1]->color = RBT_BLACK;
+                        }
+                        else if (is_red(root->link[dir]->link[dir])) {
+                                // Case 3
+                                root = rotation(root, dir ^ 1);
+                        }
+                        else if (is_red(root->link[dir]->link[dir ^ 1])) {
+                                // Case 2
+                                root = double_rotation(root, dir ^ 1);
+                        }
+                }
+        }
+        return root;
+}
+
+int rb_insert(RBTREE * t, void * key, void * data)
+{
+        struct rb_tree * tree = (struct rb_tree *)t;
+        if (tree->valid != _RB_TREE_VALID) return -1;
+        if (tree->epoch != NULL || rb_shared(tree))
+                return rb_insert_copying(tree, key, data);
+
+        int rv = 1;     // Until the key turns out to be there already
+        if (tree->root == NULL) {
+                tree->root = rb_make_node(tree, key, data);
+                if (tree->root == NULL)
+                        return -1;
+        }
+        else {
+                struct rb_node head = { 0 }; // False root}
+                struct rb_node *g, *t; // Grandparent & parent
+                struct rb_node *p, *q; // Iterator & parent
+                int dir = 0, last = 0;
+                rv = 0;
+
+                /* Set Up Helpers */
+                t = &head;
+                g = p = NULL;
+                q = t->link[1] = tree->root;
+
+                /*
+                 * Every node from the root down to q already counts the new
+                 * key; rotations recount only nodes that leave the path
+                 */
+                q->size++;
+
+                /* Search down the tree */
+                for (;;) {
+                        if (q == NULL) {
+                                /* Insert new node at the bottom */
+                                p->link[dir] = q = rb_make_node(tree, key, data);
+                                if (q == NULL)
+                                        return -1;
+                                rv = 1;
+                        }
+                        else if (is_red(q->link[0]) && is_red(q->link[1])) {
+                                // Color Flip
+                                q->color = RBT_RED;
+                                q->link[0]->color = RBT_BLACK;
+                                q->link[1]->color = RBT_BLACK;
+                        }
+
+                        /* Fix Red Violation */
+                        if (is_red(q) && is_red(p)) {
+                                int dir2 = t->link[1] == g ? 1 : 0;
+                                if (q == p->link[last]) {
+                                        t->link[dir2] = rotation(g, last ^ 1);
+                                }
+                                else {
+                                        t->link[dir2] = double_rotation(g, last ^ 1);
+                                }
+                        }
+
+                        /* Stop if found */
+                        int comp = tree->info.keycomp(q->key, key);
+                        if (comp == 0) {
+                                // Already present: update the value
+                                if (rv == 0 && q->data != data) {
+                                        rb_free_data(tree, q);
+                                        q->data = data;
+                                }
+                                break;
+                        }
+                        last = dir;
+                        dir = comp < 0 ? 1 : 0;
+
+                        /* Update helpers */
+                        if (g != NULL) {
+                                t = g;
+                        }
+                        g = p, p = q;
+                        q = q->link[dir];
+                        if (q != NULL)
+                                q->size++;
+                }
+                /* update root */
+                tree->root = head.link[1];
+                if (rv == 0)
+                        rb_adjust_sizes(tree, key, -1);
+        }
+        tree->root->color = RBT_BLACK;
+        return rv;
+}
+
+/*
+ * Links the 'n' nodes of 'nodes', in key order, into a balanced subtree at
+ * 'depth': each root is the middle node, so every path down to NULL is
+ * floor(log2(N + 1)) or one more nodes long for the whole tree of N.  Only
+ * nodes on the deeper level ('red', the leaves of the ragged bottom row) are
+ * red, which leaves every black height equal.
+ */
+struct rb_node * rb_link_sorted(struct rb_node ** nodes, int n, int depth,
+                int red)
+{
+        if (n == 0)
+                return NULL;
+
+        int mid = n / 2;
+        struct rb_node * root = nodes[mid];
+        root->link[0] = rb_link_sorted(nodes, mid, depth + 1, red);
+        root->link[1] = rb_link_sorted(nodes + mid + 1, n - mid - 1,
+                        depth + 1, red);
+        root->size = n;
+        root->color = depth == red ? RBT_RED : RBT_BLACK;
+        return root;
+}
+
+// Makes 'nodes' the whole tree
+void rb_relink(struct rb_tree * tree, struct rb_node ** nodes, int n)
+{
+        int red = 0;
+        while ((2L << red) <= n + 1L)
+                red++;
+        tree->root = rb_link_sorted(nodes, n, 0, red);
+}
+
+// Checks that keys[0 .. n) strictly increase
+int rb_sorted(struct rb_tree * tree, void ** keys, int n)
+{
+        for (int i = 1; i < n; ++i)
+                if (tree->info.keycomp(keys[i - 1], keys[i]) >= 0)
+                        return 0;
+        return 1;
+}
+
+RBTREE * rb_build_sorted(struct rbtreeinfo * info, void ** keys,
+                void ** values, int n)
+{
+        struct rbtreeinfo pooled = *info;
+        pooled.pool = 1;
+        struct rb_tree * tree = (struct rb_tree *)rb_init(&pooled);
+        if (tree == NULL)
+                return NULL;
+        if (n < 0 || !rb_sorted(tree, keys, n)) {
+                rb_free((RBTREE *)tree);
+                errno = EINVAL;
+                return NULL;
+        }
+        if (n == 0)
+                return (RBTREE *)tree;
+
+        // One chunk holds the nodes, in key order
+        struct rb_node ** nodes = malloc(n * sizeof(*nodes));
+        struct rb_chunk * chunk = rb_pool_chunk(tree->pool, n);
+        if (nodes == NULL || chunk == NULL) {
+                free(nodes);
+                rb_free((RBTREE *)tree);
+                errno = ENOMEM;
+                return NULL;
+        }
+        for (int i = 0; i < n; ++i) {
+                struct rb_node * node = &chunk->nodes[i];
+                memset(node, 0, sizeof *node);
+                node->refs = 1;
+                tree->info.keycopy(&node->key, &keys[i]);
+                node->data = values != NULL ? values[i] : NULL;
+                nodes[i] = node;
+        }
+        chunk->n = n;
+
+        rb_relink(tree, nodes, n);
+        free(nodes);
+        return (RBTREE *)tree;
+}
+
+// Appends the nodes under 'root' to 'nodes' in key order
+int rb_collect(struct rb_node * root, struct rb_node ** nodes)
+{
+        int n = 0;
+        while (root != NULL) {
+                n += rb_collect(root->link[0], nodes + n);
+                nodes[n++] = root;
+                root = root->link[1];
+        }
+        return n;
+}
+
+int rb_merge_sorted(RBTREE * t, void ** keys, void ** values, int n)
+{
+        struct rb_tree * tree = (struct rb_tree *)t;
+        if (tree->valid != _RB_TREE_VALID || tree->epoch != NULL ||
+                        rb_shared(tree) || n < 0 || !rb_sorted(tree, keys, n)) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        // A batch much smaller than the tree is cheaper to insert key by key
+        int size = node_size(tree->root);
+        int lg = 1;
+        while ((1L << lg) < size)
+                lg++;
+        if ((long)n * lg < size) {
+                int rv = 0;
+                for (int i = 0; i < n; ++i) {
+                        int inserted = rb_insert(t, keys[i],
+                                        values != NULL ? values[i] : NULL);
+                        if (inserted < 0)
+                                return -1;
+                        rv += inserted;
+                }
+                return rv;
+        }
+
+        struct rb_node ** old = malloc(size * sizeof(*old));
+        struct rb_node ** nodes = malloc(((long)size + n) * sizeof(*nodes));
+        if ((size > 0 && old == NULL) || nodes == NULL) {
+                free(old);
+                free(nodes);
+                errno = ENOMEM;
+                return -1;
+        }
+        rb_collect(tree->root, old);
+
+        // Merge; if a node can't be had, keep what is merged so far
+        int i = 0, j = 0, m = 0, rv = 0;
+        while (j < n) {
+                void * data = values != NULL ? values[j] : NULL;
+                int comp = i < size ? tree->info.keycomp(old[i]->key, keys[j])
+                        : 1;
+                if (comp < 0) {
+                        nodes[m++] = old[i++];
+                }
+                else if (comp == 0) {
+                        if (old[i]->data != data) {
+                                rb_free_data(tree, old[i]);
+                                old[i]->data = data;
+                        }
+                        nodes[m++] = old[i++];
+                        j++;
+                }
+                else {
+                        struct rb_node * node = rb_make_node(tree, keys[j], data);
+                        if (node == NULL) {
+                                rv = -1;
+                                break;
+                        }
+                        nodes[m++] = node;
+                        j++;
+                        rv++;
+                }
+        }
+        while (i < size)
+                nodes[m++] = old[i++];
+
+        rb_relink(tree, nodes, m);
+        free(old);
+        free(nodes);
+        if (rv < 0)
+                errno = ENOMEM;
+        return rv;
+}
+
+int rb_size(RBTREE * t)
+{
+        if (t == NULL)
+                return 0;
+
+        struct rb_tree * tree = (struct rb_tree *)t;
+        if (tree->valid != _RB_TREE_VALID) return -1;
+        struct rb_reader * rec;
+        if (rb_read_begin(tree, &rec) != 0)
+                return -1;
+        int rv = node_size(rb_root(tree));
+        rb_exit(rec);
+        return rv;
+}
+
+int rb_rank(RBTREE * t, void * key)
+{
+        struct rb_tree * tree = (struct rb_tree *)t;
+        if (tree->valid != _RB_TREE_VALID) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        struct rb_reader * rec;
+        if (rb_read_begin(tree, &rec) != 0)
+                return -1;
+        int rank = 0;
+        struct rb_node * root = rb_root(tree);
+        while (root != NULL) {
+                int comp = tree->info.keycomp(key, root->key);
+                if (comp > 0)
+                        rank += 1 + node_size(root->link[0]);
+                else if (comp == 0) {
+                        rank += node_size(root->link[0]);
+                        break;
+                }
+                root = root->link[comp > 0];
+        }
+        rb_exit(rec);
+        return rank;
+}
+
+int rb_select(RBTREE * t, int k, void ** key, void ** data)
+{
+        struct rb_tree * tree = (struct rb_tree *)t;
+        if (tree->valid != _RB_TREE_VALID) {
+                errno = EINVAL;
+                return -1;
+        }
+        struct rb_reader * rec;
+        if (rb_read_begin(tree, &rec) != 0)
+                return -1;
+        struct rb_node * root = rb_root(tree);
+        if (k < 0 || k >= (int)node_size(root)) {
+                rb_exit(rec);
+                return 0;
+        }
+
+        for (;;) {
+                int left = node_size(root->link[0]);
+                if (k == left)
+                        break;
+                if (k < left) {
+                        root = root->link[0];
+                } else {
+                        k -= left + 1;
+                        root = root->link[1];
+                }
+        }
+        if (key != NULL)
+                *key = root->key;
+        if (data != NULL)
+                *data = root->data;
+        rb_exit(rec);
+        return 1;
+}
+
+/*
+ * The node holding 'key' below 'root', or NULL.  The child is picked by
+ * indexing link[] with the comparison rather than branching on it three
+ * ways, and both children are prefetched before the (indirect) keycomp
+ * call, so the next level is on its way while this one is compared.
+ */
+struct rb_node * rb_find_node(struct rb_tree * tree, struct rb_node * root,
+                void * key)
+{
+        while (root != NULL) {
+                __builtin_prefetch(root->link[0]);
+                __builtin_prefetch(root->link[1]);
+                int comp = tree->info.keycomp(key, root->key);
+                if (comp == 0)
+                        break;
+                root = root->link[comp > 0];
+        }
+        return root;
+}
+
+int rb_has(RBTREE * t, void * key)
+{
+        struct rb_tree * tree = (struct rb_tree *)t;
+        if (tree->valid != _RB_TREE_VALID) {
+                errno = EINVAL;
+                return -1;
+        }
+        struct rb_reader * rec;
+        if (rb_read_begin(tree, &rec) != 0)
+                return -1;
+        int rv = rb_find_node(tree, rb_root(tree), key) != NULL;
+        rb_exit(rec);
+        return rv;
+}
+
+/*
+ * Descends for up to RB_BATCH keys at once, one level of each per pass, so
+ * that while one key waits on a node the others are compared.  at[i] is
+ * where key i is, NULL once it is found or has fallen off the tree.
+ */
+int rb_has_many(RBTREE * t, void * const * keys, int n, int * found)
+{
+        struct rb_tree * tree = (struct rb_tree *)t;
+        if (tree->valid != _RB_TREE_VALID || n < 0) {
+                errno = EINVAL;
+                return -1;
+        }
+        struct rb_reader * rec;
+        if (rb_read_begin(tree, &rec) != 0)
+                return -1;
+
+        struct rb_node * root = rb_root(tree);
+        struct rb_node * at[RB_BATCH];
+        int hit[RB_BATCH];
+        int rv = 0;
+        for (int base = 0; base < n; base += RB_BATCH) {
+                int m = n - base < RB_BATCH ? n - base : RB_BATCH;
+                int live = root != NULL ? m : 0;
+                for (int i = 0; i < m; ++i) {
+                        at[i] = root;
+                        hit[i] = 0;
+                }
+                while (live > 0) {
+                        for (int i = 0; i < m; ++i) {
+                                struct rb_node * node = at[i];
+                                if (node == NULL)
+                                        continue;
+                                int comp = tree->info.keycomp(keys[base + i],
+                                                node->key);
+                                node = comp != 0 ? node->link[comp > 0] : NULL;
+                                hit[i] = comp == 0;
+                                if (node != NULL)
+                                        __builtin_prefetch(node);
+                                else
+                                        --live;
+                                at[i] = node;
+                        }
+                }
+                for (int i = 0; i < m; ++i) {
+                        rv += hit[i];
+                        if (found != NULL)
+                                found[base + i] = hit[i];
+                }
+        }
+        rb_exit(rec);
+        return rv;
+}
+
+void ** rb_find(RBTREE * t, void * key)
+{
+        struct rb_tree * tree = (struct rb_tree *)t;
+        if (tree->valid != _RB_TREE_VALID) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        struct rb_reader * rec;
+        if (rb_read_begin(tree, &rec) != 0)
+                return NULL;
+        struct rb_node * root = rb_find_node(tree, rb_root(tree), key);
+        rb_exit(rec);
+        return root != NULL ? &root->data : NULL;
+}
+
+// Points 'it' at the node on top of its path, if any
+int rb_iter_load(struct rb_iter * it)
+{
+        if (it->depth == 0) {
+                it->key = it->data = NULL;
+                return 0;
+        }
+        struct rb_node * node = it->nodes[it->depth - 1];
+        it->key = node->key;
+        it->data = node->data;
+        return 1;
 }
 
-int rb_insert(RBTREE * t, void * key, void * data)
+// Pushes 'node' and then its children towards 'dir' down to the end
+int rb_iter_descend(struct rb_iter * it, struct rb_node * node, int dir)
 {
-        struct rb_tree * tree = (struct rb_tree *)t;
-        if (tree->valid != _RB_TREE_VALID) return -1;
-
-        if (tree->root == NULL) {
-                tree->root = rb_make_node(tree, key, data);
-                if (tree->root == NULL)
-                        return -1;
-        }
-        else {
-                struct rb_node head = { 0 }; // False root}
-                struct rb_node *g, *t; // Grandparent & parent
-                struct rb_node *p, *q; // Iterator & parent
-                int dir = 0, last;
+        for (; node != NULL; node = node->link[dir])
+                it->nodes[it->depth++] = node;
+        return rb_iter_load(it);
+}
 
-                /* Set Up Helpers */
-                t = &head;
-                g = p = NULL;
-                q = t->link[1] = tree->root;
+// Moves to the in-order successor (dir 1) or predecessor (dir 0)
+int rb_iter_step(struct rb_iter * it, int dir)
+{
+        if (it->depth == 0)
+                return 0;
 
-                /* Search down the tree */
-                for (;;) {
-                        if (q == NULL) {
-                                /* Insert new node at the bottom */
-                                p->link[dir] = q = rb_make_node(tree, key, data);
-                                if (q == NULL)
-                                        return -1;
-                        }
-                        else if (is_red(q->link[0]) && is_red(q->link[1])) {
-                                // Color Flip
-                                q->color = RBT_RED;
-                                q->link[0]->color = RBT_BLACK;
-                                q->link[1]->color = RBT_BLACK;
-                        }
+        struct rb_node * node = it->nodes[it->depth - 1];
+        if (node->link[dir] != NULL)
+                return rb_iter_descend(it, node->link[dir], !dir);
 
-                        /* Fix Red Violation */
-                        if (is_red(q) && is_red(p)) {
-                                int dir2 = t->link[1] == g ? 1 : 0;
-                                if (q == p->link[last]) {
-                                        t->link[dir2] = rotation(g, last ^ 1);
-                                }
-                                else {
-                                        t->link[dir2] = double_rotation(g, last ^ 1);
-                                }
-                        }
+        // Climb until we leave a subtree from its 'dir ^ 1' side
+        struct rb_node * child;
+        do {
+                child = it->nodes[--it->depth];
+        } while (it->depth > 0 &&
+                        ((struct rb_node *)it->nodes[it->depth - 1])->link[dir]
+                        == child);
+        return rb_iter_load(it);
+}
 
-                        /* Stop if found */
-                        if (tree->info.keycomp(q->key, key) == 0) {
-                                break;
-                        }
-                        last = dir;
-                        dir = tree->info.keycomp(q->key, key) < 0 ? 1 : 0;
+int rb_first(RBTREE * t, struct rb_iter * it)
+{
+        struct rb_tree * tree = (struct rb_tree *)t;
+        if (tree->valid != _RB_TREE_VALID) {
+                errno = EINVAL;
+                return -1;
+        }
+        it->depth = 0;
+        return rb_iter_descend(it, rb_root(tree), 0);
+}
 
-                        /* Update helpers */
-                        if (g != NULL) {
-                                t = g;
-                        }
-                        g = p, p = q;
-                        q = q->link[dir];
-                }
-                /* update root */
-                tree->root = head.link[1];
+int rb_last(RBTREE * t, struct rb_iter * it)
+{
+        struct rb_tree * tree = (struct rb_tree *)t;
+        if (tree->valid != _RB_TREE_VALID) {
+                errno = EINVAL;
+                return -1;
         }
-        tree->root->color = RBT_BLACK;
-        return 0;
+        it->depth = 0;
+        return rb_iter_descend(it, rb_root(tree), 1);
 }
 
-int rb_size_node(struct rb_node * root)
+int rb_next(struct rb_iter * it)
 {
-        if (root == NULL)
-                return 0;
-        int l = rb_size_node(root->link[0]);
-        int r = rb_size_node(root->link[1]);
-        return 1 + l + r;
+        return rb_iter_step(it, 1);
 }
 
-int rb_size(RBTREE * t)
+int rb_prev(struct rb_iter * it)
 {
-        if (t == NULL)
-                return 0;
+        return rb_iter_step(it, 0);
+}
 
+int rb_end(struct rb_iter * it)
+{
+        return it->depth == 0;
+}
+
+/*
+ * Points 'it' at the first key not less than 'key' ('strict' 0) or greater
+ * than 'key' ('strict' 1).  The path is kept up to the last node the search
+ * went left at, which is that key.
+ */
+int rb_bound(RBTREE * t, struct rb_iter * it, void * key, int strict)
+{
         struct rb_tree * tree = (struct rb_tree *)t;
-        if (tree->valid != _RB_TREE_VALID) return -1;
-        return rb_size_node(tree->root);
+        if (tree->valid != _RB_TREE_VALID) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        int found = 0;
+        it->depth = 0;
+        for (struct rb_node * root = rb_root(tree); root != NULL; ) {
+                int comp = tree->info.keycomp(root->key, key);
+                it->nodes[it->depth++] = root;
+                if (comp > 0 || (comp == 0 && !strict)) {
+                        found = it->depth;
+                        root = root->link[0];
+                } else {
+                        root = root->link[1];
+                }
+        }
+        it->depth = found;
+        return rb_iter_load(it);
 }
 
-int rb_has_node(struct rb_tree * tree, struct rb_node * root, void * key) {
-        if (root == NULL)
-                return 0;
+int rb_lower_bound(RBTREE * tree, struct rb_iter * it, void * key)
+{
+        return rb_bound(tree, it, key, 0);
+}
 
-        int comp = tree->info.keycomp(key, root->key);
-        if (comp == 0)
-                return 1;
-        else if (comp < 0)
-                return rb_has_node(tree, root->link[0], key);
-        else
-                return rb_has_node(tree, root->link[1], key);
+int rb_upper_bound(RBTREE * tree, struct rb_iter * it, void * key)
+{
+        return rb_bound(tree, it, key, 1);
 }
 
-int rb_has(RBTREE * t, void * key)
+int rb_range(RBTREE * t, void * lo, void * hi,
+                int (*cb)(void * key, void * data, void * arg), void * arg)
 {
         struct rb_tree * tree = (struct rb_tree *)t;
+        struct rb_reader * rec;
         if (tree->valid != _RB_TREE_VALID) {
                 errno = EINVAL;
                 return -1;
         }
-        return rb_has_node(tree, tree->root, key);
+        if (rb_read_begin(tree, &rec) != 0)
+                return -1;
+
+        struct rb_iter it;
+        int rv = rb_lower_bound(t, &it, lo), stop = 0;
+        for (; rv == 1; rv = rb_next(&it)) {
+                if (tree->info.keycomp(it.key, hi) >= 0)
+                        break;
+                stop = cb(it.key, it.data, arg);
+                if (stop != 0)
+                        break;
+        }
+        rb_exit(rec);
+        return stop;
 }
 
 void rb_free_node(struct rb_tree * tree, struct rb_node * root)
@@ -266,7 +1821,16 @@ void rb_free_node(struct rb_tree * tree, struct rb_node * root)
         rb_free_node(tree, root->link[0]);
         rb_free_node(tree, root->link[1]);
         tree->info.keyfree(root->key);
-        free(root);
+        rb_free_data(tree, root);
+        rb_release_node(tree, root);
+}
+
+// Counts 'tree' out of the versions sharing its nodes
+void rb_drop_version(struct rb_tree * tree)
+{
+        if (tree->versions != NULL && __atomic_sub_fetch(tree->versions, 1,
+                                __ATOMIC_ACQ_REL) == 0)
+                free(tree->versions);
 }
 
 int rb_free(RBTREE * t)
@@ -276,7 +1840,53 @@ int rb_free(RBTREE * t)
                 errno = EINVAL;
                 return -1;
         }
-        rb_free_node(tree, tree->root);
+        if (tree->epoch != NULL)
+                rb_free_epoch(tree);
+        struct rb_pool * pool = tree->pool;
+        if (pool == NULL) {
+                if (rb_shared(tree))
+                        rb_node_release(tree, tree->root);
+                else
+                        rb_free_node(tree, tree->root);
+                rb_drop_version(tree);
+                free(t);
+                return 0;
+        }
+
+        // Always locked: a tree freed on another thread may still be
+        // unlocking after it counted itself out
+        pthread_mutex_lock(&pool->lock);
+        int last = pool->refs == 1;
+        pthread_mutex_unlock(&pool->lock);
+        if (!last) {
+                // Other trees still use the pool: give back just our nodes
+                if (rb_shared(tree))
+                        rb_node_release(tree, tree->root);
+                else
+                        rb_free_node(tree, tree->root);
+                pthread_mutex_lock(&pool->lock);
+                last = __atomic_sub_fetch(&pool->refs, 1,
+                                __ATOMIC_ACQ_REL) == 0;
+                pthread_mutex_unlock(&pool->lock);
+        }
+        if (last) {
+                // Sweep the chunks front to back rather than chase the tree
+                while (pool->chunks != NULL) {
+                        struct rb_chunk * chunk = pool->chunks;
+                        for (int i = 0; i < chunk->n; ++i) {
+                                struct rb_node * node = &chunk->nodes[i];
+                                if (node->color == 0)
+                                        continue;
+                                tree->info.keyfree(node->key);
+                                rb_free_data(tree, node);
+                        }
+                        pool->chunks = chunk->next;
+                        free(chunk);
+                }
+                pthread_mutex_destroy(&pool->lock);
+                free(pool);
+        }
+        rb_drop_version(tree);
         free(t);
         return 0;
 }
@@ -296,6 +1906,8 @@ int rb_remove(RBTREE * t, void * key)
                 return -1;
         }
 
+        if (tree->epoch != NULL || rb_shared(tree))
+                return rb_remove_copying(tree, key);
         if (tree->root == NULL)
                 return 0;
 
@@ -320,6 +1932,9 @@ int rb_remove(RBTREE * t, void * key)
                 int comp = tree->info.keycomp(q->key, key);
                 dir = comp < 0;
 
+                // Counts the key out of every node from the root down to q
+                q->size--;
+
                 // Save found node
                 if (comp == 0) {
                         f = q;
@@ -329,6 +1944,7 @@ int rb_remove(RBTREE * t, void * key)
                 if (!is_red(q) && !is_red(q->link[dir])) {
                         if (is_red(q->link[dir ^ 1])) {
                                 p = p->link[last] = rotation(q, dir);
+                                q->size--;      // Recounted below p
                         }
 
                         else if (!is_red(q->link[dir ^ 1])) {
@@ -366,10 +1982,15 @@ int rb_remove(RBTREE * t, void * key)
         // Replace and remove if found
         int rv = 0;
         if (f != NULL) {
-                tree->info.keycopy(&(f->key), &(q->key));
+                // Unlink q (f's in-order neighbour)
                 p->link[p->link[1] == q] = q->link[q->link[0] == NULL];
-                tree->info.keyfree(q->key);
-                free(q);
+
+                // q moves its key and value into f
+                tree->info.keyfree(f->key);
+                rb_free_data(tree, f);
+                f->key = q->key;
+                f->data = q->data;
+                rb_release_node(tree, q);
                 rv = 1;
         }
 
@@ -377,7 +1998,452 @@ int rb_remove(RBTREE * t, void * key)
         tree->root = head.link[1];
         if (tree->root != NULL)
                 tree->root->color = RBT_BLACK;
+        if (rv == 0)
+                rb_adjust_sizes(tree, key, 1);
+
+        return rv;
+}
+
+
+/*
+ * Join-based set operations (Blelloch, Ferizovic and Sun, "Just Join for
+ * Parallel Ordered Sets").  Everything is built from rb_join3, which links
+ * two trees and a middle node in time proportional to the difference of their
+ * black heights, and rb_split, which cuts a tree at a key with O(log n) joins.
+ * While a tree is being taken apart its pieces are valid red-black trees
+ * except that their roots may be red, so each piece carries its black height
+ * instead of it being recounted.
+ */
+
+// Total size above which a set operation recurses on two threads
+#define RB_PARALLEL_GRAIN (1 << 15)
+// Levels of recursion that may fork (up to 2^depth threads)
+#define RB_PARALLEL_DEPTH 3
+
+struct rb_part {
+        struct rb_node * root;
+        int bh;         // Black nodes on every path down (NULL counts none)
+};
+
+// The 'dir' subtree of 'part'
+struct rb_part rb_part_child(struct rb_part part, int dir)
+{
+        struct rb_part rv = { part.root->link[dir],
+                part.bh - !is_red(part.root) };
+        return rv;
+}
+
+// The whole of 'tree' as a part
+struct rb_part rb_part_of(struct rb_tree * tree)
+{
+        struct rb_part rv = { tree->root, 0 };
+        for (struct rb_node * it = tree->root; it != NULL; it = it->link[0])
+                rv.bh += !is_red(it);
+        return rv;
+}
+
+struct rb_node * rb_attach(struct rb_node * left, struct rb_node * node,
+                struct rb_node * right, int color)
+{
+        node->link[0] = left;
+        node->link[1] = right;
+        node->size = 1 + node_size(left) + node_size(right);
+        node->color = color;
+        return node;
+}
+
+/*
+ * Hangs 'low' off the 'dir' side of 'tall' (of at least its black height)
+ * through 'node': walks down that side to a black node of the black height
+ * of 'low', puts 'node' in its place as a red parent of the two, and fixes
+ * any red-red pair on the way back up with one rotation.
+ */
+struct rb_node * rb_join_down(struct rb_part tall, struct rb_node * node,
+                struct rb_part low, int dir)
+{
+        struct rb_node * t = tall.root;
+        if (!is_red(t) && tall.bh == low.bh) {
+                if (dir)
+                        return rb_attach(t, node, low.root, RBT_RED);
+                return rb_attach(low.root, node, t, RBT_RED);
+        }
 
+        t->link[dir] = rb_join_down(rb_part_child(tall, dir), node, low, dir);
+        t->size = 1 + node_size(t->link[0]) + node_size(t->link[1]);
+        if (!is_red(t) && is_red(t->link[dir]) &&
+                        is_red(t->link[dir]->link[dir])) {
+                t->link[dir]->link[dir]->color = RBT_BLACK;
+                t = rotation(t, !dir);
+                // rotation leaves the new root black; here it stays red
+                t->color = RBT_RED;
+                t->link[!dir]->color = RBT_BLACK;
+        }
+        return t;
+}
+
+// Joins 'left', 'node' and 'right', whose keys are in that order
+struct rb_part rb_join3(struct rb_part left, struct rb_node * node,
+                struct rb_part right)
+{
+        struct rb_part rv;
+        if (left.bh != right.bh) {
+                int dir = left.bh > right.bh;   // The side 'low' goes on
+                struct rb_part tall = dir ? left : right;
+                struct rb_part low = dir ? right : left;
+                rv.root = rb_join_down(tall, node, low, dir);
+                rv.bh = tall.bh;
+                if (is_red(rv.root) && is_red(rv.root->link[dir])) {
+                        rv.root->color = RBT_BLACK;
+                        rv.bh++;
+                }
+        }
+        else if (!is_red(left.root) && !is_red(right.root)) {
+                rv.root = rb_attach(left.root, node, right.root, RBT_RED);
+                rv.bh = left.bh;
+        }
+        else {
+                rv.root = rb_attach(left.root, node, right.root, RBT_BLACK);
+                rv.bh = left.bh + 1;
+        }
         return rv;
 }
 
+/*
+ * Cuts 'part' into the keys less than 'key' ('left') and greater ('right').
+ * Returns the node holding 'key', unlinked, or NULL.
+ */
+struct rb_node * rb_split_part(struct rb_tree * tree, struct rb_part part,
+                void * key, struct rb_part * left, struct rb_part * right)
+{
+        if (part.root == NULL) {
+                *left = *right = part;
+                return NULL;
+        }
+
+        struct rb_node * root = part.root;
+        struct rb_part l = rb_part_child(part, 0), r = rb_part_child(part, 1);
+        int comp = tree->info.keycomp(key, root->key);
+        if (comp == 0) {
+                *left = l;
+                *right = r;
+                return root;
+        }
+
+        struct rb_part mid;
+        struct rb_node * found;
+        if (comp < 0) {
+                found = rb_split_part(tree, l, key, left, &mid);
+                *right = rb_join3(mid, root, r);
+        }
+        else {
+                found = rb_split_part(tree, r, key, &mid, right);
+                *left = rb_join3(l, root, mid);
+        }
+        return found;
+}
+
+// Takes the last node out of the nonempty 'part', leaving the rest in 'rest'
+struct rb_node * rb_split_last(struct rb_part part, struct rb_part * rest)
+{
+        struct rb_node * root = part.root;
+        if (root->link[1] == NULL) {
+                *rest = rb_part_child(part, 0);
+                return root;
+        }
+
+        struct rb_part right;
+        struct rb_node * last = rb_split_last(rb_part_child(part, 1), &right);
+        *rest = rb_join3(rb_part_child(part, 0), root, right);
+        return last;
+}
+
+// Joins 'left' and 'right', whose keys are in that order
+struct rb_part rb_join2(struct rb_part left, struct rb_part right)
+{
+        if (left.root == NULL)
+                return right;
+        struct rb_part rest;
+        struct rb_node * last = rb_split_last(left, &rest);
+        return rb_join3(rest, last, right);
+}
+
+// Frees a node a set operation has dropped
+void rb_drop_node(struct rb_tree * tree, struct rb_node * node)
+{
+        tree->info.keyfree(node->key);
+        rb_free_data(tree, node);
+        rb_release_node(tree, node);
+}
+
+typedef struct rb_part (*rb_setop_t)(struct rb_tree *, struct rb_part,
+                struct rb_part, int);
+
+struct rb_task {
+        rb_setop_t op;
+        struct rb_tree * tree;
+        struct rb_part a, b;
+        int depth;
+        struct rb_part rv;
+};
+
+void * rb_run_task(void * arg)
+{
+        struct rb_task * task = (struct rb_task *)arg;
+        task->rv = task->op(task->tree, task->a, task->b, task->depth);
+        return NULL;
+}
+
+/*
+ * Runs 'op' on the left pieces and on the right pieces, the left on a new
+ * thread if 'depth' allows and the pieces are large enough
+ */
+void rb_fork(rb_setop_t op, struct rb_tree * tree, struct rb_part al,
+                struct rb_part bl, struct rb_part ar, struct rb_part br,
+                int depth, struct rb_part * left, struct rb_part * right)
+{
+        struct rb_task task = { op, tree, al, bl, depth - 1, { NULL, 0 } };
+        pthread_t thread;
+        int forked = depth > 0 &&
+                node_size(al.root) + node_size(bl.root) >= RB_PARALLEL_GRAIN &&
+                node_size(ar.root) + node_size(br.root) >= RB_PARALLEL_GRAIN &&
+                pthread_create(&thread, NULL, rb_run_task, &task) == 0;
+        if (!forked)
+                rb_run_task(&task);
+
+        *right = op(tree, ar, br, depth - 1);
+        if (forked)
+                pthread_join(thread, NULL);
+        *left = task.rv;
+}
+
+// Keys of 'a' or 'b'; for keys in both, b's node (and value) stays
+struct rb_part rb_union_part(struct rb_tree * tree, struct rb_part a,
+                struct rb_part b, int depth)
+{
+        if (a.root == NULL)
+                return b;
+        if (b.root == NULL)
+                return a;
+
+        struct rb_node * node = b.root;
+        struct rb_part al, ar, left, right;
+        struct rb_node * dup = rb_split_part(tree, a, node->key, &al, &ar);
+        if (dup != NULL)
+                rb_drop_node(tree, dup);
+        rb_fork(rb_union_part, tree, al, rb_part_child(b, 0), ar,
+                        rb_part_child(b, 1), depth, &left, &right);
+        return rb_join3(left, node, right);
+}
+
+// Frees a whole subtree a set operation has dropped
+void rb_drop_part(struct rb_tree * tree, struct rb_node * root)
+{
+        while (root != NULL) {
+                struct rb_node * right = root->link[1];
+                rb_drop_part(tree, root->link[0]);
+                rb_drop_node(tree, root);
+                root = right;
+        }
+}
+
+// Keys of both 'a' and 'b', with a's nodes
+struct rb_part rb_intersect_part(struct rb_tree * tree, struct rb_part a,
+                struct rb_part b, int depth)
+{
+        if (a.root == NULL || b.root == NULL) {
+                rb_drop_part(tree, a.root);
+                rb_drop_part(tree, b.root);
+                struct rb_part empty = { NULL, 0 };
+                return empty;
+        }
+
+        struct rb_node * node = a.root;
+        struct rb_part bl, br, left, right;
+        struct rb_node * dup = rb_split_part(tree, b, node->key, &bl, &br);
+        rb_fork(rb_intersect_part, tree, rb_part_child(a, 0), bl,
+                        rb_part_child(a, 1), br, depth, &left, &right);
+        if (dup != NULL) {
+                rb_drop_node(tree, dup);
+                return rb_join3(left, node, right);
+        }
+        rb_drop_node(tree, node);
+        return rb_join2(left, right);
+}
+
+// Keys of 'a' that are not in 'b'
+struct rb_part rb_difference_part(struct rb_tree * tree, struct rb_part a,
+                struct rb_part b, int depth)
+{
+        if (a.root == NULL || b.root == NULL) {
+                rb_drop_part(tree, b.root);
+                return a;
+        }
+
+        struct rb_node * node = b.root;
+        struct rb_part al, ar, left, right;
+        struct rb_node * dup = rb_split_part(tree, a, node->key, &al, &ar);
+        rb_fork(rb_difference_part, tree, al, rb_part_child(b, 0), ar,
+                        rb_part_child(b, 1), depth, &left, &right);
+        rb_drop_node(tree, node);
+        if (dup != NULL)
+                rb_drop_node(tree, dup);
+        return rb_join2(left, right);
+}
+
+/*
+ * Lets 'a' own the nodes of 'b': both must be pooled or neither.  Two
+ * pools are merged into whichever is shared with other trees (if both are,
+ * the trees can't be combined).
+ */
+int rb_share_pool(struct rb_tree * a, struct rb_tree * b)
+{
+        if (a->pool == b->pool)
+                return 0;
+        if (a->pool == NULL || b->pool == NULL ||
+                        (rb_pool_shared(a->pool) &&
+                         rb_pool_shared(b->pool))) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        struct rb_tree * from = rb_pool_shared(b->pool) ? a : b;
+        struct rb_tree * to = from == a ? b : a;
+        struct rb_pool * pool = from->pool;
+        int locked = rb_pool_lock(to->pool);
+        if (pool->chunks != NULL) {
+                struct rb_chunk * last = pool->chunks;
+                while (last->next != NULL)
+                        last = last->next;
+                last->next = to->pool->chunks;
+                to->pool->chunks = pool->chunks;
+        }
+        while (pool->free != NULL) {
+                struct rb_node * node = pool->free;
+                pool->free = node->link[0];
+                node->link[0] = to->pool->free;
+                to->pool->free = node;
+        }
+        __atomic_add_fetch(&to->pool->refs, 1, __ATOMIC_ACQ_REL);
+        if (locked)
+                pthread_mutex_unlock(&to->pool->lock);
+
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+        from->pool = to->pool;
+        return 0;
+}
+
+// Runs a set operation of 'ta' and 'tb' into 'ta', emptying 'tb'
+int rb_setop(RBTREE * ta, RBTREE * tb, rb_setop_t op)
+{
+        struct rb_tree * a = (struct rb_tree *)ta;
+        struct rb_tree * b = (struct rb_tree *)tb;
+        if (a->valid != _RB_TREE_VALID || b->valid != _RB_TREE_VALID ||
+                        a == b || a->epoch != NULL || b->epoch != NULL ||
+                        rb_shared(a) || rb_shared(b)) {
+                errno = EINVAL;
+                return -1;
+        }
+        if (rb_share_pool(a, b) != 0)
+                return -1;
+
+        int depth = node_size(a->root) + node_size(b->root) >=
+                2 * RB_PARALLEL_GRAIN ? RB_PARALLEL_DEPTH : 0;
+        if (depth > 0 && a->pool != NULL)
+                a->pool->threads = 1;
+        struct rb_part rv = op(a, rb_part_of(a), rb_part_of(b), depth);
+        if (depth > 0 && a->pool != NULL)
+                a->pool->threads = 0;
+
+        a->root = rv.root;
+        if (a->root != NULL)
+                a->root->color = RBT_BLACK;
+        b->root = NULL;
+        return node_size(a->root);
+}
+
+int rb_union(RBTREE * a, RBTREE * b)
+{
+        return rb_setop(a, b, rb_union_part);
+}
+
+int rb_intersect(RBTREE * a, RBTREE * b)
+{
+        return rb_setop(a, b, rb_intersect_part);
+}
+
+int rb_difference(RBTREE * a, RBTREE * b)
+{
+        return rb_setop(a, b, rb_difference_part);
+}
+
+RBTREE * rb_split(RBTREE * t, void * key)
+{
+        struct rb_tree * tree = (struct rb_tree *)t;
+        if (tree->valid != _RB_TREE_VALID || tree->epoch != NULL ||
+                        rb_shared(tree)) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        // The new tree shares the pool, if any
+        struct rbtreeinfo info = tree->info;
+        info.pool = 0;
+        struct rb_tree * right = (struct rb_tree *)rb_init(&info);
+        if (right == NULL)
+                return NULL;
+        if (tree->pool != NULL) {
+                rb_pool_share(tree->pool);
+                right->info.pool = 1;
+                right->pool = tree->pool;
+        }
+
+        struct rb_part l, r;
+        struct rb_node * found = rb_split_part(tree, rb_part_of(tree), key,
+                        &l, &r);
+        if (found != NULL) {
+                struct rb_part empty = { NULL, 0 };
+                r = rb_join3(empty, found, r);
+        }
+        tree->root = l.root;
+        right->root = r.root;
+        if (tree->root != NULL)
+                tree->root->color = RBT_BLACK;
+        if (right->root != NULL)
+                right->root->color = RBT_BLACK;
+        return (RBTREE *)right;
+}
+
+int rb_join(RBTREE * tl, RBTREE * tr)
+{
+        struct rb_tree * left = (struct rb_tree *)tl;
+        struct rb_tree * right = (struct rb_tree *)tr;
+        if (left->valid != _RB_TREE_VALID || right->valid != _RB_TREE_VALID ||
+                        left == right || left->epoch != NULL ||
+                        right->epoch != NULL || rb_shared(left) ||
+                        rb_shared(right)) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (left->root != NULL && right->root != NULL) {
+                struct rb_node * max = left->root, * min = right->root;
+                while (max->link[1] != NULL)
+                        max = max->link[1];
+                while (min->link[0] != NULL)
+                        min = min->link[0];
+                if (left->info.keycomp(max->key, min->key) >= 0) {
+                        errno = EINVAL;
+                        return -1;
+                }
+        }
+        if (rb_share_pool(left, right) != 0)
+                return -1;
+
+        struct rb_part rv = rb_join2(rb_part_of(left), rb_part_of(right));
+        left->root = rv.root;
+        if (left->root != NULL)
+                left->root->color = RBT_BLACK;
+        right->root = NULL;
+        return node_size(left->root);
+}
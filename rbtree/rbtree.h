@@ -60,21 +60,241 @@
 
 typedef void * RBTREE;
 
+// Longest root-to-leaf path of a tree with fewer than 2^32 keys
+#define RB_MAX_DEPTH 64
+
+/**
+ * An in-order position in a tree that needs no allocation and may live on
+ * the stack; only 'key' and 'data' are meant to be read.  It holds the path
+ * from the root (no parent pointers are stored) and stays valid until the
+ * tree is next modified.
+ **/
+struct rb_iter {
+        void * key;                     // Key at the current position
+        void * data;                    // Its value
+        void * nodes[RB_MAX_DEPTH];
+        int depth;
+};
+
 struct rbtreeinfo {
         int (*keycopy)(void * dest, void * src);
         int (*keycomp)(void * p, void * q);
         int (*keyfree)(void * p);
+        int (*datafree)(void * p);      // Optional: releases a value the
+                                        // tree drops (replaced, removed or
+                                        // freed with the tree)
+        int pool;                       // Optional: nonzero to allocate
+                                        // nodes in chunks owned by the
+                                        // tree; removed nodes are reused and
+                                        // rb_free releases whole chunks
+        int (*datacopy)(void * dest, void * src);
+                                        // Optional: copies a value for
+                                        // another version (see rb_snapshot)
 };
 
 RBTREE * rb_init(struct rbtreeinfo * info);
 int rb_free(RBTREE * tree);
+
+/**
+ * Shape of a tree, as measured by rb_check.
+ **/
+struct rb_stats {
+        int size;                       // Keys in the tree
+        int black_height;               // Black nodes on every path from
+                                        // the root to a NULL link
+        int min_depth;                  // Nodes on the shortest such path
+        int max_depth;                  // Nodes on the longest
+};
+
+/**
+ * Checks every invariant of 'tree' without recursion: node colors, no red
+ * child of a red node, equal black heights, subtree sizes, and that each key
+ * lies strictly between its bounds from every ancestor (by 'keycomp'), not
+ * just its parent's.  Subtrees are split among up to 'threads' threads once
+ * the tree is large enough.  Fills 'stats' if it is not NULL.  Returns 1 if
+ * the tree is valid, 0 if not (the violation is reported on stderr) and -1
+ * on error (sets errno).  rb_assert(tree) is rb_check(tree, 1, NULL) == 1.
+ **/
+int rb_check(RBTREE * tree, int threads, struct rb_stats * stats);
 int rb_assert(RBTREE * tree);
+
+/**
+ * Initializes a tree that many threads may use at once.  Lookups (rb_has,
+ * rb_find, rb_size, rb_rank, rb_select, rb_range and the iterators) never
+ * lock: rb_insert and rb_remove copy the nodes they would change and publish
+ * the new version with one atomic store, so readers see the tree either
+ * before or after each write.  Writers take a mutex, one at a time.  Replaced
+ * nodes, and removed keys and values, are freed once no reader can still be
+ * looking at them.  rb_merge_sorted and the join-based operations are not
+ * supported (EINVAL), and rb_free and rb_assert must not run alongside other
+ * calls.  Returns NULL on error (sets errno).
+ **/
+RBTREE * rb_init_concurrent(struct rbtreeinfo * info);
+
+/**
+ * Bracket a read of a concurrent tree, on one thread (they nest): pointers
+ * from rb_find, and iterators, stay valid until rb_read_unlock.  Values must
+ * not be written through rb_find on a concurrent tree.  Other trees need no
+ * bracketing, and these do nothing.  Return 0, or -1 on error (sets errno).
+ **/
+int rb_read_lock(RBTREE * tree);
+int rb_read_unlock(RBTREE * tree);
+
+/**
+ * Inserts 'key' with the value 'data', or replaces the value if 'key' is
+ * already present.  Returns 1 if 'key' is new, 0 if its value was replaced
+ * and -1 on error.
+ **/
 int rb_insert(RBTREE * tree, void * key, void * data);
+
+/**
+ * Builds a tree of keys[i] with the values values[i] (or NULL values if
+ * 'values' is NULL) in O(n).  The keys must strictly increase.  The result is
+ * perfectly balanced and uses a node pool (as with info->pool) whose first
+ * chunk holds all 'n' nodes in key order.  Returns NULL on error (sets errno).
+ **/
+RBTREE * rb_build_sorted(struct rbtreeinfo * info, void ** keys,
+                void ** values, int n);
+
+/**
+ * Inserts a batch of 'n' strictly increasing keys (values as for
+ * rb_build_sorted), replacing the values of keys already present.  A batch
+ * that is not much smaller than the tree is merged with its nodes and the
+ * tree relinked, balanced, in O(size + n); a small one is inserted key by
+ * key.  Returns the number of new keys, or -1 on error (sets errno), in which
+ * case only part of the batch may have been inserted.
+ **/
+int rb_merge_sorted(RBTREE * tree, void ** keys, void ** values, int n);
+
+/**
+ * Every node counts the nodes in its subtree, so the size is read off the
+ * root in O(1) and rb_rank/rb_select take O(log n).
+ **/
 int rb_size(RBTREE * tree);
+
+/**
+ * Returns the number of keys less than 'key' (its 0-based position if it is
+ * present), or -1 on error.
+ **/
+int rb_rank(RBTREE * tree, void * key);
+
+/**
+ * Finds the key of rank 'k' (0-based, in key order) and stores the key and
+ * its value in 'key' and 'data' (either may be NULL).  Returns 1 if found,
+ * 0 if 'k' is not in [0, rb_size) and -1 on error.
+ **/
+int rb_select(RBTREE * tree, int k, void ** key, void ** data);
 int rb_has(RBTREE * tree, void * key);
 
+/**
+ * Looks up 'n' keys at once: the descents are interleaved a level at a
+ * time, with each key's next node prefetched while the others are compared,
+ * so the cache misses of a batch overlap.  Faster than 'n' calls to rb_has
+ * once the tree no longer fits in cache.  If 'found' is not NULL, found[i]
+ * is set to 1 if keys[i] is present and to 0 otherwise.  Returns the number
+ * of keys found, or -1 on error (sets errno).
+ **/
+int rb_has_many(RBTREE * tree, void * const * keys, int n, int * found);
+
+/**
+ * Returns a borrowed pointer to the value stored with 'key' (which may be
+ * written through to update it in place), or NULL if 'key' is not present.
+ * The pointer stays valid until the tree is next modified.
+ **/
+void ** rb_find(RBTREE * tree, void * key);
+
+/**
+ * Point 'it' at the smallest (rb_first) or largest (rb_last) key.  Return 1
+ * if 'it' is at a key, 0 if the tree is empty and -1 on error.
+ **/
+int rb_first(RBTREE * tree, struct rb_iter * it);
+int rb_last(RBTREE * tree, struct rb_iter * it);
+
+/**
+ * Move 'it' to the next larger (rb_next) or smaller (rb_prev) key in
+ * amortized O(1).  Return 1 if 'it' is at a key and 0 once it has walked off
+ * either end, after which rb_end is true.  Typical use:
+ *      for (rb_first(t, &it); !rb_end(&it); rb_next(&it))
+ *              use(it.key, it.data);
+ **/
+int rb_next(struct rb_iter * it);
+int rb_prev(struct rb_iter * it);
+int rb_end(struct rb_iter * it);
+
+/**
+ * Point 'it' at the first key not less than (rb_lower_bound) or greater
+ * than (rb_upper_bound) 'key' in O(log n).  Return 1 if there is one, 0 if
+ * not (rb_end is then true) and -1 on error.
+ **/
+int rb_lower_bound(RBTREE * tree, struct rb_iter * it, void * key);
+int rb_upper_bound(RBTREE * tree, struct rb_iter * it, void * key);
+
+/**
+ * Calls 'cb' with the key, value and 'arg' of every key in [lo, hi), in
+ * order, in O(log n + k) for k keys visited; stops early if 'cb' returns
+ * nonzero.  'cb' must not modify the tree.  Returns 0 if the whole range was
+ * visited, else the nonzero value 'cb' returned; -1 on error.
+ **/
+int rb_range(RBTREE * tree, void * lo, void * hi,
+                int (*cb)(void * key, void * data, void * arg), void * arg);
 
 int rb_remove(RBTREE * tree, void * key);
 
+/**
+ * Versions.  rb_snapshot returns a new tree sharing every node with 'tree'
+ * in O(1).  Either may then be modified: rb_insert and rb_remove on a tree
+ * that shares nodes copy the O(log n) nodes they change, leaving every other
+ * subtree shared, and nodes are reference counted so each is freed with the
+ * last version using it.  Once the other versions are freed, a tree no
+ * longer shares nodes and writes in place again.  A version may only be used
+ * by one thread at a time, but versions sharing nodes may be used and freed
+ * concurrently.
+ *
+ * Each copied node gets its own copy of its key (keycopy) and value
+ * (datacopy, or the same pointer if 'datacopy' is NULL, in which case
+ * 'datafree' must be NULL too), so a version frees only what it holds.
+ * Values must not be written through rb_find on a tree that shares nodes.
+ * Snapshots of concurrent trees, and rb_merge_sorted and the join-based
+ * operations on trees that share nodes, are not supported (EINVAL).
+ *
+ * rb_pinsert and rb_premove return a new version with 'key' inserted (as by
+ * rb_insert) or removed, leaving 'tree' unchanged.
+ *
+ * These return the new tree (release with rb_free), or NULL on error (sets
+ * errno).
+ **/
+RBTREE * rb_snapshot(RBTREE * tree);
+RBTREE * rb_pinsert(RBTREE * tree, void * key, void * data);
+RBTREE * rb_premove(RBTREE * tree, void * key);
+
+/**
+ * Join-based operations.  Each moves nodes between trees instead of copying
+ * keys, so the trees must share their rbtreeinfo callbacks and either both
+ * use a node pool or neither (pools are merged; trees made by rb_split share
+ * one, and two trees that each share a pool with others can't be combined:
+ * EINVAL).  Trees lock a pool on every insert and remove for as long as
+ * they share it.
+ *
+ * rb_split moves the keys not less than 'key' from 'tree' into a new tree,
+ * which it returns (NULL on error, sets errno), in O(log n).
+ *
+ * rb_join moves every key of 'right', which must all be greater than those of
+ * 'left', into 'left' in O(log n), leaving 'right' empty.
+ *
+ * rb_union, rb_intersect and rb_difference leave in 'a' the keys in 'a' or
+ * 'b', in both, or in 'a' but not 'b', and empty 'b'.  A key in both keeps
+ * the value from 'b' for a union and the one from 'a' for an intersection;
+ * every dropped key and value is freed.  They take O(m log(n / m + 1)) for
+ * trees of m <= n keys, and split large trees across up to eight threads, so
+ * keyfree, datafree and keycomp may then run on several threads at once.
+ *
+ * These return the new size of 'left' or 'a', or -1 on error (sets errno).
+ **/
+RBTREE * rb_split(RBTREE * tree, void * key);
+int rb_join(RBTREE * left, RBTREE * right);
+int rb_union(RBTREE * a, RBTREE * b);
+int rb_intersect(RBTREE * a, RBTREE * b);
+int rb_difference(RBTREE * a, RBTREE * b);
+
 #endif
 
@@ -0,0 +1,311 @@
+/**
+ * A red-black tree specialized at compile time for one key type.
+ *
+ * RBTREE reaches its keys through the keycopy/keycomp callbacks, which costs
+ * an indirect call at every level of every search.  Including this file
+ * instead instantiates the same top-down tree with keys stored by value in
+ * the nodes and compared by an expression the compiler inlines:
+ *
+ *      #define RB_SPEC_NAME rbi                // Prefix of the names defined
+ *      #define RB_SPEC_KEY  intptr_t           // Key type (copied by '=')
+ *      #include "rbtree_spec.h"
+ *
+ * defines struct rbi_tree and rbi_init, rbi_insert, rbi_find, rbi_has,
+ * rbi_remove, rbi_size, rbi_assert and rbi_free, which behave as their rb_
+ * counterparts.  Keys are compared with < and > unless RB_SPEC_COMP(a, b) is
+ * defined to return <0, 0 or >0; for fixed-width byte keys wrap the bytes in
+ * a struct and compare with memcmp, whose constant length lets the compiler
+ * inline it.  The file may be included several times with different
+ * parameters, which it undefines at the end.
+ **/
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifndef RB_SPEC_NAME
+#error "RB_SPEC_NAME must be defined before including rbtree_spec.h"
+#endif
+#ifndef RB_SPEC_KEY
+#error "RB_SPEC_KEY must be defined before including rbtree_spec.h"
+#endif
+#ifndef RB_SPEC_COMP
+#define RB_SPEC_COMP(a, b) ( ((a) > (b)) - ((a) < (b)) )
+#endif
+
+#define RB_SPEC_PASTE(a, b) a ## _ ## b
+#define RB_SPEC_CAT(a, b) RB_SPEC_PASTE(a, b)
+#define RB_SPEC(name) RB_SPEC_CAT(RB_SPEC_NAME, name)
+#define RB_SPEC_RED(node) ( ((node) != NULL) && (node)->red )
+
+struct RB_SPEC(node) {
+        uint8_t red;
+        RB_SPEC_KEY key;
+        void * data;
+        struct RB_SPEC(node) * link[2];
+};
+
+struct RB_SPEC(tree) {
+        struct RB_SPEC(node) * root;
+        int size;
+        int (*datafree)(void * p);      // Optional, as in struct rbtreeinfo
+};
+
+static inline void RB_SPEC(init)(struct RB_SPEC(tree) * tree,
+                int (*datafree)(void * p))
+{
+        tree->root = NULL;
+        tree->size = 0;
+        tree->datafree = datafree;
+}
+
+static inline struct RB_SPEC(node) * RB_SPEC(rotation)(
+                struct RB_SPEC(node) * root, int dir)
+{
+        struct RB_SPEC(node) * parent = root->link[dir ^ 1];
+        root->link[dir ^ 1] = parent->link[dir];
+        parent->link[dir] = root;
+        root->red = 1;
+        parent->red = 0;
+        return parent;
+}
+
+static inline struct RB_SPEC(node) * RB_SPEC(double_rotation)(
+                struct RB_SPEC(node) * root, int dir)
+{
+        root->link[dir ^ 1] = RB_SPEC(rotation)(root->link[dir ^ 1], dir ^ 1);
+        return RB_SPEC(rotation)(root, dir);
+}
+
+static inline void ** RB_SPEC(find)(struct RB_SPEC(tree) * tree,
+                RB_SPEC_KEY key)
+{
+        // Both children are fetched while the key is compared, as in
+        // rb_find_node
+        struct RB_SPEC(node) * root = tree->root;
+        while (root != NULL) {
+                __builtin_prefetch(root->link[0]);
+                __builtin_prefetch(root->link[1]);
+                int comp = RB_SPEC_COMP(key, root->key);
+                if (comp == 0)
+                        return &root->data;
+                root = root->link[comp > 0];
+        }
+        return NULL;
+}
+
+static inline int RB_SPEC(has)(struct RB_SPEC(tree) * tree, RB_SPEC_KEY key)
+{
+        return RB_SPEC(find)(tree, key) != NULL;
+}
+
+static inline int RB_SPEC(size)(struct RB_SPEC(tree) * tree)
+{
+        return tree->size;
+}
+
+// Top-down insert, as rb_insert
+static inline int RB_SPEC(insert)(struct RB_SPEC(tree) * tree,
+                RB_SPEC_KEY key, void * data)
+{
+        struct RB_SPEC(node) head = { 0 };      // False root
+        struct RB_SPEC(node) * g, * t;          // Grandparent & parent
+        struct RB_SPEC(node) * p, * q;          // Iterator & parent
+        int dir = 0, last = 0, rv = 0;
+
+        t = &head;
+        g = p = NULL;
+        q = t->link[1] = tree->root;
+
+        for (;;) {
+                if (q == NULL) {
+                        // Insert new node at the bottom
+                        q = (struct RB_SPEC(node) *)calloc(1, sizeof *q);
+                        if (q == NULL)
+                                return -1;
+                        q->red = 1;
+                        q->key = key;
+                        q->data = data;
+                        if (p == NULL)
+                                head.link[1] = q;
+                        else
+                                p->link[dir] = q;
+                        rv = 1;
+                }
+                else if (RB_SPEC_RED(q->link[0]) && RB_SPEC_RED(q->link[1])) {
+                        // Color flip
+                        q->red = 1;
+                        q->link[0]->red = 0;
+                        q->link[1]->red = 0;
+                }
+
+                // Fix red violation
+                if (RB_SPEC_RED(q) && RB_SPEC_RED(p)) {
+                        int dir2 = t->link[1] == g;
+                        if (q == p->link[last])
+                                t->link[dir2] = RB_SPEC(rotation)(g, last ^ 1);
+                        else
+                                t->link[dir2] = RB_SPEC(double_rotation)(g,
+                                                last ^ 1);
+                }
+
+                int comp = RB_SPEC_COMP(q->key, key);
+                if (comp == 0) {
+                        // Already present: update the value
+                        if (rv == 0 && q->data != data) {
+                                if (tree->datafree != NULL)
+                                        tree->datafree(q->data);
+                                q->data = data;
+                        }
+                        break;
+                }
+                last = dir;
+                dir = comp < 0;
+
+                if (g != NULL)
+                        t = g;
+                g = p, p = q;
+                q = q->link[dir];
+        }
+
+        tree->root = head.link[1];
+        tree->root->red = 0;
+        tree->size += rv;
+        return rv;
+}
+
+// Top-down remove, as rb_remove
+static inline int RB_SPEC(remove)(struct RB_SPEC(tree) * tree,
+                RB_SPEC_KEY key)
+{
+        if (tree->root == NULL)
+                return 0;
+
+        struct RB_SPEC(node) head = { 0 };      // False root
+        struct RB_SPEC(node) * q, * p, * g;     // Helpers
+        struct RB_SPEC(node) * f = NULL;        // Found item
+        int dir = 1;
+
+        q = &head;
+        g = p = NULL;
+        q->link[1] = tree->root;
+
+        // Search and push down a red
+        while (q->link[dir] != NULL) {
+                int last = dir;
+
+                g = p, p = q;
+                q = q->link[dir];
+                int comp = RB_SPEC_COMP(q->key, key);
+                dir = comp < 0;
+
+                if (comp == 0)
+                        f = q;
+
+                if (RB_SPEC_RED(q) || RB_SPEC_RED(q->link[dir]))
+                        continue;
+
+                if (RB_SPEC_RED(q->link[dir ^ 1])) {
+                        p = p->link[last] = RB_SPEC(rotation)(q, dir);
+                        continue;
+                }
+
+                struct RB_SPEC(node) * s = p->link[last ^ 1];   // Sibling
+                if (s == NULL)
+                        continue;
+
+                if (!RB_SPEC_RED(s->link[last ^ 1]) &&
+                                !RB_SPEC_RED(s->link[last])) {
+                        // Color flip
+                        p->red = 0;
+                        s->red = 1;
+                        q->red = 1;
+                }
+                else {
+                        int dir2 = g->link[1] == p;
+
+                        if (RB_SPEC_RED(s->link[last]))
+                                g->link[dir2] = RB_SPEC(double_rotation)(p, last);
+                        else
+                                g->link[dir2] = RB_SPEC(rotation)(p, last);
+
+                        // Ensure correct coloring
+                        q->red = 1;
+                        g->link[dir2]->red = 1;
+                        g->link[dir2]->link[0]->red = 0;
+                        g->link[dir2]->link[1]->red = 0;
+                }
+        }
+
+        // Replace and remove if found
+        int rv = 0;
+        if (f != NULL) {
+                if (tree->datafree != NULL)
+                        tree->datafree(f->data);
+                f->key = q->key;
+                f->data = q->data;
+                p->link[p->link[1] == q] = q->link[q->link[0] == NULL];
+                free(q);
+                rv = 1;
+        }
+
+        tree->root = head.link[1];
+        if (tree->root != NULL)
+                tree->root->red = 0;
+        tree->size -= rv;
+        return rv;
+}
+
+// Returns the black height of 'root' or 0 if the subtree is invalid
+static inline int RB_SPEC(assert_node)(struct RB_SPEC(node) * root,
+                RB_SPEC_KEY * lo, RB_SPEC_KEY * hi)
+{
+        if (root == NULL)
+                return 1;
+
+        struct RB_SPEC(node) * ln = root->link[0], * rn = root->link[1];
+        if (root->red && (RB_SPEC_RED(ln) || RB_SPEC_RED(rn)))
+                return 0;
+        if ((lo != NULL && RB_SPEC_COMP(root->key, *lo) <= 0) ||
+                        (hi != NULL && RB_SPEC_COMP(root->key, *hi) >= 0))
+                return 0;
+
+        int lh = RB_SPEC(assert_node)(ln, lo, &root->key);
+        int rh = RB_SPEC(assert_node)(rn, &root->key, hi);
+        if (lh == 0 || rh == 0 || lh != rh)
+                return 0;
+        return root->red ? lh : lh + 1;
+}
+
+static inline int RB_SPEC(assert)(struct RB_SPEC(tree) * tree)
+{
+        return RB_SPEC(assert_node)(tree->root, NULL, NULL) != 0;
+}
+
+static inline void RB_SPEC(free_node)(struct RB_SPEC(tree) * tree,
+                struct RB_SPEC(node) * root)
+{
+        while (root != NULL) {
+                struct RB_SPEC(node) * right = root->link[1];
+                RB_SPEC(free_node)(tree, root->link[0]);
+                if (tree->datafree != NULL)
+                        tree->datafree(root->data);
+                free(root);
+                root = right;
+        }
+}
+
+// Frees every node ('tree' itself belongs to the caller)
+static inline void RB_SPEC(free)(struct RB_SPEC(tree) * tree)
+{
+        RB_SPEC(free_node)(tree, tree->root);
+        tree->root = NULL;
+        tree->size = 0;
+}
+
+#undef RB_SPEC_RED
+#undef RB_SPEC
+#undef RB_SPEC_CAT
+#undef RB_SPEC_PASTE
+#undef RB_SPEC_COMP
+#undef RB_SPEC_KEY
+#undef RB_SPEC_NAME
@@ -0,0 +1,192 @@
+#include "trie.h"
+#include "hamt.h"
+#include "rbtree.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * The trie against the HAMT and RBTREE on the same string keys
+ *
+ *      ./bench [keys]
+ *
+ * Two key sets: random lowercase words of 1 to 12 letters, and URLs that
+ * share long prefixes.  Each structure gets the same keys in the same order
+ * and is then probed for every key in a shuffled order; all probes hit.  The
+ * HAMT and RBTREE keep pointers to the strings instead of copies.
+ */
+
+/* FNV-1a over the string a HAMT key points at, from a seeded basis (the
+ * default rehash would hash the pointer) */
+int rehash_str_ref(const void * key, int seed)
+{
+        const unsigned char * s = *(const unsigned char * const *)key;
+        uint32_t h = 2166136261u ^ (uint32_t)seed * 0x9e3779b9u;
+        for (; *s != '\0'; ++s)
+                h = (h ^ *s) * 16777619u;
+        return (int)h;
+}
+
+int hash_str_ref(const void * key)
+{
+        return rehash_str_ref(key, 0);
+}
+
+int cmp_str_ref(const void * stored, const void * key)
+{
+        return strcmp(*(const char * const *)stored,
+                        *(const char * const *)key);
+}
+
+int str_copy(void * dest, void * src)
+{
+        *(void **)dest = *(void **)src;
+        return 0;
+}
+
+int str_comp(void * p, void * q)
+{
+        return strcmp((const char *)p, (const char *)q);
+}
+
+int str_free(void * p)
+{
+        (void)p;
+        return 0;
+}
+
+static unsigned int next_rand(unsigned int * x)
+{
+        *x ^= *x << 13;
+        *x ^= *x >> 17;
+        *x ^= *x << 5;
+        return *x;
+}
+
+double seconds(struct timespec * start)
+{
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        return (end.tv_sec - start->tv_sec) +
+                (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Times inserting and finding keys[] in each structure */
+void run(const char * name, char ** keys, int n, const int * probe)
+{
+        struct timespec start;
+        long hits;
+
+        TRIE * trie = make_trie();
+        assert(trie);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < n; ++i)
+                add_word_trie(trie, keys[i]);
+        double insert = seconds(&start);
+        hits = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < n; ++i)
+                hits += search_trie(trie, keys[probe[i]]);
+        double find = seconds(&start);
+        assert(hits == n);
+        printf("%-6s %9d  trie     %10.1f %10.1f   %5.1f bytes/key\n", name,
+                        n, insert * 1e9 / n, find * 1e9 / n,
+                        (double)trie->bytes / trie->size);
+        free_trie(trie);
+
+        struct hamtinfo hinfo = {
+                .key_size = sizeof(char *),
+                .elem_size = sizeof(int),
+                .hash = hash_str_ref,
+                .cmp_key = cmp_str_ref,
+                .rehash = rehash_str_ref,
+        };
+        HAMT * h = init_hamt(&hinfo);
+        assert(h);
+        int one = 1;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < n; ++i)
+                insert_hamt(h, &keys[i], &one);
+        insert = seconds(&start);
+        hits = 0;
+        int out;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < n; ++i)
+                hits += find_hamt(h, &keys[probe[i]], (void **)&out);
+        find = seconds(&start);
+        assert(hits == n);
+        printf("%-6s %9d  hamt     %10.1f %10.1f\n", name, n,
+                        insert * 1e9 / n, find * 1e9 / n);
+        free_hamt(h);
+
+        struct rbtreeinfo rinfo = { str_copy, str_comp, str_free, NULL };
+        RBTREE * rb = rb_init(&rinfo);
+        assert(rb);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < n; ++i)
+                rb_insert(rb, keys[i], NULL);
+        insert = seconds(&start);
+        hits = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < n; ++i)
+                hits += rb_has(rb, keys[probe[i]]);
+        find = seconds(&start);
+        assert(hits == n);
+        printf("%-6s %9d  rbtree   %10.1f %10.1f\n", name, n,
+                        insert * 1e9 / n, find * 1e9 / n);
+        rb_free(rb);
+}
+
+int main(int argc, char ** argv)
+{
+        int max = argc > 1 ? atoi(argv[1]) : 1000000;
+        char ** words = malloc(max * sizeof(*words));
+        char ** urls = malloc(max * sizeof(*urls));
+        int * probe = malloc(max * sizeof(*probe));
+        assert(words && urls && probe);
+
+        unsigned int x = 2463534242u;
+        char buf[96];
+        for (int i = 0; i < max; ++i) {
+                int len = 1 + next_rand(&x) % 12;
+                for (int j = 0; j < len; ++j)
+                        buf[j] = 'a' + next_rand(&x) % 26;
+                buf[len] = '\0';
+                words[i] = strdup(buf);
+
+                /* i is in every URL, so they are distinct */
+                snprintf(buf, sizeof(buf),
+                                "https://www.site%u.example.com/%s/%u/item%d",
+                                next_rand(&x) % 64, i % 3 ? "docs" : "images",
+                                next_rand(&x) % 1000, i);
+                urls[i] = strdup(buf);
+                assert(words[i] && urls[i]);
+        }
+
+        printf("keys   %9s  %-8s %10s %10s  (ns per key)\n", "n", "",
+                        "insert", "find");
+        for (int n = 1000; n <= max; n *= 10) {
+                for (int i = 0; i < n; ++i)
+                        probe[i] = i;
+                for (int i = n - 1; i > 0; --i) {
+                        int j = next_rand(&x) % (i + 1);
+                        int t = probe[i];
+                        probe[i] = probe[j];
+                        probe[j] = t;
+                }
+                run("words", words, n, probe);
+                run("urls", urls, n, probe);
+        }
+
+        for (int i = 0; i < max; ++i) {
+                free(words[i]);
+                free(urls[i]);
+        }
+        free(words);
+        free(urls);
+        free(probe);
+        return 0;
+}
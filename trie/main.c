@@ -1,8 +1,14 @@
 #include "trie.h"
+#include <assert.h>
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define DICTSZ 2
 #define DICTSZ2 3
+#define NWORDS 200000
+#define NKEYS 3000
 const char * dict[DICTSZ] = {
         "hello",
         "world"
@@ -13,15 +19,232 @@ const char * dict2[DICTSZ2] = {
         "buddabing"
 };
 
+/* Writes a random lowercase word of 1 to 12 letters into buf */
+void random_word(char * buf, unsigned int * seed);
+/* Builds a dictionary of random words and checks every lookup */
+int test_dictionary(int n);
+/* Checks keys of arbitrary bytes, and nodes growing through every type */
+int test_bytes(void);
+
+/* A key for test_changes */
+struct key {
+        uint8_t bytes[40];
+        size_t len;
+};
+int key_order(const void * p, const void * q);
+/* Collects the keys trie_iterate visits into a struct visit */
+struct visit {
+        struct key * keys;
+        void ** values;
+        int n;
+};
+int visit_key(const void * key, size_t len, void * value, void * arg);
+/* Compares the trie with the keys marked present */
+void check_trie(TRIE * trie, struct key * keys, const int * present, int n);
+/* Random puts and removes of keys that share long prefixes or are prefixes
+ * of each other, checked against an array */
+int test_changes(int rounds);
+
 int main(void)
 {
         TRIE * trie = make_trie();
         for (int i = 0; i < DICTSZ; ++i)
                 add_word_trie(trie, dict[i]);
-        
+
         for (int i = 0; i < DICTSZ2; ++i)
                 printf("Trie contains %s? %s\n", dict2[i],
                                 search_trie(trie, dict2[i]) ? "Yes" : "No");
 
+        assert(search_trie(trie, "hell") == 0 && search_trie(trie, "") == 0);
+        assert(add_word_trie(trie, "Hello, World!") == 0);
+        assert(search_trie(trie, "Hello, World!") == 1);
+        assert(search_trie(trie, "Hello") == 0 && search_trie(trie, "hello"));
+        assert(add_word_trie(trie, NULL) == -1 && errno == EINVAL);
+        free_trie(trie);
+
+        test_bytes();
+        test_changes(20);
+        test_dictionary(NWORDS);
+        return 0;
+}
+
+void random_word(char * buf, unsigned int * seed)
+{
+        int len = 1 + rand_r(seed) % 12;
+        for (int i = 0; i < len; ++i)
+                buf[i] = 'a' + rand_r(seed) % 26;
+        buf[len] = '\0';
+}
+
+int test_dictionary(int n)
+{
+        TRIE * trie = make_trie();
+        assert(trie != NULL);
+
+        char word[16];
+        unsigned int seed = 1;
+        for (int i = 0; i < n; ++i) {
+                random_word(word, &seed);
+                assert(add_word_trie(trie, word) == 0);
+        }
+
+        /* Replay the same words */
+        seed = 1;
+        for (int i = 0; i < n; ++i) {
+                random_word(word, &seed);
+                assert(search_trie(trie, word) == 1);
+        }
+
+        assert(trie->size <= (size_t)n);
+        printf("%d words: %zu keys, %zu/%zu/%zu/%zu Node4/16/48/256, "
+                        "%zu bytes (%.1f per key)\n", n, trie->size,
+                        trie->nodes[0], trie->nodes[1], trie->nodes[2],
+                        trie->nodes[3], trie->bytes,
+                        (double)trie->bytes / trie->size);
+        free_trie(trie);
+        return 0;
+}
+
+int test_bytes(void)
+{
+        TRIE * trie = make_trie();
+        assert(trie != NULL);
+
+        /* The empty key, and keys through the root's Node4, 16, 48, 256 */
+        assert(trie_search(trie, "", 0) == 0);
+        assert(trie_insert(trie, "", 0) == 0 && trie_search(trie, NULL, 0));
+        uint8_t key[3];
+        for (int b = 0; b < 256; ++b) {
+                key[0] = 255 - b;
+                assert(trie_insert(trie, key, 1) == 0);
+                for (int c = 0; c < 256; ++c) {
+                        key[0] = c;
+                        assert(trie_search(trie, key, 1) == (c >= 255 - b));
+                }
+        }
+        assert(trie->root->type == TRIE_NODE256 && trie->root->count == 256);
+
+        /* Zero bytes inside keys, and keys that are prefixes of others */
+        for (int b = 0; b < 256; b += 3) {
+                key[0] = 0, key[1] = b, key[2] = 0;
+                assert(trie_insert(trie, key, 3) == 0);
+        }
+        for (int b = 0; b < 256; ++b) {
+                key[0] = 0, key[1] = b, key[2] = 0;
+                assert(trie_search(trie, key, 3) == (b % 3 == 0));
+                assert(trie_search(trie, key, 2) == 0);
+        }
+        assert(trie_insert(trie, NULL, 1) == -1 && errno == EINVAL);
+        free_trie(trie);
+        return 0;
+}
+
+int key_order(const void * p, const void * q)
+{
+        const struct key * a = p, * b = q;
+        int c = memcmp(a->bytes, b->bytes, a->len < b->len ? a->len : b->len);
+        if (c != 0)
+                return c;
+        return (a->len > b->len) - (a->len < b->len);
+}
+
+int visit_key(const void * key, size_t len, void * value, void * arg)
+{
+        struct visit * v = arg;
+        assert(len <= sizeof(v->keys[0].bytes));
+        memcpy(v->keys[v->n].bytes, key, len);
+        v->keys[v->n].len = len;
+        v->values[v->n++] = value;
+        return 0;
+}
+
+void check_trie(TRIE * trie, struct key * keys, const int * present, int n)
+{
+        size_t size = 0;
+        for (int i = 0; i < n; ++i) {
+                void ** value = trie_get(trie, keys[i].bytes, keys[i].len);
+                assert((value != NULL) == present[i]);
+                assert(value == NULL || *value == &keys[i]);
+                size += present[i];
+        }
+        assert(trie->size == size);
+
+        /* Keys are sorted, so iteration visits the present ones in turn */
+        struct visit v = { malloc(n * sizeof(struct key)),
+                malloc(n * sizeof(void *)), 0 };
+        assert(v.keys && v.values);
+        assert(trie_iterate(trie, visit_key, &v) == 0);
+        assert((size_t)v.n == size);
+        for (int i = 0, j = 0; i < n; ++i) {
+                if (!present[i])
+                        continue;
+                assert(key_order(&v.keys[j], &keys[i]) == 0);
+                assert(v.values[j++] == &keys[i]);
+        }
+        free(v.keys);
+        free(v.values);
+}
+
+int test_changes(int rounds)
+{
+        /* Prefixes longer than TRIE_PREFIX, and tails over a few bytes
+         * (with one group taking every byte, for Node48 and Node256) */
+        static const char * stems[] = {
+                "", "a", "https://example.com/", "https://example.com/a/b/",
+                "https://example.org/"
+        };
+        static const uint8_t tail[] = { 0, 1, 'a', 'b', 255 };
+        struct key * keys = malloc(NKEYS * sizeof(*keys));
+        int * present = calloc(NKEYS, sizeof(*present));
+        assert(keys && present);
+        unsigned int seed = 7;
+        for (int i = 0; i < NKEYS; ++i) {
+                const char * stem = stems[rand_r(&seed) % 5];
+                keys[i].len = strlen(stem);
+                memcpy(keys[i].bytes, stem, keys[i].len);
+                if (i < 256)
+                        keys[i].bytes[keys[i].len++] = i;
+                for (int t = rand_r(&seed) % 9; t > 0; --t)
+                        keys[i].bytes[keys[i].len++] =
+                                tail[rand_r(&seed) % 5];
+        }
+        qsort(keys, NKEYS, sizeof(*keys), key_order);
+        int n = 0;
+        for (int i = 0; i < NKEYS; ++i)
+                if (n == 0 || key_order(&keys[n - 1], &keys[i]) != 0)
+                        keys[n++] = keys[i];
+
+        TRIE * trie = make_trie();
+        assert(trie != NULL);
+        for (int r = 0; r < rounds; ++r) {
+                /* Early rounds mostly put, later ones mostly remove */
+                int puts = 90 - 80 * r / (rounds > 1 ? rounds - 1 : 1);
+                for (int k = 0; k < n; ++k) {
+                        int i = rand_r(&seed) % n;
+                        struct key * key = &keys[i];
+                        if (rand_r(&seed) % 100 < puts) {
+                                assert(trie_put(trie, key->bytes, key->len,
+                                                        key) == !present[i]);
+                                present[i] = 1;
+                        }
+                        else {
+                                assert(trie_remove(trie, key->bytes,
+                                                        key->len) == present[i]);
+                                present[i] = 0;
+                        }
+                }
+                check_trie(trie, keys, present, n);
+        }
 
+        /* Emptied, the trie holds nothing */
+        for (int i = 0; i < n; ++i)
+                assert(trie_remove(trie, keys[i].bytes, keys[i].len) ==
+                                present[i]);
+        assert(trie->root == NULL && trie->size == 0 && trie->bytes == 0);
+        for (int t = 0; t < 4; ++t)
+                assert(trie->nodes[t] == 0);
+        free_trie(trie);
+        free(keys);
+        free(present);
+        return 0;
 }
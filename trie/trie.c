@@ -1,60 +1,707 @@
 #include "trie.h"
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-/* Make a trie to for an alphabet of size width at depth dpeth*/
+/* Child pointers to leaves have the low bit set */
+#define is_leaf(p) ((uintptr_t)(p) & 1)
+#define as_leaf(p) ((struct trie_leaf *)((uintptr_t)(p) - 1))
+#define tag_leaf(l) ((struct trie_node *)((uintptr_t)(l) + 1))
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+/* Children each node type holds */
+static const int _capacity[4] = { 4, 16, 48, 256 };
+/* A node with this many children or fewer is replaced by a smaller type
+ * (leaving room to add a few before it would grow again) */
+static const int _shrink_at[4] = { 0, 3, 12, 40 };
+/* Bytes in each node type */
+static const size_t _size[4] = {
+        sizeof(struct trie_node4), sizeof(struct trie_node16),
+        sizeof(struct trie_node48), sizeof(struct trie_node256)
+};
+
+/* Makes an empty node of the given type */
+/* On failure, returns NULL (sets ERRNO) */
+static struct trie_node * _make_node(TRIE * trie, int type);
+static void _drop_node(TRIE * trie, struct trie_node * node);
+
+/* Makes a leaf holding a copy of the len bytes at key */
 /* On failure, returns NULL (sets ERRNO) */
-static TRIE * _make_trie(int depth);
+static struct trie_leaf * _make_leaf(TRIE * trie, const uint8_t * key,
+                size_t len, void * value);
+static void _drop_leaf(TRIE * trie, struct trie_leaf * leaf);
+
+/* Tells whether leaf holds the len bytes at key */
+static int _leaf_matches(const struct trie_leaf * leaf, const uint8_t * key,
+                size_t len);
+
+/* Returns the slot holding node's child for byte, or NULL if it has none */
+static struct trie_node ** _find_child(struct trie_node * node, uint8_t byte);
+
+/* Returns the slot of node's child for the smallest byte, and the byte */
+static struct trie_node ** _first_child(struct trie_node * node,
+                uint8_t * byte);
+
+/* Returns a leaf below node: its key holds the whole path through node */
+static struct trie_leaf * _any_leaf(struct trie_node * node);
+
+/* Number of bytes of node's prefix that match the key from depth */
+static size_t _prefix_match(struct trie_node * node, const uint8_t * key,
+                size_t len, size_t depth);
+
+/* Replaces the node at *link with one of the given type */
+/* On failure, returns -1 (sets ERRNO) and leaves the node as it was */
+static int _resize(TRIE * trie, struct trie_node ** link, int type);
+
+/* Gives the node at *link the child for byte, growing the node if full */
+/* On success returns 0.  On failure, returns -1 (sets ERRNO) */
+static int _add_child(TRIE * trie, struct trie_node ** link, uint8_t byte,
+                struct trie_node * child);
+
+/* Takes the child for byte from node */
+static void _remove_child(struct trie_node * node, uint8_t byte);
+
+/* Inserts (byte, child) into the count sorted pairs of a Node4 or Node16 */
+static void _add_sorted(uint8_t * keys, struct trie_node ** children,
+                int count, uint8_t byte, struct trie_node * child);
+
+/* Restores the shape of the node at *link after it lost a child or leaf:
+ * folds it into its parent's slot if it has one thing left, else shrinks
+ * it if it has become sparse */
+static void _tidy(TRIE * trie, struct trie_node ** link);
+
+static void _free_node(TRIE * trie, struct trie_node * node);
+static int _iterate(struct trie_node * node, int (*cb)(const void * key,
+                        size_t len, void * value, void * arg), void * arg);
 
 
 TRIE * make_trie(void)
 {
-        return _make_trie(0);
+        return calloc(1, sizeof(TRIE));
+}
+
+void free_trie(TRIE * trie)
+{
+        if (trie == NULL)
+                return;
+        if (trie->root != NULL)
+                _free_node(trie, trie->root);
+        free(trie);
 }
 
+static struct trie_node * _make_node(TRIE * trie, int type)
+{
+        struct trie_node * rv = calloc(1, _size[type]);
+        if (rv == NULL)
+                return rv;
+
+        rv->type = type;
+        trie->nodes[type] += 1;
+        trie->bytes += _size[type];
+        return rv;
+}
+
+static void _drop_node(TRIE * trie, struct trie_node * node)
+{
+        trie->nodes[node->type] -= 1;
+        trie->bytes -= _size[node->type];
+        free(node);
+}
 
-static TRIE * _make_trie(int depth)
+static struct trie_leaf * _make_leaf(TRIE * trie, const uint8_t * key,
+                size_t len, void * value)
 {
-        TRIE * rv = calloc(1, sizeof(*rv));
+        struct trie_leaf * rv = malloc(sizeof(*rv) + len);
         if (rv == NULL)
                 return rv;
 
-        rv->depth = depth;
+        rv->value = value;
+        rv->len = len;
+        if (len > 0)
+                memcpy(rv->key, key, len);
+        trie->bytes += sizeof(*rv) + len;
         return rv;
 }
 
-int add_word_trie(TRIE * trie, const char * word)
+static void _drop_leaf(TRIE * trie, struct trie_leaf * leaf)
 {
-        if (trie == NULL) {
-                errno = EINVAL;
+        trie->bytes -= sizeof(*leaf) + leaf->len;
+        free(leaf);
+}
+
+static void _free_node(TRIE * trie, struct trie_node * node)
+{
+        if (is_leaf(node)) {
+                _drop_leaf(trie, as_leaf(node));
+                return;
+        }
+        if (node->leaf != NULL)
+                _drop_leaf(trie, node->leaf);
+        for (int b = 0; node->count > 0 && b < 256; ++b) {
+                struct trie_node ** child = _find_child(node, b);
+                if (child != NULL)
+                        _free_node(trie, *child);
+        }
+        _drop_node(trie, node);
+}
+
+static int _leaf_matches(const struct trie_leaf * leaf, const uint8_t * key,
+                size_t len)
+{
+        return leaf->len == len && (len == 0 || memcmp(leaf->key, key, len) == 0);
+}
+
+static struct trie_node ** _find_child(struct trie_node * node, uint8_t byte)
+{
+        switch (node->type) {
+        case TRIE_NODE4: {
+                struct trie_node4 * n = (struct trie_node4 *)node;
+                for (int i = 0; i < node->count; ++i)
+                        if (n->keys[i] == byte)
+                                return &n->children[i];
+                return NULL;
+        }
+        case TRIE_NODE16: {
+                struct trie_node16 * n = (struct trie_node16 *)node;
+#ifdef __SSE2__
+                /* Compare the byte with all 16 keys at once */
+                __m128i hits = _mm_cmpeq_epi8(_mm_set1_epi8((char)byte),
+                                _mm_loadu_si128((const __m128i *)n->keys));
+                unsigned int mask = _mm_movemask_epi8(hits) &
+                        ((1u << node->count) - 1);
+                return mask ? &n->children[__builtin_ctz(mask)] : NULL;
+#else
+                for (int i = 0; i < node->count; ++i)
+                        if (n->keys[i] == byte)
+                                return &n->children[i];
+                return NULL;
+#endif
+        }
+        case TRIE_NODE48: {
+                struct trie_node48 * n = (struct trie_node48 *)node;
+                return n->index[byte] ? &n->children[n->index[byte] - 1] : NULL;
+        }
+        default: {
+                struct trie_node256 * n = (struct trie_node256 *)node;
+                return n->children[byte] ? &n->children[byte] : NULL;
+        }
+        }
+}
+
+static struct trie_node ** _first_child(struct trie_node * node,
+                uint8_t * byte)
+{
+        switch (node->type) {
+        case TRIE_NODE4: {
+                struct trie_node4 * n = (struct trie_node4 *)node;
+                *byte = n->keys[0];
+                return &n->children[0];
+        }
+        case TRIE_NODE16: {
+                struct trie_node16 * n = (struct trie_node16 *)node;
+                *byte = n->keys[0];
+                return &n->children[0];
+        }
+        default:
+                for (int b = 0; ; ++b) {
+                        struct trie_node ** child = _find_child(node, b);
+                        if (child != NULL) {
+                                *byte = b;
+                                return child;
+                        }
+                }
+        }
+}
+
+static struct trie_leaf * _any_leaf(struct trie_node * node)
+{
+        uint8_t byte;
+        while (!is_leaf(node)) {
+                if (node->leaf != NULL)
+                        return node->leaf;
+                node = *_first_child(node, &byte);
+        }
+        return as_leaf(node);
+}
+
+static size_t _prefix_match(struct trie_node * node, const uint8_t * key,
+                size_t len, size_t depth)
+{
+        size_t max = min(node->prefix_len, len - depth);
+        size_t i = 0;
+        for (; i < min(max, TRIE_PREFIX); ++i)
+                if (node->prefix[i] != key[depth + i])
+                        return i;
+        if (i == max)
+                return i;
+
+        /* Only the first bytes are kept: read the rest from a leaf */
+        const uint8_t * path = _any_leaf(node)->key + depth;
+        for (; i < max; ++i)
+                if (path[i] != key[depth + i])
+                        return i;
+        return i;
+}
+
+static int _resize(TRIE * trie, struct trie_node ** link, int type)
+{
+        struct trie_node * old = *link;
+        struct trie_node * rv = _make_node(trie, type);
+        if (rv == NULL)
                 return -1;
+        rv->count = old->count;
+        rv->prefix_len = old->prefix_len;
+        memcpy(rv->prefix, old->prefix, sizeof(rv->prefix));
+        rv->leaf = old->leaf;
+
+        if (old->type <= TRIE_NODE16 && type <= TRIE_NODE16) {
+                /* Node4 <-> Node16: the sorted pairs are copied as is */
+                uint8_t * from_keys = old->type == TRIE_NODE4 ?
+                        ((struct trie_node4 *)old)->keys :
+                        ((struct trie_node16 *)old)->keys;
+                struct trie_node ** from = old->type == TRIE_NODE4 ?
+                        ((struct trie_node4 *)old)->children :
+                        ((struct trie_node16 *)old)->children;
+                uint8_t * keys = type == TRIE_NODE4 ?
+                        ((struct trie_node4 *)rv)->keys :
+                        ((struct trie_node16 *)rv)->keys;
+                struct trie_node ** children = type == TRIE_NODE4 ?
+                        ((struct trie_node4 *)rv)->children :
+                        ((struct trie_node16 *)rv)->children;
+                memcpy(keys, from_keys, old->count);
+                memcpy(children, from, old->count * sizeof(*children));
+        }
+        else {
+                /* Otherwise visit the children in byte order */
+                int i = 0;
+                for (int b = 0; b < 256 && i < old->count; ++b) {
+                        struct trie_node ** child = _find_child(old, b);
+                        if (child == NULL)
+                                continue;
+                        switch (type) {
+                        case TRIE_NODE16:
+                                ((struct trie_node16 *)rv)->keys[i] = b;
+                                ((struct trie_node16 *)rv)->children[i] =
+                                        *child;
+                                break;
+                        case TRIE_NODE48:
+                                ((struct trie_node48 *)rv)->index[b] = i + 1;
+                                ((struct trie_node48 *)rv)->children[i] =
+                                        *child;
+                                break;
+                        default:
+                                ((struct trie_node256 *)rv)->children[b] =
+                                        *child;
+                                break;
+                        }
+                        ++i;
+                }
         }
 
-        if (word[0] == '\0') {
-                trie->in_dict = IN_TRIE;
-                return 0;
+        _drop_node(trie, old);
+        *link = rv;
+        return 0;
+}
+
+static void _add_sorted(uint8_t * keys, struct trie_node ** children,
+                int count, uint8_t byte, struct trie_node * child)
+{
+        int at = count;
+        for (; at > 0 && keys[at - 1] > byte; --at) {
+                keys[at] = keys[at - 1];
+                children[at] = children[at - 1];
+        }
+        keys[at] = byte;
+        children[at] = child;
+}
+
+static int _add_child(TRIE * trie, struct trie_node ** link, uint8_t byte,
+                struct trie_node * child)
+{
+        if ((*link)->count == _capacity[(*link)->type] &&
+                        _resize(trie, link, (*link)->type + 1) == -1)
+                return -1;
+
+        struct trie_node * node = *link;
+        int count = node->count++;
+        switch (node->type) {
+        case TRIE_NODE4: {
+                struct trie_node4 * n = (struct trie_node4 *)node;
+                _add_sorted(n->keys, n->children, count, byte, child);
+                break;
+        }
+        case TRIE_NODE16: {
+                struct trie_node16 * n = (struct trie_node16 *)node;
+                _add_sorted(n->keys, n->children, count, byte, child);
+                break;
+        }
+        case TRIE_NODE48: {
+                /* The slots in use are always the first count */
+                struct trie_node48 * n = (struct trie_node48 *)node;
+                n->index[byte] = count + 1;
+                n->children[count] = child;
+                break;
+        }
+        default:
+                ((struct trie_node256 *)node)->children[byte] = child;
+                break;
+        }
+        return 0;
+}
+
+static void _remove_child(struct trie_node * node, uint8_t byte)
+{
+        struct trie_node ** slot = _find_child(node, byte);
+        int count = --node->count;
+        switch (node->type) {
+        case TRIE_NODE4:
+        case TRIE_NODE16: {
+                uint8_t * keys = node->type == TRIE_NODE4 ?
+                        ((struct trie_node4 *)node)->keys :
+                        ((struct trie_node16 *)node)->keys;
+                struct trie_node ** children = node->type == TRIE_NODE4 ?
+                        ((struct trie_node4 *)node)->children :
+                        ((struct trie_node16 *)node)->children;
+                int at = slot - children;
+                memmove(&keys[at], &keys[at + 1], count - at);
+                memmove(&children[at], &children[at + 1],
+                                (count - at) * sizeof(*children));
+                break;
+        }
+        case TRIE_NODE48: {
+                /* Move the last slot into the freed one */
+                struct trie_node48 * n = (struct trie_node48 *)node;
+                int at = slot - n->children;
+                n->index[byte] = 0;
+                if (at != count) {
+                        for (int b = 0; b < 256; ++b)
+                                if (n->index[b] == count + 1)
+                                        n->index[b] = at + 1;
+                        n->children[at] = n->children[count];
+                }
+                n->children[count] = NULL;
+                break;
+        }
+        default:
+                ((struct trie_node256 *)node)->children[byte] = NULL;
+                break;
+        }
+}
+
+static void _tidy(TRIE * trie, struct trie_node ** link)
+{
+        struct trie_node * node = *link;
+        if (node->count == 0) {
+                /* Only its own key is left: a leaf can stand in its place */
+                *link = tag_leaf(node->leaf);
+                _drop_node(trie, node);
+                return;
         }
+        if (node->count == 1 && node->leaf == NULL) {
+                /* Fold the node into its only child */
+                uint8_t byte;
+                struct trie_node * child = *_first_child(node, &byte);
+                if (!is_leaf(child)) {
+                        uint8_t prefix[TRIE_PREFIX];
+                        size_t n = min(node->prefix_len, TRIE_PREFIX);
+                        memcpy(prefix, node->prefix, n);
+                        if (n < TRIE_PREFIX)
+                                prefix[n++] = byte;
+                        size_t more = min(child->prefix_len, TRIE_PREFIX - n);
+                        memcpy(prefix + n, child->prefix, more);
+                        memcpy(child->prefix, prefix, n + more);
+                        child->prefix_len += node->prefix_len + 1;
+                }
+                *link = child;
+                _drop_node(trie, node);
+                return;
+        }
+        if (node->count <= _shrink_at[node->type])
+                _resize(trie, link, node->type - 1);
+}
+
+static int _iterate(struct trie_node * node, int (*cb)(const void * key,
+                        size_t len, void * value, void * arg), void * arg)
+{
+        if (is_leaf(node)) {
+                struct trie_leaf * leaf = as_leaf(node);
+                return cb(leaf->key, leaf->len, leaf->value, arg);
+        }
+
+        int rv = 0;
+        if (node->leaf != NULL)
+                rv = cb(node->leaf->key, node->leaf->len, node->leaf->value,
+                                arg);
+        if (node->type <= TRIE_NODE16) {
+                struct trie_node ** children = node->type == TRIE_NODE4 ?
+                        ((struct trie_node4 *)node)->children :
+                        ((struct trie_node16 *)node)->children;
+                for (int i = 0; rv == 0 && i < node->count; ++i)
+                        rv = _iterate(children[i], cb, arg);
+                return rv;
+        }
+        for (int b = 0; rv == 0 && b < 256; ++b) {
+                struct trie_node ** child = _find_child(node, b);
+                if (child != NULL)
+                        rv = _iterate(*child, cb, arg);
+        }
+        return rv;
+}
+
+int trie_put(TRIE * trie, const void * key, size_t len, void * value)
+{
+        if (trie == NULL || (key == NULL && len > 0)) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        const uint8_t * p = key;
+        struct trie_node ** link = &trie->root;
+        size_t depth = 0;
+        for (;;) {
+                struct trie_node * node = *link;
+                if (node == NULL) {
+                        struct trie_leaf * leaf = _make_leaf(trie, p, len,
+                                        value);
+                        if (leaf == NULL)
+                                return -1;
+                        *link = tag_leaf(leaf);
+                        break;
+                }
+
+                if (is_leaf(node)) {
+                        struct trie_leaf * old = as_leaf(node);
+                        if (_leaf_matches(old, p, len)) {
+                                old->value = value;
+                                return 0;
+                        }
 
-        int idx = word[0] - 'a';
+                        /* Split the leaf: a node for the path both keys
+                         * share, holding each where they part */
+                        size_t end = depth, limit = min(old->len, len);
+                        while (end < limit && old->key[end] == p[end])
+                                ++end;
+                        struct trie_node * n = _make_node(trie, TRIE_NODE4);
+                        struct trie_leaf * leaf = _make_leaf(trie, p, len,
+                                        value);
+                        if (n == NULL || leaf == NULL) {
+                                if (n != NULL)
+                                        _drop_node(trie, n);
+                                if (leaf != NULL)
+                                        _drop_leaf(trie, leaf);
+                                return -1;
+                        }
+                        n->prefix_len = end - depth;
+                        memcpy(n->prefix, p + depth,
+                                        min(n->prefix_len, TRIE_PREFIX));
+                        if (old->len == end)
+                                n->leaf = old;
+                        else
+                                _add_child(trie, &n, old->key[end], node);
+                        if (len == end)
+                                n->leaf = leaf;
+                        else
+                                _add_child(trie, &n, p[end], tag_leaf(leaf));
+                        *link = n;
+                        break;
+                }
 
-        if (trie->children[idx] == NULL) {
-                trie->children[idx] = _make_trie(trie->depth + 1);
-                if (trie->children[idx] == NULL)
+                if (node->prefix_len > 0) {
+                        size_t match = _prefix_match(node, p, len, depth);
+                        if (match < node->prefix_len) {
+                                /* Split the prefix where the key leaves it */
+                                struct trie_node * n = _make_node(trie,
+                                                TRIE_NODE4);
+                                struct trie_leaf * leaf = _make_leaf(trie, p,
+                                                len, value);
+                                if (n == NULL || leaf == NULL) {
+                                        if (n != NULL)
+                                                _drop_node(trie, n);
+                                        if (leaf != NULL)
+                                                _drop_leaf(trie, leaf);
+                                        return -1;
+                                }
+                                n->prefix_len = match;
+                                memcpy(n->prefix, node->prefix,
+                                                min(match, TRIE_PREFIX));
+
+                                /* node keeps what follows its byte in n */
+                                uint8_t byte;
+                                size_t rest = node->prefix_len - match - 1;
+                                if (node->prefix_len <= TRIE_PREFIX) {
+                                        byte = node->prefix[match];
+                                        memmove(node->prefix,
+                                                        node->prefix + match + 1,
+                                                        rest);
+                                }
+                                else {
+                                        const uint8_t * path =
+                                                _any_leaf(node)->key + depth;
+                                        byte = path[match];
+                                        memcpy(node->prefix, path + match + 1,
+                                                        min(rest, TRIE_PREFIX));
+                                }
+                                node->prefix_len = rest;
+
+                                _add_child(trie, &n, byte, node);
+                                if (len == depth + match)
+                                        n->leaf = leaf;
+                                else
+                                        _add_child(trie, &n, p[depth + match],
+                                                        tag_leaf(leaf));
+                                *link = n;
+                                break;
+                        }
+                        depth += node->prefix_len;
+                }
+
+                if (depth == len) {
+                        if (node->leaf != NULL) {
+                                node->leaf->value = value;
+                                return 0;
+                        }
+                        node->leaf = _make_leaf(trie, p, len, value);
+                        if (node->leaf == NULL)
+                                return -1;
+                        break;
+                }
+
+                struct trie_node ** child = _find_child(node, p[depth]);
+                if (child != NULL) {
+                        link = child;
+                        ++depth;
+                        continue;
+                }
+                struct trie_leaf * leaf = _make_leaf(trie, p, len, value);
+                if (leaf == NULL)
+                        return -1;
+                if (_add_child(trie, link, p[depth], tag_leaf(leaf)) == -1) {
+                        _drop_leaf(trie, leaf);
                         return -1;
+                }
+                break;
         }
 
-        return add_word_trie(trie->children[idx], word+1);
+        trie->size += 1;
+        return 1;
 }
 
-int search_trie(TRIE * root, const char * word)
+void ** trie_get(TRIE * trie, const void * key, size_t len)
+{
+        if (trie == NULL || (key == NULL && len > 0))
+                return NULL;
+
+        /* Prefixes longer than TRIE_PREFIX are skipped in part: the whole
+         * key is compared with the leaf at the end */
+        const uint8_t * p = key;
+        struct trie_node * node = trie->root;
+        size_t depth = 0;
+        while (node != NULL && !is_leaf(node)) {
+                size_t plen = node->prefix_len;
+                if (plen > 0) {
+                        if (len - depth < plen)
+                                return NULL;
+                        for (size_t i = 0; i < min(plen, TRIE_PREFIX); ++i)
+                                if (node->prefix[i] != p[depth + i])
+                                        return NULL;
+                        depth += plen;
+                }
+                if (depth == len) {
+                        struct trie_leaf * leaf = node->leaf;
+                        return leaf != NULL && _leaf_matches(leaf, p, len) ?
+                                &leaf->value : NULL;
+                }
+                struct trie_node ** child = _find_child(node, p[depth++]);
+                node = child != NULL ? *child : NULL;
+        }
+        if (node == NULL || !_leaf_matches(as_leaf(node), p, len))
+                return NULL;
+        return &as_leaf(node)->value;
+}
+
+int trie_remove(TRIE * trie, const void * key, size_t len)
 {
-        if (NULL == root)
+        if (trie == NULL || (key == NULL && len > 0))
                 return 0;
 
-        if (word[0] == '\0')
-                return root->in_dict == IN_TRIE ? 1 : 0;
+        const uint8_t * p = key;
+        struct trie_node ** link = &trie->root;
+        struct trie_node ** parent = NULL;      /* Link to the node above */
+        uint8_t byte = 0;                       /* Its byte for *link */
+        size_t depth = 0;
+        struct trie_node * node;
+        while ((node = *link) != NULL && !is_leaf(node)) {
+                size_t plen = node->prefix_len;
+                if (plen > 0) {
+                        if (len - depth < plen ||
+                                        _prefix_match(node, p, len, depth) < plen)
+                                return 0;
+                        depth += plen;
+                }
+                if (depth == len) {
+                        /* The key ends at this node */
+                        struct trie_leaf * leaf = node->leaf;
+                        if (leaf == NULL)
+                                return 0;
+                        node->leaf = NULL;
+                        _drop_leaf(trie, leaf);
+                        _tidy(trie, link);
+                        trie->size -= 1;
+                        return 1;
+                }
+                struct trie_node ** child = _find_child(node, p[depth]);
+                if (child == NULL)
+                        return 0;
+                parent = link;
+                byte = p[depth++];
+                link = child;
+        }
 
-        int idx = word[0] - 'a';
-        
-        return search_trie(root->children[idx], word+1);
+        if (node == NULL || !_leaf_matches(as_leaf(node), p, len))
+                return 0;
+        _drop_leaf(trie, as_leaf(node));
+        if (parent == NULL)
+                trie->root = NULL;
+        else {
+                _remove_child(*parent, byte);
+                _tidy(trie, parent);
+        }
+        trie->size -= 1;
+        return 1;
+}
+
+int trie_iterate(TRIE * trie, int (*cb)(const void * key, size_t len,
+                        void * value, void * arg), void * arg)
+{
+        if (trie == NULL || trie->root == NULL)
+                return 0;
+        return _iterate(trie->root, cb, arg);
+}
+
+int trie_insert(TRIE * trie, const void * key, size_t len)
+{
+        return trie_put(trie, key, len, NULL) == -1 ? -1 : 0;
+}
+
+int trie_search(TRIE * trie, const void * key, size_t len)
+{
+        return trie_get(trie, key, len) != NULL;
+}
+
+int add_word_trie(TRIE * trie, const char * word)
+{
+        if (word == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+        return trie_insert(trie, word, strlen(word));
+}
+
+int search_trie(TRIE * root, const char * word)
+{
+        return word != NULL && trie_search(root, word, strlen(word));
 }
@@ -1,26 +1,127 @@
 #ifndef _TRIE_H_
 #define _TRIE_H_
+#include <stddef.h>
+#include <stdint.h>
 
 #define IN_TRIE 1
 #define NOT_IN_TRIE 0
 
-typedef struct trie_node TRIE;
+/*
+ * An adaptive radix tree over byte strings.  Keys are looked up a byte per
+ * level, and each inner node is sized to the children it has:
+ *
+ *      Node4, Node16   up to 4 or 16 (byte, child) pairs, sorted by byte
+ *      Node48          a 256-entry index of slots into up to 48 children
+ *      Node256         a child pointer for every byte
+ *
+ * A node that fills up is replaced by one of the next larger type, and one
+ * left with few children by one of the next smaller.  Every node type
+ * begins with struct trie_node, whose 'type' tells them apart.
+ *
+ * Paths are compressed: a key is stored in a leaf (holding the whole key and
+ * its value) as soon as no other key shares its path, and a chain of nodes
+ * with a single child is folded into the 'prefix' of the node below it.  Only
+ * the first TRIE_PREFIX bytes of a longer prefix are kept; lookups skip the
+ * rest and compare the whole key once they reach a leaf.  A key that ends
+ * where others go on is the 'leaf' of the node at which it ends.
+ *
+ * Child pointers with the low bit set point at leaves (see struct
+ * trie_leaf), all others at inner nodes.  As nodes are replaced, the trie
+ * holds the pointer to the root and each node is reached through the one
+ * slot pointing at it.
+ */
+#define TRIE_PREFIX 8
+
+enum trie_type { TRIE_NODE4, TRIE_NODE16, TRIE_NODE48, TRIE_NODE256 };
+
+struct trie_leaf {
+        void * value;
+        size_t len;
+        uint8_t key[];
+};
+
 struct trie_node {
-        struct trie_node * children[26];    /* Children array */
-        int depth;                        /* Node dpeth */
-        int in_dict;                      /* Is a terminal node (not leaf) */
+        uint8_t type;                     /* enum trie_type */
+        uint16_t count;                   /* Children (leaves and nodes) */
+        uint32_t prefix_len;              /* Bytes of the compressed path */
+        uint8_t prefix[TRIE_PREFIX];      /* Its first bytes */
+        struct trie_leaf * leaf;          /* Key ending here, or NULL */
+};
+
+struct trie_node4 {
+        struct trie_node n;
+        uint8_t keys[4];
+        struct trie_node * children[4];
+};
+
+struct trie_node16 {
+        struct trie_node n;
+        uint8_t keys[16];
+        struct trie_node * children[16];
+};
+
+struct trie_node48 {
+        struct trie_node n;
+        uint8_t index[256];               /* Slot + 1 of each byte's child,
+                                             or 0 if it has none */
+        struct trie_node * children[48];
+};
+
+struct trie_node256 {
+        struct trie_node n;
+        struct trie_node * children[256];
+};
+
+typedef struct trie TRIE;
+struct trie {
+        struct trie_node * root;          /* Tagged as a child pointer, or
+                                             NULL if the trie is empty */
+        size_t size;                      /* Keys */
+        size_t nodes[4];                  /* Inner nodes of each type */
+        size_t bytes;                     /* Bytes held by nodes and leaves */
 };
 
 /* Make a trie */
 /* On failure, returns NULL (sets ERRNO) */
 TRIE * make_trie(void);
 
-/* Inserts word into trie */
+/* Frees a trie, its nodes and its leaves (values belong to the caller) */
+void free_trie(TRIE * trie);
+
+/* Stores value with the len bytes at key, which may take any values */
+/* Returns 1 if the key is new, 0 if its value was replaced and -1 on failure
+ * (sets errno) */
+int trie_put(TRIE * trie, const void * key, size_t len, void * value);
+
+/* Returns a borrowed pointer to the value stored with key (which may be
+ * written through), or NULL if key is not present.  The pointer stays valid
+ * until key is removed. */
+void ** trie_get(TRIE * trie, const void * key, size_t len);
+
+/* Removes key.  Returns 1 if it was present and 0 if not */
+int trie_remove(TRIE * trie, const void * key, size_t len);
+
+/* Calls cb with every key, its length, its value and arg, in key order
+ * (bytes compared as unsigned, a prefix before the keys it begins); stops
+ * early if cb returns nonzero.  cb must not modify the trie.  Returns 0 if
+ * every key was visited, else what cb returned. */
+int trie_iterate(TRIE * trie, int (*cb)(const void * key, size_t len,
+                        void * value, void * arg), void * arg);
+
+/* Inserts the len bytes at key into trie (with a NULL value) */
+/* On success returns 0.  On failure, returns -1, sets errno */
+int trie_insert(TRIE * trie, const void * key, size_t len);
+
+/* Searchs trie for the len bytes at key, in time proportional to len */
+/* If found, returns 1.  If not found, returns 0 */
+int trie_search(TRIE * trie, const void * key, size_t len);
+
+/* Inserts word, its bytes up to the NUL, into trie */
 /* On success returns 0.  On failure, returns -1, sets errno */
 int add_word_trie(TRIE * trie, const char * word);
 
 /* Searchs trie for word */
-/* If found, returns 1.  If not found, returns 0.  On error, returns errno */
+/* If found, returns 1.  If not found, returns 0 */
 int search_trie(TRIE * root, const char * word);
 
 #endif